@@ -11,25 +11,29 @@ $(top_srcdir)/src/5.3/opendkim.lua: $(top_srcdir)/src/opendkim.lua
 	$(MKDIR_P) $(@D)
 	$(INSTALL_DATA) $^ $@
 
+$(top_srcdir)/src/5.1/opendkim/ffi.lua: $(top_srcdir)/src/opendkim/ffi.lua
+	$(MKDIR_P) $(@D)
+	$(INSTALL_DATA) $^ $@
+
 $(top_srcdir)/src/opendkim-const.h:
 	$(RM) -f $@;
 	for prefix in DKIM_STAT_ DKIM_CBSTAT_ DKIM_SIGERROR_ DKIM_DNS_ \
 	              DKIM_CANON_ DKIM_SIGN_ DKIM_QUERY_ DKIM_PARAM_ \
 	              DKIM_MODE_ DKIM_OP_ DKIM_OPTS_ DKIM_LIBFLAGS_ \
-	              DKIM_DNSSEC_ DKIM_ATPS_; \
+	              DKIM_DNSSEC_ DKIM_ATPS_ DKIM_FEATURE_; \
 	do \
 		CPPFLAGS="$(CPPFLAGS)" $(top_srcdir)/mk/macros.ls -i "<opendkim/dkim.h>" -x -m "^$${prefix}" | awk '{ print "{ \""$$1"\", "$$1" }," }' >> $@; \
 	done
 
-$(top_srcdir)/src/5.1/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h
+$(top_srcdir)/src/5.1/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h $(top_srcdir)/src/opendkim-lua.h
 	$(MKDIR_P) $(@D)
 	$(CC) $(CFLAGS) $(LUA51_CPPFLAGS) $(CPPFLAGS) -DOPENDKIM_LUA_VERSION_NUM=501 -o $@ $< $(SOFLAGS) $(LDFLAGS) $(LIBS)
 
-$(top_srcdir)/src/5.2/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h
+$(top_srcdir)/src/5.2/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h $(top_srcdir)/src/opendkim-lua.h
 	$(MKDIR_P) $(@D)
 	$(CC) $(CFLAGS) $(LUA52_CPPFLAGS) $(CPPFLAGS) -DOPENDKIM_LUA_VERSION_NUM=502 -o $@ $< $(SOFLAGS) $(LDFLAGS) $(LIBS)
 
-$(top_srcdir)/src/5.3/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h
+$(top_srcdir)/src/5.3/opendkim/core.so: $(top_srcdir)/src/opendkim.c $(top_srcdir)/src/opendkim-const.h $(top_srcdir)/src/opendkim-lua.h
 	$(MKDIR_P) $(@D)
 	$(CC) $(CFLAGS) $(LUA53_CPPFLAGS) $(CPPFLAGS) -DOPENDKIM_LUA_VERSION_NUM=503 -o $@ $< $(SOFLAGS) $(LDFLAGS) $(LIBS)
 
@@ -49,6 +53,10 @@ $(DESTDIR)$(lua51cpath)/opendkim/core.so: $(top_srcdir)/src/5.1/opendkim/core.so
 	$(MKDIR_P) $(@D)
 	$(INSTALL_DATA) $^ $@
 
+$(DESTDIR)$(lua51path)/opendkim/ffi.lua: $(top_srcdir)/src/5.1/opendkim/ffi.lua
+	$(MKDIR_P) $(@D)
+	$(INSTALL_DATA) $^ $@
+
 $(DESTDIR)$(lua52cpath)/opendkim/core.so: $(top_srcdir)/src/5.2/opendkim/core.so
 	$(MKDIR_P) $(@D)
 	$(INSTALL_DATA) $^ $@
@@ -57,18 +65,41 @@ $(DESTDIR)$(lua53cpath)/opendkim/core.so: $(top_srcdir)/src/5.3/opendkim/core.so
 	$(MKDIR_P) $(@D)
 	$(INSTALL_DATA) $^ $@
 
+#
+# opendkim-lua.h is for C modules which extend the bindings.
+#
+$(DESTDIR)$(includedir)/opendkim-lua.h: $(top_srcdir)/src/opendkim-lua.h
+	$(MKDIR_P) $(@D)
+	$(INSTALL_DATA) $^ $@
+
+install: $(DESTDIR)$(includedir)/opendkim-lua.h
+
 $(top_srcdir)/src/uninstall:
 	for path in "$(lua51path)" "$(lua52path)" "$(lua53path)"; do \
-		[ -z "$${path}" ] || $(RM) -f "$(DESTDIR)$${path}/opendkim.lua"; \
+		[ -n "$${path}" ] || continue; \
+		$(RM) -f "$(DESTDIR)$${path}/opendkim.lua"; \
+		$(RM) -f "$(DESTDIR)$${path}/opendkim/ffi.lua"; \
+		[ ! -d "$(DESTDIR)$${path}/opendkim" ] || $(RMDIR) "$(DESTDIR)$${path}/opendkim" || true; \
 	done
 	for cpath in "$(lua51cpath)" "$(lua52cpath)" "$(lua53cpath)"; do \
 		[ -n "$${cpath}" ] || continue; \
 		$(RM) -f "$(DESTDIR)$${cpath}/opendkim/core.so"; \
 		[ ! -d "$(DESTDIR)$${cpath}/opendkim" ] || $(RMDIR) "$(DESTDIR)$${cpath}/opendkim" || true; \
 	done
+	$(RM) -f "$(DESTDIR)$(includedir)/opendkim-lua.h"
 
 uninstall: $(top_srcdir)/src/uninstall
 
+#
+# LuaJIT uses the Lua 5.1 module ABI, so these build the 5.1 module plus
+# the opendkim.ffi fast path, which only loads under LuaJIT.
+#
+luajit: $(top_srcdir)/src/5.1/opendkim.lua $(top_srcdir)/src/5.1/opendkim/core.so $(top_srcdir)/src/5.1/opendkim/ffi.lua
+
+install-luajit: $(DESTDIR)$(lua51path)/opendkim.lua $(DESTDIR)$(lua51cpath)/opendkim/core.so $(DESTDIR)$(lua51path)/opendkim/ffi.lua $(DESTDIR)$(includedir)/opendkim-lua.h
+
+.PHONY: luajit install-luajit
+
 $(top_srcdir)/src/clean:
 	$(RM) -fr $(@D)/5.1 $(@D)/5.2 $(@D)/5.3 $(@D)/opendkim-const.h
 
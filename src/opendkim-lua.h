@@ -0,0 +1,95 @@
+/* ==========================================================================
+ * opendkim-lua.h - C interface to the Lua bindings to libopendkim.
+ * --------------------------------------------------------------------------
+ * Copyright (c) 2015 Barracuda Networks, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef OPENDKIM_LUA_H
+#define OPENDKIM_LUA_H
+
+#include <stddef.h> /* size_t */
+
+#include <opendkim/dkim.h>
+
+#include <lua.h>
+
+/*
+ * When loaded, opendkim.core stores a pointer to a struct opendkim_lua_api
+ * in the Lua registry under OPENDKIM_LUA_REGISTRYKEY. Other C modules in
+ * the same Lua state use it to install native callbacks on a DKIM_LIB*
+ * object, and to get at the libopendkim handles behind the userdata.
+ *
+ * Native callbacks are called from within libopendkim, in place of the Lua
+ * closures, and must not call into the Lua state. Returning
+ * DKIM_CBSTAT_DEFAULT defers to the Lua closure. Without one a deferred
+ * prescreen or final callback continues, but a deferred key lookup is
+ * reported as DKIM_CBSTAT_NOTFOUND: libopendkim doesn't query DNS itself
+ * while any key lookup hook is installed. A native callback must not
+ * return DKIM_CBSTAT_TRYAGAIN; defer to a Lua closure instead where an
+ * answer needs waiting on.
+ *
+ * The abi member is bumped whenever the structure changes incompatibly.
+ */
+#define OPENDKIM_LUA_ABI 1
+#define OPENDKIM_LUA_REGISTRYKEY "opendkim.core.api"
+
+typedef DKIM_CBSTAT opendkim_lua_key_lookup_f(void *arg, DKIM *dkim, DKIM_SIGINFO *sig, unsigned char *buf, size_t bufsiz);
+typedef DKIM_CBSTAT opendkim_lua_siglist_f(void *arg, DKIM *dkim, DKIM_SIGINFO **siglist, int sigcount);
+
+struct opendkim_lua_api {
+	int abi; /* OPENDKIM_LUA_ABI */
+
+	/*
+	 * Return the handle behind the DKIM* or DKIM_LIB* userdata at index,
+	 * or NULL if it isn't one or has been closed. todkim first flushes
+	 * and disables the object's body coalescing (see
+	 * dkim:set_body_buffer), so the handle can be fed directly. Fields
+	 * fed that way bypass key prefetching and lib:set_limits.
+	 */
+	DKIM *(*todkim)(lua_State *L, int index);
+	DKIM_LIB *(*tolib)(lua_State *L, int index);
+
+	/*
+	 * Install f, called with arg, on the DKIM_LIB* userdata at index,
+	 * or remove it if f is NULL. arg must remain valid while installed.
+	 * Return 0 on success, otherwise an errno value.
+	 */
+	int (*set_key_lookup)(lua_State *L, int index, opendkim_lua_key_lookup_f *f, void *arg);
+	int (*set_prescreen)(lua_State *L, int index, opendkim_lua_siglist_f *f, void *arg);
+	int (*set_final)(lua_State *L, int index, opendkim_lua_siglist_f *f, void *arg);
+}; /* struct opendkim_lua_api */
+
+/*
+ * Return the interface of the opendkim.core module loaded into L, or NULL
+ * if it hasn't been loaded or has an incompatible ABI.
+ */
+static inline const struct opendkim_lua_api *opendkim_lua_getapi(lua_State *L) {
+	const struct opendkim_lua_api *api;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, OPENDKIM_LUA_REGISTRYKEY);
+	api = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return (api && api->abi == OPENDKIM_LUA_ABI)? api : NULL;
+} /* opendkim_lua_getapi() */
+
+#endif /* OPENDKIM_LUA_H */
@@ -23,9 +23,21 @@
  * USE OR OTHER DEALINGS IN THE SOFTWARE.
  * ==========================================================================
  */
-#include <stdlib.h> /* free(3) */
+#include <stdio.h>  /* FILE fopen(3) fwrite(3) fclose(3) rename(2) snprintf(3) */
+#include <stdlib.h> /* free(3) qsort(3) mkstemp(3) */
 #include <string.h> /* strerror_r(3) */
-#include <errno.h>  /* ENOMEM errno */
+#include <strings.h> /* strcasecmp(3) strncasecmp(3) */
+#include <ctype.h>  /* tolower(3) */
+#include <errno.h>  /* ENOMEM EINTR EINVAL ENOSYS EAGAIN ENOTSUP EILSEQ errno */
+#include <time.h>   /* CLOCK_MONOTONIC CLOCK_REALTIME clock_gettime(2) */
+
+#include <sys/types.h> /* struct stat */
+#include <sys/stat.h>  /* stat(2) S_ISDIR S_ISREG */
+#include <sys/uio.h>   /* struct iovec writev(2) */
+#include <sys/mman.h>  /* PROT_READ MAP_SHARED MAP_FAILED mmap(2) munmap(2) */
+#include <dirent.h>    /* DIR opendir(3) readdir(3) closedir(3) */
+#include <fcntl.h>     /* O_RDONLY O_CLOEXEC open(2) */
+#include <unistd.h>    /* close(2) read(2) write(2) fsync(2) */
 
 #include <opendkim/dkim.h>
 
@@ -33,6 +45,8 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "opendkim-lua.h"
+
 #if defined OPENDKIM_LUA_VERSION_NUM && OPENDKIM_LUA_VERSION_NUM != LUA_VERSION_NUM
 #error Lua version mismatch
 #endif
@@ -55,6 +69,101 @@
 #define HAVE_DKIM_SIG_SETDNSSEC 0
 #endif
 
+#ifndef HAVE_SENDFILE
+#if defined __linux__
+#define HAVE_SENDFILE 1
+#else
+#define HAVE_SENDFILE 0
+#endif
+#endif
+
+#if HAVE_SENDFILE
+#include <sys/sendfile.h> /* sendfile(2) */
+#endif
+
+#ifndef HAVE_INOTIFY
+#if defined __linux__
+#define HAVE_INOTIFY 1
+#else
+#define HAVE_INOTIFY 0
+#endif
+#endif
+
+#ifndef HAVE_TEE
+#if defined __linux__
+#define HAVE_TEE 1
+#else
+#define HAVE_TEE 0
+#endif
+#endif
+
+#if HAVE_TEE && !defined SPLICE_F_NONBLOCK
+/* <fcntl.h> only declares tee(2) with _GNU_SOURCE */
+#define SPLICE_F_NONBLOCK 0x02
+extern ssize_t tee(int, int, size_t, unsigned int);
+#endif
+
+#if HAVE_TEE
+#include <poll.h> /* POLLOUT struct pollfd poll(2) */
+#endif
+
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
+
+#if HAVE_ZLIB
+#include <zlib.h> /* z_stream inflateInit2(3) inflate(3) inflateEnd(3) */
+#endif
+
+#ifndef HAVE_ZSTD
+#define HAVE_ZSTD 0
+#endif
+
+#if HAVE_ZSTD
+#include <zstd.h> /* ZSTD_DStream ZSTD_createDStream(3) ZSTD_decompressStream(3) */
+#endif
+
+#if HAVE_INOTIFY
+#include <sys/inotify.h> /* inotify_init1(2) inotify_add_watch(2) */
+#endif
+
+/* libopendkim always links libcrypto; used directly by DKIM_STAMP */
+#ifndef HAVE_OPENSSL
+#define HAVE_OPENSSL 1
+#endif
+
+#if HAVE_OPENSSL
+#include <openssl/bio.h> /* BIO_new_mem_buf(3) BIO_free(3) */
+#include <openssl/evp.h> /* EVP_PKEY EVP_MD_CTX EVP_DigestSign(3) EVP_PKEY_sign(3) */
+#include <openssl/pem.h> /* PEM_read_bio_PrivateKey(3) */
+#include <openssl/rsa.h> /* RSA_PKCS1_PADDING */
+#include <openssl/x509.h> /* d2i_AutoPrivateKey(3) */
+#endif
+
+/*
+ * Status codes synthesized by the binding, numbered well above
+ * libopendkim's DKIM_STAT range.
+ */
+#ifndef DKIM_STAT_TIMEOUT
+#define DKIM_STAT_TIMEOUT 256
+#endif
+
+#ifndef DKIM_STAT_MAXSIGS
+#define DKIM_STAT_MAXSIGS 257
+#endif
+
+#ifndef DKIM_STAT_MAXHDRBYTES
+#define DKIM_STAT_MAXHDRBYTES 258
+#endif
+
+#ifndef DKIM_STAT_MAXHDRS
+#define DKIM_STAT_MAXHDRS 259
+#endif
+
+#ifndef DKIM_STAT_MAXLOOKUPS
+#define DKIM_STAT_MAXLOOKUPS 260
+#endif
+
 #ifndef STRERROR_R_CHAR_P
 #define STRERROR_R_CHAR_P ((GLIBC_PREREQ(0,0) || UCLIBC_PREREQ(0,0,0)) && (_GNU_SOURCE || !(_POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600)))
 #endif
@@ -75,7 +184,6 @@ static int lua_absindex(lua_State *L, int index) {
 	return (index > 0 || index <= LUA_REGISTRYINDEX)? index : lua_gettop(L) + index + 1;
 } /* lua_absindex() */
 
-#if 0 /* not needed yet */
 static void *luaL_testudata(lua_State *L, int index, const char *tname) {
 	void *p = lua_touserdata(L, index);
 	int eq;
@@ -89,7 +197,6 @@ static void *luaL_testudata(lua_State *L, int index, const char *tname) {
 
 	return (eq)? p : 0;
 } /* luaL_testudata() */
-#endif
 
 static void luaL_setmetatable(lua_State *L, const char *tname) {
 	luaL_getmetatable(L, tname);
@@ -117,6 +224,19 @@ static void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
 
 #define lua_rawlen lua_objlen
 
+static void lua_rawgetp(lua_State *L, int index, const void *p) {
+	index = lua_absindex(L, index);
+	lua_pushlightuserdata(L, (void *)p);
+	lua_rawget(L, index);
+} /* lua_rawgetp() */
+
+static void lua_rawsetp(lua_State *L, int index, const void *p) {
+	index = lua_absindex(L, index);
+	lua_pushlightuserdata(L, (void *)p);
+	lua_insert(L, -2);
+	lua_rawset(L, index);
+} /* lua_rawsetp() */
+
 #endif /* LUA_VERSION_NUM < 502 */
 
 
@@ -273,6 +393,48 @@ static int auxL_pusherror(lua_State *L, int error, const char *how) {
 	return lua_gettop(L) - top;
 } /* auxL_pusherror() */
 
+/*
+ * Reason strings are interned at module load in registry tables mapping
+ * code to string, so the error path is a single table lookup.
+ */
+static const char auxL_resultstr = 0; /* registry key */
+static const char auxL_sigerrorstr = 0; /* registry key */
+
+static void auxL_pushinterned(lua_State *L, const void *key, int code, const char *(*f)(int)) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, key);
+
+	if (lua_type(L, -1) == LUA_TTABLE) {
+		lua_rawgeti(L, -1, code);
+
+		if (!lua_isnil(L, -1)) {
+			lua_replace(L, -2);
+
+			return;
+		}
+
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 1);
+	lua_pushstring(L, f(code));
+} /* auxL_pushinterned() */
+
+static const char *auxL_getresultstr(int code) {
+	return dkim_getresultstr(code);
+} /* auxL_getresultstr() */
+
+static const char *auxL_sig_geterrorstr(int code) {
+	return dkim_sig_geterrorstr(code);
+} /* auxL_sig_geterrorstr() */
+
+static void auxL_pushresultstr(lua_State *L, DKIM_STAT code) {
+	auxL_pushinterned(L, &auxL_resultstr, code, &auxL_getresultstr);
+} /* auxL_pushresultstr() */
+
+static void auxL_pushsigerrorstr(lua_State *L, int code) {
+	auxL_pushinterned(L, &auxL_sigerrorstr, code, &auxL_sig_geterrorstr);
+} /* auxL_pushsigerrorstr() */
+
 static int auxL_pushstat(lua_State *L, DKIM_STAT error, const char *how) {
 	int top = lua_gettop(L);
 
@@ -288,7 +450,7 @@ static int auxL_pushstat(lua_State *L, DKIM_STAT error, const char *how) {
 			lua_pushinteger(L, error);
 			break;
 		case '$':
-			lua_pushstring(L, dkim_getresultstr(error));
+			auxL_pushresultstr(L, error);
 			break;
 		default:
 			lua_pushnil(L);
@@ -299,1378 +461,6084 @@ static int auxL_pushstat(lua_State *L, DKIM_STAT error, const char *how) {
 	return lua_gettop(L) - top;
 } /* auxL_pushstat() */
 
-static int auxL_checkcbstat(lua_State *L, int index) {
-	DKIM_CBSTAT error = luaL_checkinteger(L, index);
+static void auxL_pushlower(lua_State *L, const char *src) {
+	luaL_Buffer B;
 
-	/* FIXME: Add constraint check. */
+	luaL_buffinit(L, &B);
 
-	return error;
-} /* auxL_checkcbstat() */
+	for (; *src; src++)
+		luaL_addchar(&B, tolower((unsigned char)*src));
 
+	luaL_pushresult(&B);
+} /* auxL_pushlower() */
 
 /*
- * (DKIM_LIB_State *) and (DKIM_State *) D E F I N I T I O N S
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ * Push the contents of the file at path as a string. Returns 0 on success,
+ * otherwise an errno value and pushes nothing.
+ */
+static int auxL_readfile(lua_State *L, const char *path) {
+	luaL_Buffer B;
+	char *p;
+	ssize_t n;
+	int fd, error;
 
-typedef struct {
-	DKIM_LIB *ctx;
+	if (-1 == (fd = open(path, O_RDONLY|O_CLOEXEC)))
+		return errno;
 
-	auxref_t final; /* reference key to Lua callback function */
-	auxref_t key_lookup; /* "" (for asynchronous DNS) */
-	auxref_t prescreen; /* "" */
+	luaL_buffinit(L, &B);
 
-	struct { /* synchronous DNS callbacks */
-		lua_State *L; /* callback thread */
-		auxref_t thread; /* reference key to thread */
-		auxref_t start;
-		auxref_t cancel;
-		auxref_t waitreply;
-		auxref_t trustanchor;
+	while (1) {
+		p = luaL_prepbuffer(&B);
 
-		/*
-		 * NB: only one query can be live at any time because we're
-		 * single-threaded, the old-style DNS callbacks are
-		 * synchronous, and libopendkim always calls start,
-		 * waitreply, and cancel in sequence.
-		 */
-		void *buf;
-		size_t bufsiz;
-	} dns;
-} DKIM_LIB_State;
+		if (-1 == (n = read(fd, p, LUAL_BUFFERSIZE))) {
+			if (errno == EINTR)
+				continue;
 
-static const DKIM_LIB_State DKIM_LIB_initializer = {
-	.ctx = NULL,
-	.final = LUA_NOREF,
-	.key_lookup = LUA_NOREF,
-	.prescreen = LUA_NOREF,
-	.dns = {
-		.L = NULL,
-		.thread = LUA_NOREF,
-		.start = LUA_NOREF,
-		.cancel = LUA_NOREF,
-		.waitreply = LUA_NOREF,
-		.trustanchor = LUA_NOREF,
-	},
-};
+			error = errno;
+			close(fd);
+			luaL_pushresult(&B);
+			lua_pop(L, 1);
 
-#define DKIM_CB_FINAL      0x01
-#define DKIM_CB_KEY_LOOKUP 0x02
-#define DKIM_CB_PRESCREEN  0x04
+			return error;
+		} else if (n == 0) {
+			break;
+		}
 
-typedef struct {
-	DKIM *ctx;
-	DKIM_LIB_State *lib;
+		luaL_addsize(&B, n);
+	}
 
-	struct {
-		auxref_t lib; /* DKIM_LIB_State anchor */
-		auxref_t txt; /* key_lookup txt string anchor */
-	} ref;
+	close(fd);
+	luaL_pushresult(&B);
 
-	struct {
-		int exec;
-		int done;
+	return 0;
+} /* auxL_readfile() */
 
-		struct {
-			DKIM_SIGINFO **siglist;
-			int sigcount;
+#define AUX_FNV1A_INIT 0xcbf29ce484222325ULL
 
-			DKIM_CBSTAT stat;
-		} final;
+static uint64_t aux_fnv1a(uint64_t h, const void *src, size_t len) {
+	const unsigned char *p = src, *pe = p + len;
 
-		struct {
-			DKIM_SIGINFO *siginfo;
+	for (; p < pe; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
 
-			const char *txt;
-			DKIM_CBSTAT stat;
-		} key_lookup;
+	return h;
+} /* aux_fnv1a() */
 
-		struct {
-			DKIM_SIGINFO **siglist;
-			int sigcount;
+static double aux_monotime(void) {
+	struct timespec ts;
 
-			DKIM_CBSTAT stat;
-		} prescreen;
-	} cb;
-} DKIM_State;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-static const DKIM_State DKIM_initializer = {
-	.ref = { .lib = LUA_NOREF, .txt = LUA_NOREF },
-	.cb = {
-		.key_lookup = { .stat = DKIM_CBSTAT_ERROR },
-		.prescreen = { .stat = DKIM_CBSTAT_ERROR },
-	},
-};
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} /* aux_monotime() */
 
-static DKIM_State *DKIM_checkself(lua_State *L, int index);
-static DKIM_State *DKIM_checkref(lua_State *L, auxref_t ref);
+static double aux_walltime(void) {
+	struct timespec ts;
 
-typedef struct {
-	DKIM_SIGINFO *ctx;
-	auxref_t dkim;
-} DKIM_SIGINFO_State;
+	clock_gettime(CLOCK_REALTIME, &ts);
 
-static const DKIM_SIGINFO_State DKIM_SIGINFO_initializer = {
-	.dkim = LUA_NOREF,
-}; /* DKIM_SIGINFO_initializer */
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} /* aux_walltime() */
 
-static DKIM_SIGINFO_State *DKIM_SIGINFO_checkself(lua_State *L, int index);
+static int auxL_checkcbstat(lua_State *L, int index) {
+	DKIM_CBSTAT error = luaL_checkinteger(L, index);
 
-typedef struct {
-	DKIM_QUERYINFO *ctx;
-} DKIM_QUERYINFO_State;
+	/* FIXME: Add constraint check. */
 
-static const DKIM_QUERYINFO_State DKIM_QUERYINFO_initializer = { 0 };
+	return error;
+} /* auxL_checkcbstat() */
 
+static int aux_writev(int fd, struct iovec *iov, int iovcnt, size_t *count) {
+	ssize_t n;
 
-/*
- * (DKIM_QUERYINFO *) B I N D I N G S
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+	while (iovcnt > 0) {
+		if (-1 == (n = writev(fd, iov, iovcnt))) {
+			if (errno == EINTR)
+				continue;
 
-static DKIM_QUERYINFO_State *DKIM_QUERYINFO_checkself(lua_State *L, int index) {
-	DKIM_QUERYINFO_State *siginfo = luaL_checkudata(L, index, "DKIM_QUERYINFO*");
+			return errno;
+		}
 
-	luaL_argcheck(L, siginfo->ctx, index, "attempt to use a closed DKIM_QUERYINFO handle");
+		*count += n;
 
-	return siginfo;
-} /* DKIM_QUERYINFO_checkself() */
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
 
-static DKIM_QUERYINFO_State *DKIM_QUERYINFO_prep(lua_State *L) {
-	DKIM_QUERYINFO_State *qryinfo;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
 
-	qryinfo = lua_newuserdata(L, sizeof *qryinfo);
-	*qryinfo = DKIM_QUERYINFO_initializer;
-	luaL_setmetatable(L, "DKIM_QUERYINFO*");
+	return 0;
+} /* aux_writev() */
 
-	return qryinfo;
-} /* DKIM_QUERYINFO_prep() */
+/*
+ * Copy from ifd to ofd until EOF, using sendfile(2) where the kernel
+ * supports it for this pair of descriptors, and read(2)/write(2) through a
+ * bounce buffer otherwise.
+ */
+static int aux_copyfd(int ofd, int ifd, size_t *count) {
+	char buf[8192];
+	struct iovec iov;
+	ssize_t n;
+	int error;
+
+#if HAVE_SENDFILE
+	while (1) {
+		if (-1 == (n = sendfile(ofd, ifd, NULL, 1U << 30))) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS)
+				break; /* fall back to read/write */
+
+			return errno;
+		} else if (n == 0) {
+			return 0;
+		}
 
-static int DKIM_QUERYINFO_getname(lua_State *L) {
-	DKIM_QUERYINFO_State *qryinfo = DKIM_QUERYINFO_checkself(L, 1);
+		*count += n;
+	}
+#endif
 
-	lua_pushstring(L, dkim_qi_getname(qryinfo->ctx));
+	while (1) {
+		if (-1 == (n = read(ifd, buf, sizeof buf))) {
+			if (errno == EINTR)
+				continue;
 
-	return 1;
-} /* DKIM_QUERYINFO_getname() */
+			return errno;
+		} else if (n == 0) {
+			return 0;
+		}
 
-static int DKIM_QUERYINFO_gettype(lua_State *L) {
-	DKIM_QUERYINFO_State *qryinfo = DKIM_QUERYINFO_checkself(L, 1);
-	int type;
+		iov.iov_base = buf;
+		iov.iov_len = n;
 
-	if (-1 == (type = dkim_qi_gettype(qryinfo->ctx)))
-		return 0;
+		if ((error = aux_writev(ofd, &iov, 1, count)))
+			return error;
+	}
+} /* aux_copyfd() */
 
-	lua_pushinteger(L, type);
+#if HAVE_OPENSSL
+/*
+ * Load a private key in any of the forms libopendkim accepts: PEM, base64
+ * DER, or a base64 raw Ed25519 key.
+ */
+static EVP_PKEY *aux_loadkey(const char *key, size_t len) {
+	EVP_PKEY *pkey = NULL;
+	unsigned char *der = NULL;
+	const unsigned char *p;
+	char *b64 = NULL;
+	size_t i, n = 0;
+	int derlen;
+	BIO *bio;
+
+	/* PEM, as written by opendkim-genkey */
+	if ((bio = BIO_new_mem_buf((void *)key, len))) {
+		pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+
+		if (pkey)
+			return pkey;
+	}
 
-	return 1;
-} /* DKIM_QUERYINFO_gettype() */
+	/* otherwise base64 DER, or a raw Ed25519 seed */
+	if (!(b64 = malloc(len + 1)) || !(der = malloc(len + 1)))
+		goto done;
 
-static int DKIM_QUERYINFO__gc(lua_State *L) {
-	DKIM_QUERYINFO_State *qryinfo = luaL_checkudata(L, 1, "DKIM_QUERYINFO*");
+	for (i = 0; i < len; i++) {
+		if (!isspace((unsigned char)key[i]))
+			b64[n++] = key[i];
+	}
 
-	free(qryinfo->ctx);
-	qryinfo->ctx = NULL;
+	if ((derlen = EVP_DecodeBlock(der, (unsigned char *)b64, n)) < 0)
+		goto done;
 
-	return 0;
-} /* DKIM_QUERYINFO__gc() */
+	for (i = n; i > 0 && b64[i - 1] == '=' && derlen > 0; i--)
+		derlen--;
 
-static luaL_Reg DKIM_QUERYINFO_methods[] = {
-	{ "getname", &DKIM_QUERYINFO_getname },
-	{ "gettype", &DKIM_QUERYINFO_gettype },
-	{ NULL, NULL },
-}; /* DKIM_QUERYINFO_methods[] */
+	p = der;
 
-static luaL_Reg DKIM_QUERYINFO_metamethods[] = {
-	{ "__gc", &DKIM_QUERYINFO__gc },
-	{ NULL,   NULL },
-}; /* DKIM_QUERYINFO_metamethods[] */
+	if ((pkey = d2i_AutoPrivateKey(NULL, &p, derlen)))
+		goto done;
+#if defined EVP_PKEY_ED25519
+	if (derlen == 32)
+		pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, der, derlen);
+#endif
+done:
+	free(der);
+	free(b64);
 
+	return pkey;
+} /* aux_loadkey() */
+#endif
 
 /*
- * (DKIM_SIGINFO *) B I N D I N G S
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ * Create a uniquely named file beside path for writing, so concurrent
+ * writers of the same path never share one, to be renamed into place by
+ * aux_tmpcommit. Returns NULL with errno set on failure.
+ */
+static FILE *aux_tmpopen(char **tmp, const char *path) {
+	FILE *fp;
+	int fd, error;
 
-static DKIM_SIGINFO_State *DKIM_SIGINFO_checkself(lua_State *L, int index) {
-	DKIM_SIGINFO_State *siginfo = luaL_checkudata(L, index, "DKIM_SIGINFO*");
+	if (!(*tmp = malloc(strlen(path) + sizeof ".XXXXXX")))
+		return NULL;
 
-	luaL_argcheck(L, siginfo->ctx, index, "attempt to use a closed DKIM_SIGINFO handle");
+	sprintf(*tmp, "%s.XXXXXX", path);
 
-	return siginfo;
-} /* DKIM_SIGINFO_checkself() */
+	if (-1 == (fd = mkstemp(*tmp)))
+		goto syerr;
 
-static DKIM_SIGINFO_State *DKIM_SIGINFO_prep(lua_State *L, int index) {
-	DKIM_SIGINFO_State *siginfo;
+	/* mkstemp creates it 0600, but nothing we write is secret */
+	if (0 != fchmod(fd, 0644) || !(fp = fdopen(fd, "wb"))) {
+		error = errno;
+		close(fd);
+		unlink(*tmp);
+		errno = error;
 
-	index = lua_absindex(L, index);
+		goto syerr;
+	}
 
-	siginfo = lua_newuserdata(L, sizeof *siginfo);
-	*siginfo = DKIM_SIGINFO_initializer;
-	luaL_setmetatable(L, "DKIM_SIGINFO*");
+	return fp;
+syerr:
+	error = errno;
+	free(*tmp);
+	*tmp = NULL;
+	errno = error;
 
-	auxL_ref(L, index, &siginfo->dkim);
+	return NULL;
+} /* aux_tmpopen() */
 
-	return siginfo;
-} /* DKIM_SIGINFO_prep() */
+/*
+ * Sync fp to disk, close it and rename tmp over path. tmp is unlinked on
+ * failure and freed either way. Returns 0 or an errno value.
+ */
+static int aux_tmpcommit(FILE *fp, char *tmp, const char *path) {
+	int error = 0;
 
-static DKIM_SIGINFO_State *DKIM_SIGINFO_push(lua_State *L, int index, DKIM_SIGINFO *ctx) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_prep(L, index);
+	if (0 != fflush(fp) || 0 != fsync(fileno(fp)))
+		error = errno;
 
-	siginfo->ctx = ctx;
+	if (0 != fclose(fp) && !error)
+		error = errno;
 
-	return siginfo;
-} /* DKIM_SIGINFO_push() */
+	if (!error && 0 != rename(tmp, path))
+		error = errno;
 
-static int DKIM_SIGINFO_getbh(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	if (error)
+		unlink(tmp);
 
-	lua_pushinteger(L, dkim_sig_getbh(siginfo->ctx));
+	free(tmp);
 
-	return 1;
-} /* DKIM_SIGINFO_getbh() */
+	return error;
+} /* aux_tmpcommit() */
 
-static int DKIM_SIGINFO_getcanonlen(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
-	ssize_t msglen, canonlen, signlen;
-	DKIM_STAT stat;
+static void aux_tmpabort(FILE *fp, char *tmp) {
+	fclose(fp);
+	unlink(tmp);
+	free(tmp);
+} /* aux_tmpabort() */
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_getcanonlen(dkim->ctx, siginfo->ctx, &msglen, &canonlen, &signlen)))
-		return auxL_pushstat(L, stat, "~$#");
 
-	lua_pushinteger(L, msglen);
-	lua_pushinteger(L, canonlen);
-	lua_pushinteger(L, signlen);
+/*
+ * A R E N A  A L L O C A T O R
+ *
+ * libopendkim routes all per-message allocations through the mallocf and
+ * freef hooks given to dkim_init, passing along the memclosure given to
+ * dkim_sign or dkim_verify. We pass an arena as the memclosure so that
+ * allocations are carved from a few large blocks, and release everything
+ * in one shot after dkim_free. Library-wide allocations are made with a
+ * NULL closure, and go straight to malloc(3) and free(3).
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-	return 3;
-} /* DKIM_SIGINFO_getcanonlen() */
+#define AUX_ARENA_MINBLOCK 4096
+#define AUX_ARENA_MAXBLOCK (1U << 20)
 
-static int DKIM_SIGINFO_getcanons(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	dkim_canon_t hdr, body;
-	DKIM_STAT stat;
+typedef union {
+	void *p;
+	long long ll;
+	long double ld;
+	void (*fp)(void);
+} aux_maxalign_t;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_getcanons(siginfo->ctx, &hdr, &body)))
-		return auxL_pushstat(L, stat, "~$#");
+#define AUX_ARENA_ALIGN (sizeof (aux_maxalign_t))
+#define AUX_ARENA_ROUNDUP(n) (((n) + (AUX_ARENA_ALIGN - 1)) & ~(AUX_ARENA_ALIGN - 1))
 
-	lua_pushinteger(L, hdr);
-	lua_pushinteger(L, body);
+struct aux_arena_block {
+	struct aux_arena_block *next;
+	size_t size, used;
+	aux_maxalign_t data[];
+}; /* struct aux_arena_block */
 
-	return 2;
-} /* DKIM_SIGINFO_getcanons() */
+struct aux_arena {
+	struct aux_arena_block *head;
+	size_t blocksize; /* size of next block to allocate */
+}; /* struct aux_arena */
 
-static int DKIM_SIGINFO_getdnssec(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+#define AUX_ARENA_INITIALIZER { NULL, AUX_ARENA_MINBLOCK }
 
-	lua_pushinteger(L, dkim_sig_getdnssec(siginfo->ctx));
+static void *aux_arena_alloc(struct aux_arena *arena, size_t size) {
+	struct aux_arena_block *block = arena->head;
+	size_t blocksize;
+	void *p;
 
-	return 1;
-} /* DKIM_SIGINFO_getdnssec() */
+	if (size == 0)
+		size = 1;
 
-static int DKIM_SIGINFO_getdomain(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	const void *domain = dkim_sig_getdomain(siginfo->ctx);
+	if (size > SIZE_MAX - (AUX_ARENA_ALIGN - 1))
+		return NULL;
 
-	lua_pushstring(L, domain);
+	size = AUX_ARENA_ROUNDUP(size);
 
-	return 1;
-} /* DKIM_SIGINFO_getdomain() */
+	if (!block || block->size - block->used < size) {
+		blocksize = AUX_MAX(arena->blocksize, size);
 
-static int DKIM_SIGINFO_geterror(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+		if (blocksize > SIZE_MAX - sizeof *block)
+			return NULL;
 
-	lua_pushinteger(L, dkim_sig_geterror(siginfo->ctx));
+		if (!(block = malloc(sizeof *block + blocksize)))
+			return NULL;
 
-	return 1;
-} /* DKIM_SIGINFO_geterror() */
+		block->size = blocksize;
+		block->used = 0;
 
-static int DKIM_SIGINFO_getflags(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+		/*
+		 * Keep bump allocating from the current block if an
+		 * oversized request wouldn't leave room in the new one.
+		 */
+		if (arena->head && blocksize - size < arena->head->size - arena->head->used) {
+			block->next = arena->head->next;
+			arena->head->next = block;
+		} else {
+			block->next = arena->head;
+			arena->head = block;
+		}
 
-	lua_pushinteger(L, dkim_sig_getflags(siginfo->ctx));
+		arena->blocksize = AUX_MIN(arena->blocksize * 2, AUX_ARENA_MAXBLOCK);
+	}
 
-	return 1;
-} /* DKIM_SIGINFO_getflags() */
+	p = (unsigned char *)block->data + block->used;
+	block->used += size;
 
-static int DKIM_SIGINFO_getidentity_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
-	unsigned char buf_[256];
-	void *buf;
-	size_t bufsiz;
-	int top;
-	DKIM_STAT stat;
+	return p;
+} /* aux_arena_alloc() */
 
-	top = lua_gettop(L);
-	buf = buf_;
-	bufsiz = sizeof buf;
+static void aux_arena_reset(struct aux_arena *arena) {
+	struct aux_arena_block *block;
 
-	goto again;
+	while ((block = arena->head)) {
+		arena->head = block->next;
+		free(block);
+	}
 
-	do {
-		if (SIZE_MAX / 2 < bufsiz)
-			return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+	arena->blocksize = AUX_ARENA_MINBLOCK;
+} /* aux_arena_reset() */
 
-		lua_settop(L, top);
-		bufsiz *= 2;
-		buf = lua_newuserdata(L, bufsiz);
-again:
-		stat = dkim_sig_getidentity(dkim->ctx, siginfo->ctx, buf, bufsiz);
-	} while (stat == DKIM_STAT_NORESOURCE);
+static void *aux_arena_mallocf(void *closure, size_t size) {
+	if (!closure)
+		return malloc(size);
 
-	if (stat != DKIM_STAT_OK)
-		return auxL_pushstat(L, stat, "~$#");
+	return aux_arena_alloc(closure, size);
+} /* aux_arena_mallocf() */
 
-	lua_pushlstring(L, buf, strnlen(buf, bufsiz));
+static void aux_arena_freef(void *closure, void *p) {
+	/* arena memory is released in one shot by aux_arena_reset */
+	if (!closure)
+		free(p);
+} /* aux_arena_freef() */
 
-	return 1;
-} /* DKIM_SIGINFO_getidentity_() */
 
-static int DKIM_SIGINFO_getidentity(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+/*
+ * K E Y  D A T A B A S E
+ *
+ * Read-only, memory-mapped table of key records, keyed by the query name
+ * (selector._domainkey.domain), using a hash-and-displace perfect hash:
+ * a first hash selects a bucket, and the bucket's displacement seeds a
+ * second hash which selects the slot. Every lookup probes exactly one slot.
+ * Files are written in host byte order.
+ *
+ *   header | uint32_t disp[nbuckets] | uint32_t slot[nslots] | records
+ *
+ * Each slot holds the file offset of a record, or 0 if empty. Each record
+ * is uint32_t namelen, uint32_t txtlen, name, txt, NUL, padded to 4 bytes.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
-} /* DKIM_SIGINFO_getidentity() */
+#define AUX_KEYDB_MAGIC "DKIMKDB1"
+#define AUX_KEYDB_BYTEORDER 0x01020304U
+#define AUX_KEYDB_MAXNAME 256
+#define AUX_KEYDB_MAXDISP (1U << 16)
 
-static int DKIM_SIGINFO_getqueries_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
-	DKIM_QUERYINFO **list = NULL;
-	unsigned int n = 0, i;
-	DKIM_STAT stat;
-	int tindex;
+struct aux_keydb_header {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t nbuckets;
+	uint32_t nslots;
+	uint32_t nrecords;
+}; /* struct aux_keydb_header */
 
-	lua_newtable(L);
-	tindex = lua_gettop(L);
+struct aux_keydb {
+	const unsigned char *map;
+	size_t size;
+}; /* struct aux_keydb */
 
-	do {
-		/* free any previous list */
-		for (i = 0; i < n; i++)
-			free(list[i]);
-		free(list);
-		list = NULL;
+static uint32_t aux_keydb_hash(uint32_t seed, const char *name, size_t len) {
+	uint64_t h = aux_fnv1a(AUX_FNV1A_INIT ^ (seed * 0x9e3779b97f4a7c15ULL), name, len);
 
-		/* reset stack */
-		lua_settop(L, tindex);
+	return (uint32_t)(h ^ (h >> 32));
+} /* aux_keydb_hash() */
 
-		/* pre-allocate objects */
-		luaL_checkstack(L, MAX(n, 1), NULL);
-		for (i = 0; i < MAX(n, 1); i++)
-			DKIM_QUERYINFO_prep(L);
+/*
+ * Copy name to dst lowercased and without a trailing dot. Returns the
+ * length, or 0 if the name is empty or doesn't fit.
+ */
+static size_t aux_keydb_normalize(char dst[AUX_KEYDB_MAXNAME], const char *src, size_t len) {
+	size_t i;
 
-		if (DKIM_STAT_OK != (stat = dkim_sig_getqueries(dkim->ctx, siginfo->ctx, &list, &n)))
-			return auxL_pushstat(L, stat, "~$#");
-	} while ((size_t)(lua_gettop(L) - tindex) < n);
+	if (len > 0 && src[len - 1] == '.')
+		len--;
 
-	/* shrink stack if n is less than what we pre-allocated */
-	lua_settop(L, tindex + n);
+	if (len == 0 || len >= AUX_KEYDB_MAXNAME)
+		return 0;
 
-	for (i = 0; i < n; i++) {
-		DKIM_QUERYINFO_State *qryinfo = lua_touserdata(L, tindex + i + 1);
-		qryinfo->ctx = list[i];
-		list[i] = NULL;
-	}
+	for (i = 0; i < len; i++)
+		dst[i] = tolower((unsigned char)src[i]);
 
-	free(list);
-	list = NULL;
+	dst[len] = '\0';
 
-	/* move objects to table */
-	for (i = 1; lua_gettop(L) > tindex; i++) {
-		lua_rawseti(L, tindex, i);
-	}
+	return len;
+} /* aux_keydb_normalize() */
 
-	/* sanity check our return value */
-	luaL_checktype(L, -1, LUA_TTABLE);
+static void aux_keydb_close(struct aux_keydb *db) {
+	if (db->map)
+		munmap((void *)db->map, db->size);
 
-	return 1;
-} /* DKIM_SIGINFO_getqueries_() */
+	db->map = NULL;
+	db->size = 0;
+} /* aux_keydb_close() */
 
-static int DKIM_SIGINFO_getqueries(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+static int aux_keydb_open(struct aux_keydb *db, const char *path) {
+	const struct aux_keydb_header *hdr;
+	struct stat st;
+	void *map;
+	int fd, error;
 
-	return DKIM_SIGINFO_getqueries_(L, dkim, siginfo);
-} /* DKIM_SIGINFO_getqueries() */
+	if (-1 == (fd = open(path, O_RDONLY|O_CLOEXEC)))
+		return errno;
 
-static int DKIM_SIGINFO_getkeysize(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	unsigned int bits;
-	DKIM_STAT stat;
+	if (0 != fstat(fd, &st))
+		goto syerr;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_getkeysize(siginfo->ctx, &bits)))
-		return auxL_pushstat(L, stat, "~$#");
+	if ((uintmax_t)st.st_size < sizeof *hdr || (uintmax_t)st.st_size > SIZE_MAX) {
+		error = EINVAL;
+		goto error;
+	}
 
-	lua_pushinteger(L, bits);
+	if (MAP_FAILED == (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)))
+		goto syerr;
 
-	return 1;
-} /* DKIM_SIGINFO_getkeysize() */
+	close(fd);
 
-static int DKIM_SIGINFO_getreportinfo_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
-	(void)L; (void)dkim; (void)siginfo;
+	hdr = map;
 
-	/*
-	 * NB: dkim_sig_getreportinfo doesn't appear to support asynchronous
-	 * DNS. We may need to re-implement this routine in Lua.
-	 */
+	if (memcmp(hdr->magic, AUX_KEYDB_MAGIC, sizeof hdr->magic)
+	||  hdr->byteorder != AUX_KEYDB_BYTEORDER
+	||  hdr->nbuckets == 0 || hdr->nslots == 0
+	||  ((uintmax_t)hdr->nbuckets + hdr->nslots) * 4 > (uintmax_t)st.st_size - sizeof *hdr) {
+		munmap(map, st.st_size);
+
+		return EINVAL;
+	}
+
+	db->map = map;
+	db->size = st.st_size;
 
 	return 0;
-} /* DKIM_SIGINFO_getreportinfo_() */
+syerr:
+	error = errno;
+error:
+	close(fd);
 
-static int DKIM_SIGINFO_getreportinfo(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+	return error;
+} /* aux_keydb_open() */
 
-	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
-} /* DKIM_SIGINFO_getreportinfo() */
+/*
+ * Find the record for name, returning its TXT data or NULL. The TXT data
+ * is NUL-terminated.
+ */
+static const char *aux_keydb_find(const struct aux_keydb *db, const char *name, size_t *txtlen) {
+	const struct aux_keydb_header *hdr = (const void *)db->map;
+	const uint32_t *disp, *slot;
+	char key[AUX_KEYDB_MAXNAME];
+	uint32_t rec[2], off;
+	size_t len;
 
-static int DKIM_SIGINFO_getselector(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	const void *selector = dkim_sig_getselector(siginfo->ctx);
+	if (!db->map || !(len = aux_keydb_normalize(key, name, strlen(name))))
+		return NULL;
 
-	lua_pushstring(L, selector);
+	disp = (const uint32_t *)(db->map + sizeof *hdr);
+	slot = disp + hdr->nbuckets;
 
-	return 1;
-} /* DKIM_SIGINFO_getselector() */
+	off = slot[aux_keydb_hash(disp[aux_keydb_hash(0, key, len) % hdr->nbuckets] + 1, key, len) % hdr->nslots];
 
-static int DKIM_SIGINFO_getsignalg(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	dkim_alg_t alg;
-	DKIM_STAT stat;
+	if (off == 0 || (size_t)off > db->size - sizeof rec)
+		return NULL;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_getsignalg(siginfo->ctx, &alg)))
-		return auxL_pushstat(L, stat, "~$#");
+	memcpy(rec, db->map + off, sizeof rec);
 
-	lua_pushinteger(L, alg);
+	if (rec[0] != len || (uintmax_t)rec[0] + rec[1] + 1 > db->size - off - sizeof rec)
+		return NULL;
 
-	return 1;
-} /* DKIM_SIGINFO_getsignalg() */
+	if (memcmp(db->map + off + sizeof rec, key, len))
+		return NULL;
 
-static int DKIM_SIGINFO_getsslbuf(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	*txtlen = rec[1];
 
-	lua_pushstring(L, dkim_sig_getsslbuf(siginfo->ctx));
+	return (const char *)db->map + off + sizeof rec + len;
+} /* aux_keydb_find() */
 
-	return 1;
-} /* DKIM_SIGINFO_getsslbuf() */
 
-static int DKIM_SIGINFO_hdrsigned(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	unsigned char *hdr = (void *)luaL_checkstring(L, 2);
+/*
+ * K E Y  C A C H E
+ *
+ * Direct-mapped table of key records answered by the key_lookup callback,
+ * indexed by a hash of the normalized query name. Expiry is kept in wall
+ * clock time rather than monotonic time so the table can be saved to a
+ * snapshot and reloaded by a later process with the remaining TTLs intact.
+ * Snapshots are written in host byte order:
+ *
+ *   header | records
+ *
+ * Each record is int64_t expires, uint32_t namelen, uint32_t txtlen, name,
+ * txt. Records which have expired are skipped when loading.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-	lua_pushboolean(L, dkim_sig_hdrsigned(siginfo->ctx, hdr));
+#define AUX_KCACHE_MAGIC "DKIMKCS1"
+#define AUX_KCACHE_BYTEORDER 0x01020304U
+#define AUX_KCACHE_MAXTXT 65535 /* largest possible TXT RDATA */
+
+struct aux_kcache_header {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t nrecords;
+}; /* struct aux_kcache_header */
+
+struct aux_kcache_record {
+	int64_t expires;
+	uint32_t namelen;
+	uint32_t txtlen;
+}; /* struct aux_kcache_record */
+
+struct aux_kentry {
+	uint64_t hash; /* 0 if the entry is empty */
+	char *name; /* NUL-terminated, txt follows in the same allocation */
+	char *txt;
+	double expires; /* wall clock time */
+	double refresh; /* when a refresh was handed out, or 0 */
+	unsigned failures; /* refreshes failed in a row */
+}; /* struct aux_kentry */
+
+struct aux_kcache {
+	struct aux_kentry *table;
+	size_t size;
+	double ttl; /* when the callback doesn't give one */
+}; /* struct aux_kcache */
+
+static uint64_t aux_kcache_hash(const char *name, size_t len) {
+	uint64_t h = aux_fnv1a(AUX_FNV1A_INIT, name, len);
+
+	return (h)? h : 1;
+} /* aux_kcache_hash() */
+
+static void aux_kcache_close(struct aux_kcache *cache) {
+	size_t i;
 
-	return 1;
-} /* DKIM_SIGINFO_hdrsigned() */
+	for (i = 0; i < cache->size; i++)
+		free(cache->table[i].name);
 
-static int DKIM_SIGINFO_ignore(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	free(cache->table);
+	cache->table = NULL;
+	cache->size = 0;
+} /* aux_kcache_close() */
 
-	dkim_sig_ignore(siginfo->ctx);
+static int aux_kcache_open(struct aux_kcache *cache, size_t size, double ttl) {
+	aux_kcache_close(cache);
 
-	lua_pushboolean(L, 1);
+	if (size && !(cache->table = calloc(size, sizeof *cache->table)))
+		return errno;
 
-	return 1;
-} /* DKIM_SIGINFO_ignore() */
+	cache->size = size;
+	cache->ttl = ttl;
 
-static int DKIM_SIGINFO_process_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
-	DKIM_STAT stat;
+	return 0;
+} /* aux_kcache_open() */
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_process(dkim->ctx, siginfo->ctx)))
-		return auxL_pushstat(L, stat, "0$#");
+/* return the entry for name, whether or not it has expired, or NULL */
+static struct aux_kentry *aux_kcache_lookup(struct aux_kcache *cache, const char *name) {
+	char key[AUX_KEYDB_MAXNAME];
+	struct aux_kentry *ent;
+	uint64_t hash;
+	size_t len;
 
-	lua_pushboolean(L, 1);
+	if (!cache->size || !(len = aux_keydb_normalize(key, name, strlen(name))))
+		return NULL;
 
-	return 1;
-} /* DKIM_SIGINFO_process_() */
+	hash = aux_kcache_hash(key, len);
+	ent = &cache->table[hash % cache->size];
 
-static int DKIM_SIGINFO_process(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+	if (ent->hash != hash || strcmp(ent->name, key))
+		return NULL;
 
-	return DKIM_SIGINFO_process_(L, dkim, siginfo);
-} /* DKIM_SIGINFO_process() */
+	return ent;
+} /* aux_kcache_lookup() */
 
-#if HAVE_DKIM_SIG_SETDNSSEC
-static int DKIM_SIGINFO_setdnssec(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	int status = luaL_checkinteger(L, 2);
+/*
+ * Find the live record for name, returning its TXT data or NULL. The TXT
+ * data is NUL-terminated.
+ */
+static const char *aux_kcache_find(struct aux_kcache *cache, const char *name, double now) {
+	struct aux_kentry *ent;
 
-	dkim_sig_setdnssec(siginfo->ctx, status);
+	if (!(ent = aux_kcache_lookup(cache, name)) || ent->expires <= now)
+		return NULL;
 
-	lua_pushboolean(L, 1);
+	return ent->txt;
+} /* aux_kcache_find() */
 
-	return 1;
-} /* DKIM_SIGINFO_setdnssec() */
-#endif
+static int aux_kcache_store(struct aux_kcache *cache, const char *name, const char *txt, size_t txtlen, double expires) {
+	char key[AUX_KEYDB_MAXNAME];
+	struct aux_kentry *ent;
+	uint64_t hash;
+	size_t len;
+	char *copy;
 
-static int DKIM_SIGINFO_seterror(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	int error = luaL_checkinteger(L, 2);
-	DKIM_STAT stat;
+	if (!cache->size)
+		return 0;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_seterror(siginfo->ctx, error)))
-		return auxL_pushstat(L, stat, "0$#");
+	if (!(len = aux_keydb_normalize(key, name, strlen(name))) || txtlen > AUX_KCACHE_MAXTXT)
+		return EINVAL;
 
-	lua_pushboolean(L, 1);
+	if (!(copy = malloc(len + 1 + txtlen + 1)))
+		return errno;
 
-	return 1;
-} /* DKIM_SIGINFO_seterror() */
+	memcpy(copy, key, len + 1);
+	memcpy(copy + len + 1, txt, txtlen);
+	copy[len + 1 + txtlen] = '\0';
 
-static int DKIM_SIGINFO_getowner(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	hash = aux_kcache_hash(key, len);
+	ent = &cache->table[hash % cache->size];
 
-	auxL_getref(L, siginfo->dkim);
-	DKIM_checkself(L, -1);
+	free(ent->name);
 
-	return 1;
-} /* DKIM_SIGINFO_getowner() */
+	ent->hash = hash;
+	ent->name = copy;
+	ent->txt = copy + len + 1;
+	ent->expires = expires;
+	ent->refresh = 0;
+	ent->failures = 0;
 
-static int DKIM_SIGINFO_get_sigsubstring_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
-	unsigned char buf_[256];
-	void *buf;
-	size_t bufsiz;
-	int top;
-	DKIM_STAT stat;
+	return 0;
+} /* aux_kcache_store() */
 
-	top = lua_gettop(L);
-	buf = buf_;
-	bufsiz = sizeof buf;
+/*
+ * Write the live records to a uniquely named file beside path and rename
+ * it into place, so a reader never sees a partial snapshot and processes
+ * sharing path never mix their records.
+ */
+static int aux_kcache_save(struct aux_kcache *cache, const char *path, double now) {
+	struct aux_kcache_header hdr;
+	struct aux_kcache_record rec;
+	struct aux_kentry *ent;
+	FILE *fp;
+	char *tmp;
+	size_t i;
+	int error;
 
-	goto again;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, AUX_KCACHE_MAGIC, sizeof hdr.magic);
+	hdr.byteorder = AUX_KCACHE_BYTEORDER;
 
-	do {
-		if (SIZE_MAX / 2 < bufsiz)
-			return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+	for (i = 0; i < cache->size; i++) {
+		if (cache->table[i].hash && cache->table[i].expires > now)
+			hdr.nrecords++;
+	}
 
-		lua_settop(L, top);
-		bufsiz *= 2;
-		buf = lua_newuserdata(L, bufsiz);
-again:
-		stat = dkim_get_sigsubstring(dkim->ctx, siginfo->ctx, buf, &bufsiz);
-	} while (stat == DKIM_STAT_NORESOURCE);
+	if (!(fp = aux_tmpopen(&tmp, path)))
+		return errno;
 
-	if (stat != DKIM_STAT_OK)
-		return auxL_pushstat(L, stat, "~$#");
+	if (1 != fwrite(&hdr, sizeof hdr, 1, fp))
+		goto syerr;
 
-	lua_pushlstring(L, buf, strnlen(buf, bufsiz));
+	for (i = 0; i < cache->size; i++) {
+		ent = &cache->table[i];
 
-	return 1;
-} /* DKIM_SIGINFO_get_sigsubstring_() */
+		if (!ent->hash || ent->expires <= now)
+			continue;
 
-static int DKIM_SIGINFO_get_sigsubstring(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+		memset(&rec, 0, sizeof rec);
+		rec.expires = (int64_t)ent->expires;
+		rec.namelen = strlen(ent->name);
+		rec.txtlen = strlen(ent->txt);
 
-	return DKIM_SIGINFO_get_sigsubstring_(L, dkim, siginfo);
-} /* DKIM_SIGINFO_get_sigsubstring() */
+		if (1 != fwrite(&rec, sizeof rec, 1, fp)
+		||  rec.namelen != fwrite(ent->name, 1, rec.namelen, fp)
+		||  rec.txtlen != fwrite(ent->txt, 1, rec.txtlen, fp))
+			goto syerr;
+	}
 
-static int DKIM_SIGINFO_gethashes(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
-	void *hh = NULL, *bh = NULL;
-	size_t hhlen = 0, bhlen = 0;
-	DKIM_STAT stat;
+	return aux_tmpcommit(fp, tmp, path);
+syerr:
+	error = errno;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_gethashes(siginfo->ctx, &hh, &hhlen, &bh, &bhlen)))
-		return auxL_pushstat(L, stat, "~$#");
+	aux_tmpabort(fp, tmp);
 
-	lua_pushlstring(L, hh, hhlen);
-	lua_pushlstring(L, bh, bhlen);
+	return error;
+} /* aux_kcache_save() */
 
-	return 2;
-} /* DKIM_SIGINFO_gethashes() */
+/*
+ * Merge the snapshot at path into the cache, replacing any entries whose
+ * slots the snapshot's records fall into.
+ */
+static int aux_kcache_load(struct aux_kcache *cache, const char *path, double now) {
+	struct aux_kcache_header hdr;
+	struct aux_kcache_record rec;
+	char name[AUX_KEYDB_MAXNAME];
+	char *txt = NULL;
+	FILE *fp;
+	uint32_t i;
+	int error;
+
+	if (!(fp = fopen(path, "rb")))
+		return errno;
 
-static int DKIM_SIGINFO__gc(lua_State *L) {
-	DKIM_SIGINFO_State *siginfo = luaL_checkudata(L, 1, "DKIM_SIGINFO*");
+	if (1 != fread(&hdr, sizeof hdr, 1, fp)
+	||  memcmp(hdr.magic, AUX_KCACHE_MAGIC, sizeof hdr.magic)
+	||  hdr.byteorder != AUX_KCACHE_BYTEORDER)
+		goto invalid;
 
-	siginfo->ctx = NULL;
-	auxL_unref(L, &siginfo->dkim);
+	if (!(txt = malloc(AUX_KCACHE_MAXTXT + 1)))
+		goto syerr;
 
-	return 0;
-} /* DKIM_SIGINFO__gc() */
+	for (i = 0; i < hdr.nrecords; i++) {
+		if (1 != fread(&rec, sizeof rec, 1, fp)
+		||  rec.namelen == 0 || rec.namelen >= sizeof name
+		||  rec.txtlen > AUX_KCACHE_MAXTXT
+		||  rec.namelen != fread(name, 1, rec.namelen, fp)
+		||  rec.txtlen != fread(txt, 1, rec.txtlen, fp))
+			goto invalid;
 
-static luaL_Reg DKIM_SIGINFO_methods[] = {
-	{ "getbh", DKIM_SIGINFO_getbh },
-	{ "getcanonlen", DKIM_SIGINFO_getcanonlen },
-	{ "getcanons", DKIM_SIGINFO_getcanons },
-	{ "getdnssec", DKIM_SIGINFO_getdnssec },
-	{ "getdomain", DKIM_SIGINFO_getdomain },
-	{ "geterror", DKIM_SIGINFO_geterror },
-	{ "getflags", DKIM_SIGINFO_getflags },
-	{ "getidentity", DKIM_SIGINFO_getidentity },
-	{ "getkeysize", DKIM_SIGINFO_getkeysize },
-	{ "getqueries", DKIM_SIGINFO_getqueries },
-	{ "getreportinfo", DKIM_SIGINFO_getreportinfo },
-	{ "getselector", DKIM_SIGINFO_getselector },
-	{ "getsignalg", DKIM_SIGINFO_getsignalg },
-	{ "getsslbuf", DKIM_SIGINFO_getsslbuf },
-	{ "hdrsigned", DKIM_SIGINFO_hdrsigned },
-	{ "ignore", DKIM_SIGINFO_ignore },
-	{ "process", DKIM_SIGINFO_process },
-#if HAVE_DKIM_SIG_SETDNSSEC
-	{ "setdnssec", DKIM_SIGINFO_setdnssec },
-#endif
-	{ "seterror", DKIM_SIGINFO_seterror },
-	{ "get_sigsubstring", DKIM_SIGINFO_get_sigsubstring },
-	{ "gethashes", DKIM_SIGINFO_gethashes },
+		name[rec.namelen] = '\0';
 
-	/* auxiliary module routines */
-	{ "getowner", DKIM_SIGINFO_getowner },
-	{ NULL,    NULL },
-}; /* DKIM_SIGINFO_methods[] */
+		if ((double)rec.expires <= now)
+			continue;
 
-static luaL_Reg DKIM_SIGINFO_metamethods[] = {
-	{ "__gc", &DKIM_SIGINFO__gc },
-	{ NULL,   NULL },
-}; /* DKIM_SIGINFO_metamethods[] */
+		if ((error = aux_kcache_store(cache, name, txt, rec.txtlen, rec.expires)))
+			goto error;
+	}
+
+	free(txt);
+	fclose(fp);
+
+	return 0;
+invalid:
+	error = (ferror(fp))? errno : EINVAL;
+	goto error;
+syerr:
+	error = errno;
+error:
+	free(txt);
+	fclose(fp);
+
+	return error;
+} /* aux_kcache_load() */
 
 
 /*
- * (DKIM *) B I N D I N G S
+ * V E R I F I C A T I O N  C A C H E
+ *
+ * Direct-mapped table of per-signature verification outcomes, indexed by
+ * a hash of the canonicalized header hash, the body hash and the b= value
+ * of a signature. Entries keep full copies of all three and are only
+ * matched byte-for-byte, so the index hash need not be collision
+ * resistant. A hash of the key record used to verify the signature is
+ * also kept, so an entry can be rejected when the record has since
+ * changed.
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static DKIM_State *DKIM_checkself(lua_State *L, int index) {
-	DKIM_State *dkim = luaL_checkudata(L, index, "DKIM*");
+#define AUX_VCACHE_MAXHASH 64 /* SHA-512 would be the largest digest */
+
+struct aux_vresult {
+	int error;
+	int bh;
+	unsigned flags;
+	unsigned keybits;
+}; /* struct aux_vresult */
+
+struct aux_ventry {
+	uint64_t hash; /* 0 if the entry is empty */
+	unsigned char hh[AUX_VCACHE_MAXHASH], bh[AUX_VCACHE_MAXHASH];
+	size_t hhlen, bhlen;
+	char *b;
+	uint64_t keyhash;
+	double expires;
+	struct aux_vresult result;
+}; /* struct aux_ventry */
+
+struct aux_vcache {
+	struct aux_ventry *table;
+	size_t size;
+	double ttl;
+	unsigned long hits, misses;
+}; /* struct aux_vcache */
+
+static uint64_t aux_vcache_hash(const void *hh, size_t hhlen, const void *bh, size_t bhlen, const char *b) {
+	uint64_t h = AUX_FNV1A_INIT;
+
+	h = aux_fnv1a(h, hh, hhlen);
+	h = aux_fnv1a(h, bh, bhlen);
+	h = aux_fnv1a(h, b, strlen(b));
+
+	return (h)? h : 1;
+} /* aux_vcache_hash() */
+
+static void aux_vcache_close(struct aux_vcache *cache) {
+	size_t i;
 
-	luaL_argcheck(L, dkim->ctx, index, "attempt to use a closed DKIM handle");
+	for (i = 0; i < cache->size; i++)
+		free(cache->table[i].b);
 
-	return dkim;
-} /* DKIM_checkself() */
+	free(cache->table);
+	cache->table = NULL;
+	cache->size = 0;
+} /* aux_vcache_close() */
 
-static DKIM_State *DKIM_checkref(lua_State *L, auxref_t ref) {
-	DKIM_State *dkim;
+static int aux_vcache_open(struct aux_vcache *cache, size_t size, double ttl) {
+	aux_vcache_close(cache);
 
-	auxL_getref(L, ref);
-	dkim = DKIM_checkself(L, -1);
-	lua_pop(L, 1);
+	if (size && !(cache->table = calloc(size, sizeof *cache->table)))
+		return errno;
 
-	return dkim;
-} /* DKIM_checkref() */
+	cache->size = size;
+	cache->ttl = ttl;
 
-static DKIM_State *DKIM_prep(lua_State *L, int index) {
-	DKIM_State *dkim;
+	return 0;
+} /* aux_vcache_open() */
 
-	index = lua_absindex(L, index);
+/*
+ * Return the live entry for the given hashes and b= value, or NULL. The
+ * entry must have been verified with the key record hashing to keyhash,
+ * so nothing is served while the record is unknown.
+ */
+static const struct aux_ventry *aux_vcache_find(struct aux_vcache *cache, const void *hh, size_t hhlen, const void *bh, size_t bhlen, const char *b, uint64_t keyhash, double now) {
+	uint64_t hash;
+	struct aux_ventry *ent;
+
+	if (!cache->size)
+		return NULL;
+
+	hash = aux_vcache_hash(hh, hhlen, bh, bhlen, b);
+	ent = &cache->table[hash % cache->size];
+
+	if (!keyhash
+	||  ent->hash != hash
+	||  ent->hhlen != hhlen || memcmp(ent->hh, hh, hhlen)
+	||  ent->bhlen != bhlen || memcmp(ent->bh, bh, bhlen)
+	||  strcmp(ent->b, b)
+	||  ent->expires <= now
+	||  keyhash != ent->keyhash) {
+		cache->misses++;
+
+		return NULL;
+	}
 
-	dkim = lua_newuserdata(L, sizeof *dkim);
-	*dkim = DKIM_initializer;
-	luaL_setmetatable(L, "DKIM*");
+	cache->hits++;
 
-	auxL_ref(L, index, &dkim->ref.lib);
-	dkim->lib = lua_touserdata(L, index);
+	return ent;
+} /* aux_vcache_find() */
 
-	return dkim;
-} /* DKIM_prep() */
+static void aux_vcache_store(struct aux_vcache *cache, const void *hh, size_t hhlen, const void *bh, size_t bhlen, const char *b, uint64_t keyhash, const struct aux_vresult *result, double now) {
+	uint64_t hash;
+	struct aux_ventry *ent;
+	char *copy;
 
-static int DKIM_geterror(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	/* without the key record a later hit couldn't be checked against it */
+	if (!cache->size || !keyhash || hhlen > AUX_VCACHE_MAXHASH || bhlen > AUX_VCACHE_MAXHASH)
+		return;
 
-	lua_pushstring(L, dkim_geterror(dkim->ctx));
+	if (!(copy = strdup(b)))
+		return;
 
-	return 1;
-} /* DKIM_geterror() */
+	hash = aux_vcache_hash(hh, hhlen, bh, bhlen, b);
+	ent = &cache->table[hash % cache->size];
 
-static int DKIM_getmode(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	free(ent->b);
 
-	lua_pushinteger(L, dkim_getmode(dkim->ctx));
+	ent->hash = hash;
+	memcpy(ent->hh, hh, hhlen);
+	ent->hhlen = hhlen;
+	memcpy(ent->bh, bh, bhlen);
+	ent->bhlen = bhlen;
+	ent->b = copy;
+	ent->keyhash = keyhash;
+	ent->expires = now + cache->ttl;
+	ent->result = *result;
+} /* aux_vcache_store() */
 
-	return 1;
-} /* DKIM_getmode() */
 
-static int DKIM_get_signer(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+/*
+ * H E A V Y  H I T T E R S
+ *
+ * Space-saving sketch (Metwally et al.) over (domain, selector) pairs.
+ * A fixed number of counters is kept in a min-heap ordered by count. An
+ * unseen pair takes over the counter with the smallest count, inheriting
+ * that count as its error bound, so every pair with a true frequency above
+ * total/size is guaranteed a counter. Counters are found through a chained
+ * hash index over the slots.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-	lua_pushstring(L, (const char *)dkim_get_signer(dkim->ctx));
+#define AUX_TOPK_MAXNAME 256
 
-	return 1;
-} /* DKIM_get_signer() */
+struct aux_topk_slot {
+	uint64_t hash;
+	char domain[AUX_TOPK_MAXNAME];
+	char selector[AUX_TOPK_MAXNAME];
 
-static int DKIM_add_querymethod(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const char *method = luaL_checkstring(L, 2);
-	const char *options = luaL_checkstring(L, 3);
-	DKIM_STAT stat;
+	unsigned long count; /* overestimates by at most error */
+	unsigned long error;
 
-	if (DKIM_STAT_OK != (stat = dkim_add_querymethod(dkim->ctx, method, options)))
-		return auxL_pushstat(L, stat, "0$#");
+	unsigned long passed, failed;
+	unsigned long lookups;
+	double lookuptime;
+	unsigned keybits; /* of the last signature verified */
 
-	lua_pushboolean(L, 1);
+	size_t heappos;
+	size_t next; /* hash chain, or SIZE_MAX */
+}; /* struct aux_topk_slot */
 
-	return 1;
-} /* DKIM_add_querymethod() */
+struct aux_topk {
+	struct aux_topk_slot *slot;
+	size_t *heap; /* slot indices, ordered by count */
+	size_t *bucket; /* chain heads, or SIZE_MAX */
+	size_t size, used, nbuckets;
+}; /* struct aux_topk */
 
-static int DKIM_add_xtag(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const char *tag = luaL_checkstring(L, 2);
-	const char *value = luaL_checkstring(L, 3);
-	DKIM_STAT stat;
+static void aux_topk_close(struct aux_topk *tk) {
+	free(tk->slot);
+	free(tk->heap);
+	free(tk->bucket);
+	memset(tk, 0, sizeof *tk);
+} /* aux_topk_close() */
 
-	if (DKIM_STAT_OK != (stat = dkim_add_xtag(dkim->ctx, tag, value)))
-		return auxL_pushstat(L, stat, "0$#");
+static int aux_topk_open(struct aux_topk *tk, size_t size) {
+	size_t i;
 
-	lua_pushboolean(L, 1);
+	aux_topk_close(tk);
 
-	return 1;
-} /* DKIM_add_xtag() */
+	if (!size)
+		return 0;
 
-static int DKIM_getpartial(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	tk->nbuckets = 2 * size;
 
-	lua_pushboolean(L, dkim_getpartial(dkim->ctx));
+	if (!(tk->slot = calloc(size, sizeof *tk->slot))
+	||  !(tk->heap = calloc(size, sizeof *tk->heap))
+	||  !(tk->bucket = calloc(tk->nbuckets, sizeof *tk->bucket))) {
+		int error = errno;
 
-	return 1;
-} /* DKIM_getpartial() */
+		aux_topk_close(tk);
 
-static int DKIM_getsighdr(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	size_t initial = luaL_optinteger(L, 2, strlen(DKIM_SIGNHEADER) + 2);
-	unsigned char *hdr = NULL;
-	size_t len = 0;
-	DKIM_STAT stat;
+		return error;
+	}
 
-	if (DKIM_STAT_OK != (stat = dkim_getsighdr_d(dkim->ctx, initial, &hdr, &len)))
-		return auxL_pushstat(L, stat, "~$#");
+	for (i = 0; i < tk->nbuckets; i++)
+		tk->bucket[i] = SIZE_MAX;
 
-	lua_pushlstring(L, (char *)hdr, len);
+	tk->size = size;
 
-	return 1;
-} /* DKIM_getsighdr() */
+	return 0;
+} /* aux_topk_open() */
 
-static int DKIM_privkey_load(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_STAT stat;
+static void aux_topk_swap(struct aux_topk *tk, size_t i, size_t j) {
+	size_t t = tk->heap[i];
 
-	if (DKIM_STAT_OK != (stat = dkim_privkey_load(dkim->ctx)))
-		return auxL_pushstat(L, stat, "0$#");
+	tk->heap[i] = tk->heap[j];
+	tk->heap[j] = t;
+	tk->slot[tk->heap[i]].heappos = i;
+	tk->slot[tk->heap[j]].heappos = j;
+} /* aux_topk_swap() */
 
-	lua_pushboolean(L, 1);
+/* restore heap order after the count at heap position i grew */
+static void aux_topk_sink(struct aux_topk *tk, size_t i) {
+	size_t l, r, min;
 
-	return 1;
-} /* DKIM_privkey_load() */
+	for (;;) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
 
-static int DKIM_set_margin(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	int margin = luaL_optinteger(L, 2, DKIM_HDRMARGIN);
-	DKIM_STAT stat;
+		if (l < tk->used && tk->slot[tk->heap[l]].count < tk->slot[tk->heap[min]].count)
+			min = l;
+		if (r < tk->used && tk->slot[tk->heap[r]].count < tk->slot[tk->heap[min]].count)
+			min = r;
 
-	if (DKIM_STAT_OK != (stat = dkim_set_margin(dkim->ctx, margin)))
-		return auxL_pushstat(L, stat, "0$#");
+		if (min == i)
+			return;
 
-	lua_pushboolean(L, 1);
+		aux_topk_swap(tk, i, min);
+		i = min;
+	}
+} /* aux_topk_sink() */
 
-	return 1;
-} /* DKIM_set_margin() */
+static void aux_topk_unlink(struct aux_topk *tk, size_t n) {
+	size_t *p = &tk->bucket[tk->slot[n].hash % tk->nbuckets];
 
-static int DKIM_set_signer(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const void *signer = luaL_checkstring(L, 2);
-	DKIM_STAT stat;
+	while (*p != n)
+		p = &tk->slot[*p].next;
 
-	if (DKIM_STAT_OK != (stat = dkim_set_signer(dkim->ctx, signer)))
-		return auxL_pushstat(L, stat, "0$#");
+	*p = tk->slot[n].next;
+} /* aux_topk_unlink() */
 
-	lua_pushboolean(L, 1);
+/*
+ * Count one more occurrence of (domain, selector) and return its counter,
+ * or NULL if the sketch is disabled.
+ */
+static struct aux_topk_slot *aux_topk_hit(struct aux_topk *tk, const char *domain, const char *selector) {
+	char key[2 * AUX_TOPK_MAXNAME];
+	struct aux_topk_slot *slot;
+	size_t dlen, slen, n, b;
+	uint64_t hash;
 
-	return 1;
-} /* DKIM_set_signer() */
+	if (!tk->size)
+		return NULL;
 
-static int DKIM_setpartial(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	_Bool value = auxL_checkboolean(L, 2);
-	DKIM_STAT stat;
+	dlen = strnlen(domain, AUX_TOPK_MAXNAME - 1);
+	slen = strnlen(selector, AUX_TOPK_MAXNAME - 1);
 
-	if (DKIM_STAT_OK != (stat = dkim_setpartial(dkim->ctx, value)))
-		return auxL_pushstat(L, stat, "0$#");
+	for (n = 0; n < dlen; n++)
+		key[n] = tolower((unsigned char)domain[n]);
 
-	lua_pushboolean(L, 1);
+	key[dlen] = '\0';
 
-	return 1;
-} /* DKIM_setpartial() */
+	for (n = 0; n < slen; n++)
+		key[dlen + 1 + n] = tolower((unsigned char)selector[n]);
 
-static int DKIM_signhdrs(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const char **hdrlist;
-	size_t i, n;
-	DKIM_STAT stat;
+	hash = aux_fnv1a(AUX_FNV1A_INIT, key, dlen + 1 + slen);
+	b = hash % tk->nbuckets;
 
-	luaL_checktype(L, 2, LUA_TTABLE);
-	n = lua_rawlen(L, 2);
+	for (n = tk->bucket[b]; n != SIZE_MAX; n = tk->slot[n].next) {
+		slot = &tk->slot[n];
 
-	hdrlist = lua_newuserdata(L, sizeof *hdrlist * (n + 1));
+		if (slot->hash == hash && !strncmp(slot->domain, key, dlen + 1)
+		&&  strlen(slot->selector) == slen && !memcmp(slot->selector, key + dlen + 1, slen))
+			goto found;
+	}
 
-	for (i = 0; i < n; i++) {
-		lua_rawgeti(L, 2, i + 1);
-		hdrlist[i] = luaL_checkstring(L, -1);
-		lua_pop(L, 1);
+	if (tk->used < tk->size) {
+		n = tk->used++;
+		slot = &tk->slot[n];
+		memset(slot, 0, sizeof *slot);
+		tk->heap[n] = n;
+		slot->heappos = n;
+	} else {
+		/* take over the least frequent counter */
+		n = tk->heap[0];
+		slot = &tk->slot[n];
+		aux_topk_unlink(tk, n);
+
+		slot->error = slot->count;
+		slot->passed = slot->failed = slot->lookups = 0;
+		slot->lookuptime = 0;
+		slot->keybits = 0;
 	}
 
-	hdrlist[n] = NULL;
+	slot->hash = hash;
+	memcpy(slot->domain, key, dlen + 1);
+	memcpy(slot->selector, key + dlen + 1, slen);
+	slot->selector[slen] = '\0';
+	slot->next = tk->bucket[b];
+	tk->bucket[b] = n;
+found:
+	slot->count++;
+	aux_topk_sink(tk, slot->heappos);
 
-	if (DKIM_STAT_OK != (stat = dkim_signhdrs(dkim->ctx, hdrlist)))
-		return auxL_pushstat(L, stat, "0$#");
+	return slot;
+} /* aux_topk_hit() */
 
-	lua_pushboolean(L, 1);
 
-	return 1;
-} /* DKIM_signhdrs() */
+/*
+ * (DKIM_LIB_State *) and (DKIM_State *) D E F I N I T I O N S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static int DKIM_getsiglist(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO **siglist = NULL;
-	int sigcount = 0, i;
-	DKIM_STAT stat;
+#define DKIM_ALGSTATS_MAX 8 /* dkim_alg_t values tracked */
 
-	if (DKIM_STAT_OK != (stat = dkim_getsiglist(dkim->ctx, &siglist, &sigcount)))
-		return auxL_pushstat(L, stat, "~$#");
+struct DKIM_flight { /* see DKIM_coalesce */
+	struct DKIM_flight *next;
+	char name[AUX_KEYDB_MAXNAME]; /* normalized query name */
+	const void *lead; /* DKIM_State issuing the lookup, or NULL */
+	unsigned gen; /* bumped whenever the lead changes hands */
+	int waiters; /* handles parked on the answer */
+	_Bool done;
+	DKIM_CBSTAT stat;
+	char *txt;
+}; /* struct DKIM_flight */
 
-	lua_createtable(L, sigcount, 0);
+#define DKIM_EARLY_ANY     0x01 /* stop after any passing signature */
+#define DKIM_EARLY_ALIGNED 0x02 /* "" one aligned with the From domain */
+#define DKIM_EARLY_LISTED  0x04 /* "" one from a listed domain */
 
-	for (i = 0; i < sigcount; i++) {
-		DKIM_SIGINFO_push(L, 1, siglist[i]);
-		lua_rawseti(L, -2, i + 1);
-	}
+typedef struct {
+	DKIM_LIB *ctx;
 
-	return 1;
-} /* DKIM_getsiglist() */
+	auxref_t final; /* reference key to Lua callback function */
+	auxref_t key_lookup; /* "" (for asynchronous DNS) */
+	auxref_t prescreen; /* "" */
 
-static int DKIM_getsignature(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO *siginfo;
+	auxref_t keystore; /* DKIM_KEYSTORE* used when signing without a key */
+	auxref_t prefetch; /* key prefetch callback, see DKIM_header */
 
-	if (!(siginfo = dkim_getsignature(dkim->ctx)))
-		return 0;
+	struct { /* synchronous DNS callbacks */
+		lua_State *L; /* callback thread */
+		auxref_t thread; /* reference key to thread */
+		auxref_t start;
+		auxref_t cancel;
+		auxref_t waitreply;
+		auxref_t trustanchor;
 
-	DKIM_SIGINFO_push(L, 1, siginfo);
+		/*
+		 * NB: only one query can be live at any time because we're
+		 * single-threaded, the old-style DNS callbacks are
+		 * synchronous, and libopendkim always calls start,
+		 * waitreply, and cancel in sequence.
+		 */
+		void *buf;
+		size_t bufsiz;
 
-	return 1;
-} /* DKIM_getsignature() */
+		double deadline; /* of the DKIM handle issuing queries, or 0 */
+	} dns;
 
-static int DKIM_getsslbuf(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	struct aux_keydb keydb; /* consulted before key_lookup */
+	struct aux_kcache kcache; /* key_lookup answers, see DKIM_on_key_lookup_ */
+	char *kcachepath; /* key cache snapshot, saved on __gc */
 
-	lua_pushstring(L, dkim_getsslbuf(dkim->ctx));
+	struct { /* key cache refreshes, see DKIM_kcache_lookup */
+		double grace; /* serve expired records this long */
+		double ahead; /* refresh hot records this long before expiry */
+		struct aux_topk hot; /* hits per domain and selector */
+	} krefresh;
 
-	return 1;
-} /* DKIM_getsslbuf() */
-
-static int DKIM_getuser(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	struct { /* C modules' callbacks, see opendkim-lua.h */
+		struct {
+			opendkim_lua_key_lookup_f *f;
+			void *arg;
+		} key_lookup;
 
-	lua_pushstring(L, (const char *)dkim_getuser(dkim->ctx));
+		struct {
+			opendkim_lua_siglist_f *f;
+			void *arg;
+		} prescreen, final;
+	} native;
+
+	struct { /* single-flight key lookups, see DKIM_coalesce */
+		auxref_t wait; /* parks a handle until woken */
+		auxref_t wake; /* "" wakes parked handles */
+		struct DKIM_flight *flights;
+	} coalesce;
+
+	struct aux_vcache vcache; /* verification outcomes, see DKIM_on_final */
+
+	struct aux_topk domstats; /* per domain and selector, see DKIM_domstats */
+
+	struct { /* dkim:eom cost by signing algorithm, see DKIM_algstats */
+		unsigned long count, passed, failed;
+		double time;
+	} algstats[DKIM_ALGSTATS_MAX];
+
+	struct { /* see DKIM_early_exit */
+		int flags; /* DKIM_EARLY_* */
+		char **domain; /* sorted for bsearch(3) */
+		size_t count;
+	} early;
+
+	struct { /* per message, or 0 for none; see DKIM_header_ */
+		unsigned long signatures, headers, lookups;
+		size_t hdrbytes;
+	} limits;
+} DKIM_LIB_State;
 
-	return 1;
-} /* DKIM_getuser() */
+static const DKIM_LIB_State DKIM_LIB_initializer = {
+	.ctx = NULL,
+	.final = LUA_NOREF,
+	.key_lookup = LUA_NOREF,
+	.prescreen = LUA_NOREF,
+	.keystore = LUA_NOREF,
+	.prefetch = LUA_NOREF,
+	.dns = {
+		.L = NULL,
+		.thread = LUA_NOREF,
+		.start = LUA_NOREF,
+		.cancel = LUA_NOREF,
+		.waitreply = LUA_NOREF,
+		.trustanchor = LUA_NOREF,
+	},
+	.coalesce = { .wait = LUA_NOREF, .wake = LUA_NOREF },
+};
 
-static int DKIM_minbody(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+#define DKIM_CB_FINAL      0x01
+#define DKIM_CB_KEY_LOOKUP 0x02
+#define DKIM_CB_PRESCREEN  0x04
+#define DKIM_CB_PARK       0x08 /* waiting on another handle's key lookup */
+#define DKIM_CB_EARLY      0x10 /* verifying ahead of libopendkim, see DKIM_early_exit */
 
-	lua_pushinteger(L, dkim_minbody(dkim->ctx));
+#define DKIM_PREFETCH_MAX 8 /* DKIM-Signature fields prefetched per message */
 
-	return 1;
-} /* DKIM_minbody() */
+#define DKIM_PREFETCH_PENDING 1
+#define DKIM_PREFETCH_EXEC    2
+#define DKIM_PREFETCH_DONE    3
 
-static int DKIM_ohdrs(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = (lua_isnoneornil(L, 2))? NULL : DKIM_SIGINFO_checkself(L, 2);
-	unsigned char **hdrlist;
-	int hdrlimit = (128 / 2), hdrcount, i;
-	DKIM_STAT stat;
+#define DKIM_SIGSTATE_MAX 16 /* signatures per message tracked */
 
-	/* loop, doubling the array size until the list fits */
-	do {
-		lua_settop(L, 2);
+#define DKIM_REFRESH_MAX     4  /* key cache refreshes queued per message */
+#define DKIM_REFRESH_TIMEOUT 30 /* seconds before a lost refresh is reissued */
+#define DKIM_REFRESH_BACKOFF 5  /* doublings of the above after failures */
 
-		if (INT_MAX / 2 < hdrlimit)
-			goto overflow;
+#define DKIM_BODYBUF_DEFAULT 0 /* coalesce body writes smaller than this */
 
-		hdrlimit *= 2;
+#define DKIM_PUMP_BUFSIZ  16384   /* initial dkim:pump buffer */
+#define DKIM_PUMP_MAXHDR  1048576 /* largest header section dkim:pump buffers */
+#define DKIM_PUMP_DEFAULT 65536   /* default dkim:pump maxbytes */
 
-		if (SIZE_MAX / sizeof *hdrlist < (size_t)hdrlimit)
-			goto overflow;
+#define DKIM_PUMP_HEADER 0
+#define DKIM_PUMP_EOH    1 /* header parsed, waiting on dkim:eoh */
+#define DKIM_PUMP_BODY   2
 
-		hdrlist = lua_newuserdata(L, sizeof *hdrlist * hdrlimit);
+#define DKIM_INFLATE_BUFSIZ 65536 /* compressed input read at a time */
 
-		hdrcount = hdrlimit;
-		if (DKIM_STAT_OK != (stat = dkim_ohdrs(dkim->ctx, siginfo->ctx, hdrlist, &hdrcount)))
-			return auxL_pushstat(L, stat, "~$#");
-	} while (hdrcount > hdrlimit);
+#define DKIM_CODEC_NONE 0
+#define DKIM_CODEC_GZIP 1
+#define DKIM_CODEC_ZSTD 2
 
-	lua_createtable(L, hdrcount, 0);
+#define DKIM_SMTP_BOL   0 /* at the start of a line */
+#define DKIM_SMTP_MID   1
+#define DKIM_SMTP_DOT   2 /* after a leading dot */
+#define DKIM_SMTP_DOTCR 3 /* after a leading dot and CR */
+#define DKIM_SMTP_END   4 /* saw the terminating CRLF.CRLF */
 
-	for (i = 0; i < hdrcount; i++) {
-		lua_pushstring(L, (char *)hdrlist[i]);
-		lua_rawseti(L, -2, i + 1);
-	}
+/* per-signature bookkeeping for the verification cache and domain stats */
+struct DKIM_sigstate {
+	DKIM_SIGINFO *siginfo;
+	uint64_t keyhash; /* of the key record delivered, or 0 */
+	_Bool hit; /* result below was taken from the cache */
+	struct aux_vresult result;
 
-	return 1;
-overflow:
-	return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
-} /* DKIM_ohdrs() */
+	double begin; /* key_lookup first deferred, or 0 */
+	double lookup; /* seconds waiting on key_lookup */
+	_Bool looked; /* key_lookup completed */
+}; /* struct DKIM_sigstate */
 
-static int DKIM_sig_getcanonlen(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
-	ssize_t msglen, canonlen, signlen;
-	DKIM_STAT stat;
+typedef struct {
+	DKIM *ctx;
+	DKIM_LIB_State *lib;
 
-	if (DKIM_STAT_OK != (stat = dkim_sig_getcanonlen(dkim->ctx, siginfo->ctx, &msglen, &canonlen, &signlen)))
-		return auxL_pushstat(L, stat, "~$#");
+	struct aux_arena arena; /* per-message memclosure */
 
-	lua_pushinteger(L, msglen);
-	lua_pushinteger(L, canonlen);
-	lua_pushinteger(L, signlen);
+	double deadline; /* monotonic time, or 0 if none */
 
-	return 3;
-} /* DKIM_sig_getcanonlen() */
+	dkim_alg_t signalg; /* of signing handles */
+	double eomtime; /* spent in dkim_eom, summed over retries */
 
-static int DKIM_sig_getidentity(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = (lua_isnoneornil(L, 2))? NULL : DKIM_SIGINFO_checkself(L, 2);
+	struct {
+		char *data; /* allocated on first use */
+		size_t size; /* 0 if disabled */
+		size_t count;
+	} bodybuf;
 
-	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
-} /* DKIM_sig_getidentity() */
+	struct {
+		char *data;
+		size_t size, head, tail; /* unconsumed data is [head, tail) */
+		int state;
+		_Bool eoh; /* dkim:eoh succeeded */
+		_Bool notee; /* dkim:tee descriptors aren't both pipes */
 
-static int DKIM_sig_getqueries(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+		struct {
+			char *data;
+			size_t size, head, tail; /* unwritten data is [head, tail) */
+		} out; /* read but not yet written to dkim:tee's out_fd */
+	} pump;
 
-	return DKIM_SIGINFO_getqueries_(L, dkim, siginfo);
-} /* DKIM_sig_getqueries() */
+	int smtp; /* dkim:feed_smtp_data DKIM_SMTP_* state */
 
-static int DKIM_sig_getreportinfo(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+	struct { /* counted against lib->limits */
+		unsigned long signatures, headers, lookups;
+		size_t hdrbytes;
+		uint64_t *keys; /* hashes of the lookups distinct keys */
+	} usage;
 
-	return DKIM_SIGINFO_getreportinfo_(L, dkim, siginfo);
-} /* DKIM_sig_getreportinfo() */
+	struct {
+		int codec; /* DKIM_CODEC_* */
+		char *data; /* compressed input */
+		size_t head, tail;
+		_Bool eof; /* of the compressed input */
+		_Bool boundary; /* a gzip member or zstd frame just ended */
+		_Bool end; /* of the decompressed stream */
+#if HAVE_ZLIB
+		z_stream zs;
+#endif
+#if HAVE_ZSTD
+		ZSTD_DStream *zds;
+#endif
+	} inflate;
 
-static int DKIM_sig_process(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+	struct {
+		auxref_t lib; /* DKIM_LIB_State anchor */
+		auxref_t txt; /* key_lookup txt string anchor */
+		auxref_t key; /* signing key, for dkim:stamper */
+	} ref;
 
-	return DKIM_SIGINFO_process_(L, dkim, siginfo);
-} /* DKIM_sig_process() */
+	struct {
+		int exec;
+		int done;
 
-static int DKIM_header(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	void *hdr;
-	size_t len;
-	DKIM_STAT stat;
+		struct {
+			DKIM_SIGINFO **siglist;
+			int sigcount;
 
-	hdr = (void *)luaL_checklstring(L, 2, &len);
+			DKIM_CBSTAT stat;
+		} final;
 
-	if (DKIM_STAT_OK != (stat = dkim_header(dkim->ctx, hdr, len)))
-		return auxL_pushstat(L, stat, "0$#");
+		struct {
+			DKIM_SIGINFO *siginfo;
 
-	lua_pushboolean(L, 1);
+			const char *txt;
+			double ttl; /* for the key cache, or 0 for its default */
+			DKIM_CBSTAT stat;
+		} key_lookup;
 
-	return 1;
-} /* DKIM_header() */
+		struct {
+			DKIM_SIGINFO **siglist;
+			int sigcount;
 
-static int DKIM_eoh(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_STAT stat;
+			DKIM_CBSTAT stat;
+		} prescreen;
+	} cb;
 
-	if (DKIM_STAT_OK != (stat = dkim_eoh(dkim->ctx)))
-		return auxL_pushstat(L, stat, "0$#");
+	struct {
+		struct {
+			char name[AUX_KEYDB_MAXNAME]; /* selector._domainkey.domain */
+			const char *txt; /* key record, if the callback returned one */
+			auxref_t ref; /* txt string anchor */
+			int state;
+		} entry[DKIM_PREFETCH_MAX];
+		int count;
+	} prefetch;
 
-	lua_pushboolean(L, 1);
+	struct {
+		struct DKIM_sigstate entry[DKIM_SIGSTATE_MAX];
+		int count;
+	} sigs;
 
-	return 1;
-} /* DKIM_eoh() */
+	struct { /* stale or hot key cache records, see dkim:getrefresh */
+		DKIM_SIGINFO *siginfo[DKIM_REFRESH_MAX];
+		int count;
+	} refresh;
 
-static int DKIM_body(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	void *body;
-	size_t len;
-	DKIM_STAT stat;
+	struct DKIM_flight *parked; /* key lookup waited on, see DKIM_coalesce */
+	unsigned parkgen; /* parked->gen when parked */
 
-	body = (void *)luaL_checklstring(L, 2, &len);
+	struct {
+		DKIM_SIGINFO *signature; /* overrides dkim_getsignature */
+	} vcache;
 
-	if (DKIM_STAT_OK != (stat = dkim_body(dkim->ctx, body, len)))
-		return auxL_pushstat(L, stat, "0$#");
+	struct {
+		int next; /* siglist index DKIM_early_exit resumes at */
+	} early;
+} DKIM_State;
 
-	lua_pushboolean(L, 1);
+static const DKIM_State DKIM_initializer = {
+	.arena = AUX_ARENA_INITIALIZER,
+	.signalg = -1,
+	.bodybuf = { .size = DKIM_BODYBUF_DEFAULT },
+	.ref = { .lib = LUA_NOREF, .txt = LUA_NOREF, .key = LUA_NOREF },
+	.cb = {
+		.key_lookup = { .stat = DKIM_CBSTAT_ERROR },
+		.prescreen = { .stat = DKIM_CBSTAT_ERROR },
+	},
+};
 
-	return 1;
-} /* DKIM_body() */
+static DKIM_State *DKIM_checkself(lua_State *L, int index);
+static DKIM_State *DKIM_checkref(lua_State *L, auxref_t ref);
+static DKIM_STAT DKIM_flush(DKIM_State *dkim);
+static DKIM_STAT DKIM_vcache_store(DKIM_State *dkim, DKIM_STAT stat, _Bool *testkey);
+static void DKIM_LIB_kcache_store(DKIM_LIB_State *lib, const char *name, const char *txt, double ttl);
+static DKIM_STAT DKIM_pump_header(DKIM_State *dkim, _Bool eof, _Bool *prefetch);
 
-static int DKIM_eom(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_STAT stat;
-	_Bool testkey;
+static _Bool DKIM_expired(DKIM_State *dkim) {
+	return dkim->deadline > 0 && aux_monotime() >= dkim->deadline;
+} /* DKIM_expired() */
 
-	if (DKIM_STAT_OK != (stat = dkim_eom(dkim->ctx, &testkey)))
-		return auxL_pushstat(L, stat, "0$#");
+/*
+ * Bracket libopendkim calls which may issue queries, so that the
+ * old-style DNS hooks can see the deadline of the handle.
+ */
+static void DKIM_enter(DKIM_State *dkim) {
+	dkim->lib->dns.deadline = dkim->deadline;
+} /* DKIM_enter() */
 
-	lua_pushboolean(L, 1);
-	lua_pushboolean(L, testkey);
+/*
+ * Return the bookkeeping for siginfo, adding it if create is set and
+ * there is room.
+ */
+static struct DKIM_sigstate *DKIM_sigstate(DKIM_State *dkim, DKIM_SIGINFO *siginfo, _Bool create) {
+	int i;
 
-	return 2;
-} /* DKIM_eom() */
+	for (i = 0; i < dkim->sigs.count; i++) {
+		if (dkim->sigs.entry[i].siginfo == siginfo)
+			return &dkim->sigs.entry[i];
+	}
 
-static int DKIM_chunk(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	void *chunk;
-	size_t len;
-	DKIM_STAT stat;
+	if (!create || dkim->sigs.count >= DKIM_SIGSTATE_MAX)
+		return NULL;
 
-	chunk = (void *)luaL_optlstring(L, 2, NULL, &len);
+	i = dkim->sigs.count++;
+	memset(&dkim->sigs.entry[i], 0, sizeof dkim->sigs.entry[i]);
+	dkim->sigs.entry[i].siginfo = siginfo;
 
-	if (DKIM_STAT_OK != (stat = dkim_chunk(dkim->ctx, chunk, len))) {
-		if (stat == DKIM_STAT_CBTRYAGAIN) {
-			/*
-			 * NB: dkim_chunk cannot recover if dkim_eoh fails.
-			 * Calling dkim_chunk again after the callback will
-			 * simply result in a perplexing DKIM_STAT_INVALID
-			 * error.
-			 *
-			 * For non-blocking DNS the caller should use
-			 * dkim_header, dkim_eoh, and dkim_body.
-			 *
-			 * TODO: Implement our own restartable dkim_chunk.
-			 */
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, "dkim_chunk not restartable");
-			lua_pushinteger(L, DKIM_STAT_CBINVALID);
+	return &dkim->sigs.entry[i];
+} /* DKIM_sigstate() */
 
-			return 3;
-		}
+/* cached outcome for siginfo, or NULL if libopendkim verified it */
+static const struct aux_vresult *DKIM_vcache_result(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	struct DKIM_sigstate *sig = DKIM_sigstate(dkim, siginfo, 0);
 
-		return auxL_pushstat(L, stat, "0$#");
-	}
+	return (sig && sig->hit)? &sig->result : NULL;
+} /* DKIM_vcache_result() */
 
-	lua_pushboolean(L, 1);
+static DKIM_STAT DKIM_leave(DKIM_State *dkim, DKIM_STAT stat) {
+	dkim->lib->dns.deadline = 0;
 
-	return 1;
-} /* DKIM_chunk() */
+	if (stat != DKIM_STAT_OK && DKIM_expired(dkim))
+		return DKIM_STAT_TIMEOUT;
 
-static int DKIM_getid(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
+	return stat;
+} /* DKIM_leave() */
 
-	lua_pushstring(L, dkim_getid(dkim->ctx));
+/* normalized query name of a signature's key, or 0 if it doesn't fit */
+static size_t DKIM_keyname(char dst[AUX_KEYDB_MAXNAME], DKIM_SIGINFO *siginfo) {
+	char name[AUX_KEYDB_MAXNAME];
 
-	return 1;
-} /* DKIM_getid() */
+	if ((size_t)snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo)) >= sizeof name)
+		return 0;
 
-#if 0 /* not implemented (documentation out of date) */
-static int DKIM_get_msgdate(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	uint64_t ts;
+	return aux_keydb_normalize(dst, name, strlen(name));
+} /* DKIM_keyname() */
 
-	if (0 == (ts = dkim_get_msgdate(dkim->ctx))) {
-		lua_pushboolean(L, 0);
-		lua_pushliteral(L, "Date: header field was not found, or one was found but could not be parsed, or the feature was not enabled when the DKIM library was compiled");
+static struct DKIM_flight *DKIM_LIB_flight(DKIM_LIB_State *lib, const char *name) {
+	struct DKIM_flight *fl;
 
-		return 2;
+	for (fl = lib->coalesce.flights; fl; fl = fl->next) {
+		if (!strcmp(fl->name, name))
+			return fl;
 	}
 
-	lua_pushnumber(L, ts);
+	return NULL;
+} /* DKIM_LIB_flight() */
 
-	return 1;
-} /* DKIM_get_msgdate() */
-#endif
+/* free fl once no handle is issuing or waiting on it */
+static void DKIM_LIB_flight_release(DKIM_LIB_State *lib, struct DKIM_flight *fl) {
+	struct DKIM_flight **p;
 
-static int DKIM_get_sigsubstring(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+	if (fl->waiters > 0 || (fl->lead && !fl->done))
+		return;
 
-	return DKIM_SIGINFO_get_sigsubstring_(L, dkim, siginfo);
-} /* DKIM_get_sigsubstring() */
+	for (p = &lib->coalesce.flights; *p; p = &(*p)->next) {
+		if (*p == fl) {
+			*p = fl->next;
+			free(fl->txt);
+			free(fl);
 
-static int DKIM_key_syntax(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const char *src;
-	size_t len;
-	unsigned char *buf;
-	DKIM_STAT stat;
+			return;
+		}
+	}
+} /* DKIM_LIB_flight_release() */
 
-	src = luaL_checklstring(L, 2, &len);
-	buf = lua_newuserdata(L, len + 1);
-	memcpy(buf, src, len + 1);
+/* a notification, so errors are discarded */
+static void DKIM_LIB_wake(lua_State *L, DKIM_LIB_State *lib, const char *name) {
+	if (lib->coalesce.wake == LUA_NOREF)
+		return;
 
-	if (DKIM_STAT_OK != (stat = dkim_key_syntax(dkim->ctx, buf, len)))
-		return auxL_pushstat(L, stat, "0$#");
+	auxL_getref(L, lib->coalesce.wake);
+	lua_pushstring(L, name);
 
-	lua_pushboolean(L, 1);
+	if (LUA_OK != lua_pcall(L, 1, 0, 0))
+		lua_pop(L, 1);
+} /* DKIM_LIB_wake() */
 
-	return 1;
-} /* DKIM_key_syntax() */
+/*
+ * Hand the answer to a key lookup this handle issued to the handles
+ * parked on it. Called as soon as the answer is posted, so no handle can
+ * park again between the wake up and the answer becoming available.
+ */
+static void DKIM_resolve(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO *siginfo, DKIM_CBSTAT stat, const char *txt) {
+	char name[AUX_KEYDB_MAXNAME];
+	struct DKIM_flight *fl;
+	int waiters;
 
-static int DKIM_post_final(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_CBSTAT stat = auxL_checkcbstat(L, 2);
+	if (!DKIM_keyname(name, siginfo) || !(fl = DKIM_LIB_flight(dkim->lib, name)) || fl->lead != dkim)
+		return;
 
-	dkim->cb.final.stat = stat;
+	fl->lead = NULL;
+
+	/* otherwise a parked handle takes the lookup over */
+	if (!txt || (fl->txt = strdup(txt))) {
+		fl->stat = stat;
+		fl->done = 1;
+	}
+
+	waiters = fl->waiters;
+	DKIM_LIB_flight_release(dkim->lib, fl);
+
+	if (waiters)
+		DKIM_LIB_wake(L, dkim->lib, name);
+} /* DKIM_resolve() */
+
+/*
+ * Give up a key lookup this handle issued without an answer, as when the
+ * answer posted is invalid. A parked handle takes it over.
+ */
+static void DKIM_forfeit(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	char name[AUX_KEYDB_MAXNAME];
+	struct DKIM_flight *fl;
+	int waiters;
+
+	if (!DKIM_keyname(name, siginfo) || !(fl = DKIM_LIB_flight(dkim->lib, name)) || fl->lead != dkim)
+		return;
+
+	fl->lead = NULL;
+
+	waiters = fl->waiters;
+	DKIM_LIB_flight_release(dkim->lib, fl);
+
+	if (waiters)
+		DKIM_LIB_wake(L, dkim->lib, name);
+} /* DKIM_forfeit() */
+
+/*
+ * Drop the handle's part in any key lookup as it's closed. Handles parked
+ * on a lookup it was issuing are woken to take it over, unless wake is
+ * false because we're in a finalizer, which mustn't call back into Lua
+ * code. Those handles then take it over when their wait times out.
+ */
+static void DKIM_abandon(lua_State *L, DKIM_State *dkim, _Bool wake) {
+	char name[AUX_KEYDB_MAXNAME] = "";
+	struct DKIM_flight *fl, *next;
+
+	for (fl = dkim->lib->coalesce.flights; fl; fl = next) {
+		next = fl->next;
+
+		if (fl == dkim->parked)
+			fl->waiters--;
+
+		if (fl->lead == dkim) {
+			fl->lead = NULL;
+
+			if (fl->waiters > 0)
+				memcpy(name, fl->name, sizeof name);
+		}
+
+		DKIM_LIB_flight_release(dkim->lib, fl);
+	}
+
+	dkim->parked = NULL;
+
+	if (*name && wake)
+		DKIM_LIB_wake(L, dkim->lib, name);
+} /* DKIM_abandon() */
+
+typedef struct {
+	DKIM_SIGINFO *ctx;
+	auxref_t dkim;
+} DKIM_SIGINFO_State;
+
+static const DKIM_SIGINFO_State DKIM_SIGINFO_initializer = {
+	.dkim = LUA_NOREF,
+}; /* DKIM_SIGINFO_initializer */
+
+static DKIM_SIGINFO_State *DKIM_SIGINFO_checkself(lua_State *L, int index);
+
+/*
+ * Queries are allocated from the signature's arena, so each is copied into
+ * its userdata and stays usable after the DKIM handle is closed.
+ */
+typedef struct {
+	int type;
+	char *name; /* follows the structure in the same userdata */
+} DKIM_QUERYINFO_State;
+
+static const DKIM_QUERYINFO_State DKIM_QUERYINFO_initializer = { .type = -1 };
+
+
+/*
+ * (DKIM_QUERYINFO *) B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static DKIM_QUERYINFO_State *DKIM_QUERYINFO_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "DKIM_QUERYINFO*");
+} /* DKIM_QUERYINFO_checkself() */
+
+static DKIM_QUERYINFO_State *DKIM_QUERYINFO_push(lua_State *L, DKIM_QUERYINFO *ctx) {
+	const char *name = dkim_qi_getname(ctx);
+	size_t len = (name)? strlen(name) : 0;
+	DKIM_QUERYINFO_State *qryinfo;
+
+	qryinfo = lua_newuserdata(L, sizeof *qryinfo + len + 1);
+	*qryinfo = DKIM_QUERYINFO_initializer;
+	qryinfo->type = dkim_qi_gettype(ctx);
+	qryinfo->name = (char *)(qryinfo + 1);
+	memcpy(qryinfo->name, (name)? name : "", len + 1);
+	luaL_setmetatable(L, "DKIM_QUERYINFO*");
+
+	return qryinfo;
+} /* DKIM_QUERYINFO_push() */
+
+static int DKIM_QUERYINFO_getname(lua_State *L) {
+	DKIM_QUERYINFO_State *qryinfo = DKIM_QUERYINFO_checkself(L, 1);
+
+	lua_pushstring(L, qryinfo->name);
+
+	return 1;
+} /* DKIM_QUERYINFO_getname() */
+
+static int DKIM_QUERYINFO_gettype(lua_State *L) {
+	DKIM_QUERYINFO_State *qryinfo = DKIM_QUERYINFO_checkself(L, 1);
+
+	if (qryinfo->type == -1)
+		return 0;
+
+	lua_pushinteger(L, qryinfo->type);
+
+	return 1;
+} /* DKIM_QUERYINFO_gettype() */
+
+static luaL_Reg DKIM_QUERYINFO_methods[] = {
+	{ "getname", &DKIM_QUERYINFO_getname },
+	{ "gettype", &DKIM_QUERYINFO_gettype },
+	{ NULL, NULL },
+}; /* DKIM_QUERYINFO_methods[] */
+
+static luaL_Reg DKIM_QUERYINFO_metamethods[] = {
+	{ NULL,   NULL },
+}; /* DKIM_QUERYINFO_metamethods[] */
+
+
+/*
+ * (DKIM_SIGINFO *) B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static DKIM_SIGINFO_State *DKIM_SIGINFO_checkself(lua_State *L, int index) {
+	DKIM_SIGINFO_State *siginfo = luaL_checkudata(L, index, "DKIM_SIGINFO*");
+	DKIM_State *dkim;
+
+	/* siginfo lives in the owning handle's arena, freed by dkim:close */
+	auxL_getref(L, siginfo->dkim);
+	dkim = luaL_testudata(L, -1, "DKIM*");
+	lua_pop(L, 1);
+
+	luaL_argcheck(L, siginfo->ctx && dkim && dkim->ctx, index, "attempt to use a closed DKIM_SIGINFO handle");
+
+	return siginfo;
+} /* DKIM_SIGINFO_checkself() */
+
+static DKIM_SIGINFO_State *DKIM_SIGINFO_prep(lua_State *L, int index) {
+	DKIM_SIGINFO_State *siginfo;
+
+	index = lua_absindex(L, index);
+
+	siginfo = lua_newuserdata(L, sizeof *siginfo);
+	*siginfo = DKIM_SIGINFO_initializer;
+	luaL_setmetatable(L, "DKIM_SIGINFO*");
+
+	auxL_ref(L, index, &siginfo->dkim);
+
+	return siginfo;
+} /* DKIM_SIGINFO_prep() */
+
+static DKIM_SIGINFO_State *DKIM_SIGINFO_push(lua_State *L, int index, DKIM_SIGINFO *ctx) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_prep(L, index);
+
+	siginfo->ctx = ctx;
+
+	return siginfo;
+} /* DKIM_SIGINFO_push() */
+
+static int DKIM_SIGINFO_getbh(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const struct aux_vresult *cached = DKIM_vcache_result(DKIM_checkref(L, siginfo->dkim), siginfo->ctx);
+
+	lua_pushinteger(L, (cached)? cached->bh : dkim_sig_getbh(siginfo->ctx));
+
+	return 1;
+} /* DKIM_SIGINFO_getbh() */
+
+static int DKIM_SIGINFO_getcanonlen(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+	ssize_t msglen, canonlen, signlen;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_getcanonlen(dkim->ctx, siginfo->ctx, &msglen, &canonlen, &signlen)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, msglen);
+	lua_pushinteger(L, canonlen);
+	lua_pushinteger(L, signlen);
+
+	return 3;
+} /* DKIM_SIGINFO_getcanonlen() */
+
+static int DKIM_SIGINFO_getcanons(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	dkim_canon_t hdr, body;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_getcanons(siginfo->ctx, &hdr, &body)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, hdr);
+	lua_pushinteger(L, body);
+
+	return 2;
+} /* DKIM_SIGINFO_getcanons() */
+
+static int DKIM_SIGINFO_getdnssec(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+
+	lua_pushinteger(L, dkim_sig_getdnssec(siginfo->ctx));
+
+	return 1;
+} /* DKIM_SIGINFO_getdnssec() */
+
+static int DKIM_SIGINFO_getdomain(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const void *domain = dkim_sig_getdomain(siginfo->ctx);
+
+	lua_pushstring(L, domain);
+
+	return 1;
+} /* DKIM_SIGINFO_getdomain() */
+
+static int DKIM_SIGINFO_geterror(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const struct aux_vresult *cached = DKIM_vcache_result(DKIM_checkref(L, siginfo->dkim), siginfo->ctx);
+
+	lua_pushinteger(L, (cached)? cached->error : dkim_sig_geterror(siginfo->ctx));
+
+	return 1;
+} /* DKIM_SIGINFO_geterror() */
+
+static int DKIM_SIGINFO_getflags(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const struct aux_vresult *cached = DKIM_vcache_result(DKIM_checkref(L, siginfo->dkim), siginfo->ctx);
+
+	lua_pushinteger(L, (cached)? cached->flags : dkim_sig_getflags(siginfo->ctx));
+
+	return 1;
+} /* DKIM_SIGINFO_getflags() */
+
+static int DKIM_SIGINFO_getidentity_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
+	unsigned char buf_[256];
+	void *buf;
+	size_t bufsiz;
+	int top;
+	DKIM_STAT stat;
+
+	top = lua_gettop(L);
+	buf = buf_;
+	bufsiz = sizeof buf;
+
+	goto again;
+
+	do {
+		if (SIZE_MAX / 2 < bufsiz)
+			return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+
+		lua_settop(L, top);
+		bufsiz *= 2;
+		buf = lua_newuserdata(L, bufsiz);
+again:
+		stat = dkim_sig_getidentity(dkim->ctx, siginfo->ctx, buf, bufsiz);
+	} while (stat == DKIM_STAT_NORESOURCE);
+
+	if (stat != DKIM_STAT_OK)
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushlstring(L, buf, strnlen(buf, bufsiz));
+
+	return 1;
+} /* DKIM_SIGINFO_getidentity_() */
+
+static int DKIM_SIGINFO_getidentity(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+
+	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
+} /* DKIM_SIGINFO_getidentity() */
+
+static int DKIM_SIGINFO_getqueries_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
+	DKIM_QUERYINFO **list = NULL;
+	unsigned int n = 0, i;
+	DKIM_STAT stat;
+
+	/* list is allocated from the handle's arena, so it's never freed */
+	if (DKIM_STAT_OK != (stat = dkim_sig_getqueries(dkim->ctx, siginfo->ctx, &list, &n)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_createtable(L, n, 0);
+
+	for (i = 0; i < n; i++) {
+		DKIM_QUERYINFO_push(L, list[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+} /* DKIM_SIGINFO_getqueries_() */
+
+static int DKIM_SIGINFO_getqueries(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+
+	return DKIM_SIGINFO_getqueries_(L, dkim, siginfo);
+} /* DKIM_SIGINFO_getqueries() */
+
+static int DKIM_SIGINFO_getkeysize(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const struct aux_vresult *cached = DKIM_vcache_result(DKIM_checkref(L, siginfo->dkim), siginfo->ctx);
+	unsigned int bits;
+	DKIM_STAT stat;
+
+	if (cached)
+		bits = cached->keybits;
+	else if (DKIM_STAT_OK != (stat = dkim_sig_getkeysize(siginfo->ctx, &bits)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, bits);
+
+	return 1;
+} /* DKIM_SIGINFO_getkeysize() */
+
+static int DKIM_SIGINFO_getreportinfo_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
+	(void)L; (void)dkim; (void)siginfo;
+
+	/*
+	 * NB: dkim_sig_getreportinfo doesn't appear to support asynchronous
+	 * DNS. We may need to re-implement this routine in Lua.
+	 */
+
+	return 0;
+} /* DKIM_SIGINFO_getreportinfo_() */
+
+static int DKIM_SIGINFO_getreportinfo(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+
+	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
+} /* DKIM_SIGINFO_getreportinfo() */
+
+static int DKIM_SIGINFO_getselector(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	const void *selector = dkim_sig_getselector(siginfo->ctx);
+
+	lua_pushstring(L, selector);
+
+	return 1;
+} /* DKIM_SIGINFO_getselector() */
+
+static int DKIM_SIGINFO_getsignalg(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	dkim_alg_t alg;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_getsignalg(siginfo->ctx, &alg)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, alg);
+
+	return 1;
+} /* DKIM_SIGINFO_getsignalg() */
+
+static int DKIM_SIGINFO_getsslbuf(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+
+	lua_pushstring(L, dkim_sig_getsslbuf(siginfo->ctx));
+
+	return 1;
+} /* DKIM_SIGINFO_getsslbuf() */
+
+static int DKIM_SIGINFO_hdrsigned(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	unsigned char *hdr = (void *)luaL_checkstring(L, 2);
+
+	lua_pushboolean(L, dkim_sig_hdrsigned(siginfo->ctx, hdr));
+
+	return 1;
+} /* DKIM_SIGINFO_hdrsigned() */
+
+static int DKIM_SIGINFO_ignore(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+
+	dkim_sig_ignore(siginfo->ctx);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_SIGINFO_ignore() */
+
+static int DKIM_SIGINFO_process_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
+	DKIM_STAT stat;
+
+	if (DKIM_expired(dkim))
+		return auxL_pushstat(L, DKIM_STAT_TIMEOUT, "0$#");
+
+	DKIM_enter(dkim);
+	stat = DKIM_leave(dkim, dkim_sig_process(dkim->ctx, siginfo->ctx));
+
+	if (DKIM_STAT_OK != stat)
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_SIGINFO_process_() */
+
+static int DKIM_SIGINFO_process(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+
+	return DKIM_SIGINFO_process_(L, dkim, siginfo);
+} /* DKIM_SIGINFO_process() */
+
+#if HAVE_DKIM_SIG_SETDNSSEC
+static int DKIM_SIGINFO_setdnssec(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	int status = luaL_checkinteger(L, 2);
+
+	dkim_sig_setdnssec(siginfo->ctx, status);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_SIGINFO_setdnssec() */
+#endif
+
+static int DKIM_SIGINFO_seterror(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	int error = luaL_checkinteger(L, 2);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_seterror(siginfo->ctx, error)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_SIGINFO_seterror() */
+
+static int DKIM_SIGINFO_getowner(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+
+	auxL_getref(L, siginfo->dkim);
+	DKIM_checkself(L, -1);
+
+	return 1;
+} /* DKIM_SIGINFO_getowner() */
+
+static int DKIM_SIGINFO_get_sigsubstring_(lua_State *L, DKIM_State *dkim, DKIM_SIGINFO_State *siginfo) {
+	unsigned char buf_[256];
+	void *buf;
+	size_t bufsiz;
+	int top;
+	DKIM_STAT stat;
+
+	top = lua_gettop(L);
+	buf = buf_;
+	bufsiz = sizeof buf;
+
+	goto again;
+
+	do {
+		if (SIZE_MAX / 2 < bufsiz)
+			return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+
+		lua_settop(L, top);
+		bufsiz *= 2;
+		buf = lua_newuserdata(L, bufsiz);
+again:
+		stat = dkim_get_sigsubstring(dkim->ctx, siginfo->ctx, buf, &bufsiz);
+	} while (stat == DKIM_STAT_NORESOURCE);
+
+	if (stat != DKIM_STAT_OK)
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushlstring(L, buf, strnlen(buf, bufsiz));
+
+	return 1;
+} /* DKIM_SIGINFO_get_sigsubstring_() */
+
+static int DKIM_SIGINFO_get_sigsubstring(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	DKIM_State *dkim = DKIM_checkref(L, siginfo->dkim);
+
+	return DKIM_SIGINFO_get_sigsubstring_(L, dkim, siginfo);
+} /* DKIM_SIGINFO_get_sigsubstring() */
+
+static int DKIM_SIGINFO_gethashes(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 1);
+	void *hh = NULL, *bh = NULL;
+	size_t hhlen = 0, bhlen = 0;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_gethashes(siginfo->ctx, &hh, &hhlen, &bh, &bhlen)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushlstring(L, hh, hhlen);
+	lua_pushlstring(L, bh, bhlen);
+
+	return 2;
+} /* DKIM_SIGINFO_gethashes() */
+
+static int DKIM_SIGINFO__gc(lua_State *L) {
+	DKIM_SIGINFO_State *siginfo = luaL_checkudata(L, 1, "DKIM_SIGINFO*");
+
+	siginfo->ctx = NULL;
+	auxL_unref(L, &siginfo->dkim);
+
+	return 0;
+} /* DKIM_SIGINFO__gc() */
+
+static luaL_Reg DKIM_SIGINFO_methods[] = {
+	{ "getbh", DKIM_SIGINFO_getbh },
+	{ "getcanonlen", DKIM_SIGINFO_getcanonlen },
+	{ "getcanons", DKIM_SIGINFO_getcanons },
+	{ "getdnssec", DKIM_SIGINFO_getdnssec },
+	{ "getdomain", DKIM_SIGINFO_getdomain },
+	{ "geterror", DKIM_SIGINFO_geterror },
+	{ "getflags", DKIM_SIGINFO_getflags },
+	{ "getidentity", DKIM_SIGINFO_getidentity },
+	{ "getkeysize", DKIM_SIGINFO_getkeysize },
+	{ "getqueries", DKIM_SIGINFO_getqueries },
+	{ "getreportinfo", DKIM_SIGINFO_getreportinfo },
+	{ "getselector", DKIM_SIGINFO_getselector },
+	{ "getsignalg", DKIM_SIGINFO_getsignalg },
+	{ "getsslbuf", DKIM_SIGINFO_getsslbuf },
+	{ "hdrsigned", DKIM_SIGINFO_hdrsigned },
+	{ "ignore", DKIM_SIGINFO_ignore },
+	{ "process", DKIM_SIGINFO_process },
+#if HAVE_DKIM_SIG_SETDNSSEC
+	{ "setdnssec", DKIM_SIGINFO_setdnssec },
+#endif
+	{ "seterror", DKIM_SIGINFO_seterror },
+	{ "get_sigsubstring", DKIM_SIGINFO_get_sigsubstring },
+	{ "gethashes", DKIM_SIGINFO_gethashes },
+
+	/* auxiliary module routines */
+	{ "getowner", DKIM_SIGINFO_getowner },
+	{ NULL,    NULL },
+}; /* DKIM_SIGINFO_methods[] */
+
+static luaL_Reg DKIM_SIGINFO_metamethods[] = {
+	{ "__gc", &DKIM_SIGINFO__gc },
+	{ NULL,   NULL },
+}; /* DKIM_SIGINFO_metamethods[] */
+
+
+/*
+ * (DKIM_STAMP *) B I N D I N G S
+ *
+ * Sign-once, stamp-many. A stamper is taken from a signing handle after
+ * dkim:eom, and re-signs the same message for copies which differ only in
+ * their headers. The DKIM-Signature header of the original, with its b=
+ * value removed, is kept as a template, so the body hash (bh=), tag order
+ * and folding are reused verbatim and only the header hash and the public
+ * key operation are repeated for each copy.
+ *
+ * libopendkim has no interface for supplying a precomputed body hash, so
+ * header canonicalization and signing are done here with libcrypto.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if HAVE_OPENSSL
+
+#define DKIM_STAMP_MAXSIG 1024 /* 8192-bit RSA */
+
+typedef struct {
+	EVP_PKEY *pkey;
+	const EVP_MD *md;
+	_Bool ed25519; /* signs the digest itself, RFC 8463 */
+	_Bool relaxed; /* header canonicalization */
+
+	auxref_t tmpl; /* DKIM-Signature field with an empty b= */
+	size_t bpos; /* offset of the b= value in tmpl */
+	auxref_t hlist; /* h= value */
+} DKIM_STAMP_State;
+
+static const DKIM_STAMP_State DKIM_STAMP_initializer = {
+	.tmpl = LUA_NOREF,
+	.hlist = LUA_NOREF,
+};
+
+static DKIM_STAMP_State *DKIM_STAMP_checkself(lua_State *L, int index) {
+	DKIM_STAMP_State *stamp = luaL_checkudata(L, index, "DKIM_STAMP*");
+
+	luaL_argcheck(L, stamp->pkey, index, "attempt to use a closed DKIM_STAMP handle");
+
+	return stamp;
+} /* DKIM_STAMP_checkself() */
+
+#define DKIM_STAMP_ISWSP(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/*
+ * Locate the value of tag in a tag=value list, with surrounding FWS
+ * removed. The value extends to the next semicolon.
+ */
+static _Bool DKIM_STAMP_tag(const char *src, size_t len, const char *tag, size_t *vp, size_t *vpe) {
+	size_t p = 0, np, ne, taglen = strlen(tag);
+
+	while (p < len) {
+		while (p < len && DKIM_STAMP_ISWSP(src[p]))
+			p++;
+
+		np = p;
+
+		while (p < len && src[p] != '=' && src[p] != ';')
+			p++;
+
+		ne = p;
+
+		while (ne > np && DKIM_STAMP_ISWSP(src[ne - 1]))
+			ne--;
+
+		if (p < len && src[p] == '=') {
+			*vp = ++p;
+
+			while (p < len && src[p] != ';')
+				p++;
+
+			*vpe = p;
+
+			if (ne - np == taglen && !memcmp(src + np, tag, taglen))
+				return 1;
+		}
+
+		p++; /* skip ; */
+	}
+
+	return 0;
+} /* DKIM_STAMP_tag() */
+
+/*
+ * Feed one header field to the digest, canonicalized and terminated by
+ * CRLF if crlf is set.
+ */
+static void DKIM_STAMP_canon(EVP_MD_CTX *md, _Bool relaxed, const char *src, size_t len, _Bool crlf) {
+	char buf[256];
+	size_t n = 0, p = 0;
+	_Bool wsp = 0, lead = 1;
+
+	while (len > 0 && (src[len - 1] == '\n' || src[len - 1] == '\r'))
+		len--;
+
+	if (!relaxed) {
+		EVP_DigestUpdate(md, src, len);
+
+		if (crlf)
+			EVP_DigestUpdate(md, "\r\n", 2);
+
+		return;
+	}
+
+#define PUTC(c) do { \
+	if (n == sizeof buf) { EVP_DigestUpdate(md, buf, n); n = 0; } \
+	buf[n++] = (c); \
+} while (0)
+
+	/* field name, lowercased and without trailing WSP */
+	for (; p < len && src[p] != ':'; p++) {
+		if (DKIM_STAMP_ISWSP(src[p])) {
+			wsp = 1;
+		} else {
+			if (wsp)
+				PUTC(' ');
+
+			wsp = 0;
+			PUTC(tolower((unsigned char)src[p]));
+		}
+	}
+
+	PUTC(':');
+	wsp = 0;
+
+	/* field value, unfolded with WSP runs compressed and trimmed */
+	for (p++; p < len; p++) {
+		if (DKIM_STAMP_ISWSP(src[p])) {
+			wsp = 1;
+		} else {
+			if (wsp && !lead)
+				PUTC(' ');
+
+			wsp = 0;
+			lead = 0;
+			PUTC(src[p]);
+		}
+	}
+
+	if (crlf) {
+		PUTC('\r');
+		PUTC('\n');
+	}
+
+	EVP_DigestUpdate(md, buf, n);
+#undef PUTC
+} /* DKIM_STAMP_canon() */
+
+/* compare the field name of hdr to name, ignoring case and trailing WSP */
+static _Bool DKIM_STAMP_isfield(const char *hdr, size_t hdrlen, const char *name, size_t namelen) {
+	size_t n = 0;
+
+	while (n < hdrlen && hdr[n] != ':')
+		n++;
+
+	if (n == hdrlen)
+		return 0;
+
+	while (n > 0 && DKIM_STAMP_ISWSP(hdr[n - 1]))
+		n--;
+
+	return n == namelen && !strncasecmp(hdr, name, n);
+} /* DKIM_STAMP_isfield() */
+
+/*
+ * Create a stamper from the signature header hdr (without the field name)
+ * and the private key at index key.
+ */
+static int DKIM_STAMP_new(lua_State *L, const char *hdr, size_t hdrlen, int key) {
+	DKIM_STAMP_State *stamp;
+	size_t vp, vpe;
+	const char *keystr;
+	size_t keylen;
+
+	key = lua_absindex(L, key);
+	keystr = luaL_checklstring(L, key, &keylen);
+
+	stamp = lua_newuserdata(L, sizeof *stamp);
+	*stamp = DKIM_STAMP_initializer;
+	luaL_setmetatable(L, "DKIM_STAMP*");
+
+	if (!DKIM_STAMP_tag(hdr, hdrlen, "a", &vp, &vpe))
+		return auxL_pushstat(L, DKIM_STAT_SYNTAX, "~$#");
+
+	while (vp < vpe && DKIM_STAMP_ISWSP(hdr[vp]))
+		vp++;
+
+	if (!strncmp(hdr + vp, "rsa-sha256", 10)) {
+		stamp->md = EVP_sha256();
+	} else if (!strncmp(hdr + vp, "rsa-sha1", 8)) {
+		stamp->md = EVP_sha1();
+#if defined EVP_PKEY_ED25519
+	} else if (!strncmp(hdr + vp, "ed25519-sha256", 14)) {
+		stamp->md = EVP_sha256();
+		stamp->ed25519 = 1;
+#endif
+	} else {
+		return auxL_pushstat(L, DKIM_STAT_INVALID, "~$#");
+	}
+
+	if (DKIM_STAMP_tag(hdr, hdrlen, "c", &vp, &vpe)) {
+		while (vp < vpe && DKIM_STAMP_ISWSP(hdr[vp]))
+			vp++;
+
+		stamp->relaxed = !strncmp(hdr + vp, "relaxed", 7);
+	}
+
+	if (!DKIM_STAMP_tag(hdr, hdrlen, "h", &vp, &vpe))
+		return auxL_pushstat(L, DKIM_STAT_SYNTAX, "~$#");
+
+	lua_pushlstring(L, hdr + vp, vpe - vp);
+	auxL_ref(L, -1, &stamp->hlist);
+	lua_pop(L, 1);
+
+	if (!DKIM_STAMP_tag(hdr, hdrlen, "b", &vp, &vpe))
+		return auxL_pushstat(L, DKIM_STAT_SYNTAX, "~$#");
+
+	/* the b= value, including any FWS within it, hashes as empty */
+	lua_pushstring(L, DKIM_SIGNHEADER ": ");
+	lua_pushlstring(L, hdr, vp);
+	lua_pushlstring(L, hdr + vpe, hdrlen - vpe);
+	lua_concat(L, 3);
+	auxL_ref(L, -1, &stamp->tmpl);
+	lua_pop(L, 1);
+	stamp->bpos = strlen(DKIM_SIGNHEADER) + 2 + vp;
+
+	if (!(stamp->pkey = aux_loadkey(keystr, keylen)))
+		return auxL_pushstat(L, DKIM_STAT_NOKEY, "~$#");
+
+	if (EVP_PKEY_size(stamp->pkey) > DKIM_STAMP_MAXSIG) {
+		EVP_PKEY_free(stamp->pkey);
+		stamp->pkey = NULL;
+
+		return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+	}
+
+	return 1;
+} /* DKIM_STAMP_new() */
+
+/*
+ * stamper:sign(headers) - Return the DKIM-Signature value for a copy of
+ * the message with the given header fields, in message order.
+ */
+static int DKIM_STAMP_sign(lua_State *L) {
+	DKIM_STAMP_State *stamp = DKIM_STAMP_checkself(L, 1);
+	unsigned char digest[EVP_MAX_MD_SIZE], sig[DKIM_STAMP_MAXSIG];
+	char b64[((DKIM_STAMP_MAXSIG + 2) / 3) * 4 + 1];
+	unsigned int digestlen;
+	size_t siglen = sizeof sig, hlen, tmpllen, p, pe, i, n;
+	const char *hlist, *tmpl, *hdr;
+	unsigned char *used;
+	EVP_MD_CTX *md = NULL;
+	EVP_PKEY_CTX *pctx = NULL;
+	DKIM_STAT stat = DKIM_STAT_INTERNAL;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	n = lua_rawlen(L, 2);
+
+	/* check up front, as a Lua error further down would leak md */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 2, i);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "expected array of strings");
+		lua_pop(L, 1);
+	}
+
+	used = lua_newuserdata(L, n + 1);
+	memset(used, 0, n + 1);
+
+	auxL_getref(L, stamp->hlist);
+	hlist = lua_tolstring(L, -1, &hlen);
+	auxL_getref(L, stamp->tmpl);
+	tmpl = lua_tolstring(L, -1, &tmpllen);
+
+	if (!(md = EVP_MD_CTX_create()) || !EVP_DigestInit_ex(md, stamp->md, NULL))
+		goto done;
+
+	/* each h= name selects the last unused instance of the field */
+	for (p = 0; p < hlen; p = pe + 1) {
+		size_t np, ne;
+
+		for (pe = p; pe < hlen && hlist[pe] != ':'; pe++)
+			;
+
+		for (np = p; np < pe && DKIM_STAMP_ISWSP(hlist[np]); np++)
+			;
+
+		for (ne = pe; ne > np && DKIM_STAMP_ISWSP(hlist[ne - 1]); ne--)
+			;
+
+		for (i = n; i > 0; i--) {
+			size_t len;
+
+			if (used[i])
+				continue;
+
+			lua_rawgeti(L, 2, i);
+			hdr = lua_tolstring(L, -1, &len);
+
+			if (DKIM_STAMP_isfield(hdr, len, hlist + np, ne - np)) {
+				DKIM_STAMP_canon(md, stamp->relaxed, hdr, len, 1);
+				used[i] = 1;
+				lua_pop(L, 1);
+
+				break;
+			}
+
+			lua_pop(L, 1);
+		}
+	}
+
+	/* the signature field itself comes last, without a trailing CRLF */
+	DKIM_STAMP_canon(md, stamp->relaxed, tmpl, tmpllen, 0);
+
+	if (!EVP_DigestFinal_ex(md, digest, &digestlen))
+		goto done;
+
+	if (stamp->ed25519) {
+		EVP_MD_CTX_destroy(md);
+
+		if (!(md = EVP_MD_CTX_create()))
+			goto done;
+		if (1 != EVP_DigestSignInit(md, NULL, NULL, NULL, stamp->pkey))
+			goto done;
+		if (1 != EVP_DigestSign(md, sig, &siglen, digest, digestlen))
+			goto done;
+	} else {
+		if (!(pctx = EVP_PKEY_CTX_new(stamp->pkey, NULL)))
+			goto done;
+		if (1 != EVP_PKEY_sign_init(pctx))
+			goto done;
+		if (1 != EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING))
+			goto done;
+		if (1 != EVP_PKEY_CTX_set_signature_md(pctx, stamp->md))
+			goto done;
+		if (1 != EVP_PKEY_sign(pctx, sig, &siglen, digest, digestlen))
+			goto done;
+	}
+
+	EVP_EncodeBlock((unsigned char *)b64, sig, siglen);
+
+	stat = DKIM_STAT_OK;
+done:
+	EVP_PKEY_CTX_free(pctx);
+
+	if (md)
+		EVP_MD_CTX_destroy(md);
+
+	if (stat != DKIM_STAT_OK)
+		return auxL_pushstat(L, stat, "~$#");
+
+	p = strlen(DKIM_SIGNHEADER) + 2;
+
+	lua_pushlstring(L, tmpl + p, stamp->bpos - p);
+	lua_pushstring(L, b64);
+	lua_pushlstring(L, tmpl + stamp->bpos, tmpllen - stamp->bpos);
+	lua_concat(L, 3);
+
+	return 1;
+} /* DKIM_STAMP_sign() */
+
+static int DKIM_STAMP__gc(lua_State *L) {
+	DKIM_STAMP_State *stamp = luaL_checkudata(L, 1, "DKIM_STAMP*");
+
+	if (stamp->pkey) {
+		EVP_PKEY_free(stamp->pkey);
+		stamp->pkey = NULL;
+	}
+
+	auxL_unref(L, &stamp->tmpl);
+	auxL_unref(L, &stamp->hlist);
+
+	return 0;
+} /* DKIM_STAMP__gc() */
+
+static luaL_Reg DKIM_STAMP_methods[] = {
+	{ "sign", DKIM_STAMP_sign },
+	{ NULL,   NULL },
+}; /* DKIM_STAMP_methods[] */
+
+static luaL_Reg DKIM_STAMP_metamethods[] = {
+	{ "__gc", &DKIM_STAMP__gc },
+	{ NULL,   NULL },
+}; /* DKIM_STAMP_metamethods[] */
+
+#endif /* HAVE_OPENSSL */
+
+
+/*
+ * (DKIM *) B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static DKIM_State *DKIM_checkself(lua_State *L, int index) {
+	DKIM_State *dkim = luaL_checkudata(L, index, "DKIM*");
+
+	luaL_argcheck(L, dkim->ctx, index, "attempt to use a closed DKIM handle");
+
+	return dkim;
+} /* DKIM_checkself() */
+
+static DKIM_State *DKIM_checkref(lua_State *L, auxref_t ref) {
+	DKIM_State *dkim;
+
+	auxL_getref(L, ref);
+	dkim = DKIM_checkself(L, -1);
+	lua_pop(L, 1);
+
+	return dkim;
+} /* DKIM_checkref() */
+
+static DKIM_State *DKIM_prep(lua_State *L, int index) {
+	DKIM_State *dkim;
+
+	index = lua_absindex(L, index);
+
+	dkim = lua_newuserdata(L, sizeof *dkim);
+	*dkim = DKIM_initializer;
+	luaL_setmetatable(L, "DKIM*");
+
+	auxL_ref(L, index, &dkim->ref.lib);
+	dkim->lib = lua_touserdata(L, index);
+
+	return dkim;
+} /* DKIM_prep() */
+
+static int DKIM_geterror(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushstring(L, dkim_geterror(dkim->ctx));
+
+	return 1;
+} /* DKIM_geterror() */
+
+static int DKIM_getmode(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushinteger(L, dkim_getmode(dkim->ctx));
+
+	return 1;
+} /* DKIM_getmode() */
+
+static int DKIM_get_signer(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushstring(L, (const char *)dkim_get_signer(dkim->ctx));
+
+	return 1;
+} /* DKIM_get_signer() */
+
+static int DKIM_add_querymethod(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *method = luaL_checkstring(L, 2);
+	const char *options = luaL_checkstring(L, 3);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_add_querymethod(dkim->ctx, method, options)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_add_querymethod() */
+
+static int DKIM_add_xtag(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *tag = luaL_checkstring(L, 2);
+	const char *value = luaL_checkstring(L, 3);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_add_xtag(dkim->ctx, tag, value)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_add_xtag() */
+
+static int DKIM_getpartial(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushboolean(L, dkim_getpartial(dkim->ctx));
+
+	return 1;
+} /* DKIM_getpartial() */
+
+static int DKIM_getsighdr(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	size_t initial = luaL_optinteger(L, 2, strlen(DKIM_SIGNHEADER) + 2);
+	unsigned char *hdr = NULL;
+	size_t len = 0;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_getsighdr_d(dkim->ctx, initial, &hdr, &len)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushlstring(L, (char *)hdr, len);
+
+	return 1;
+} /* DKIM_getsighdr() */
+
+/*
+ * Write the DKIM-Signature header followed by the original message to
+ * out_fd. The message is either a string or a descriptor positioned at the
+ * start of the message, in which case it's copied in the kernel where
+ * possible and never materialized as a Lua string.
+ */
+static int DKIM_write_signed(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int ofd = luaL_checkinteger(L, 2);
+	size_t eollen, msglen = 0, count = 0;
+	const char *eol = luaL_optlstring(L, 4, "\r\n", &eollen);
+	const char *msg = NULL;
+	int ifd = -1, error;
+	unsigned char *hdr = NULL;
+	size_t hdrlen = 0;
+	struct iovec iov[5];
+	DKIM_STAT stat;
+
+	luaL_argcheck(L, dkim_getmode(dkim->ctx) == DKIM_MODE_SIGN, 1, "not a signing handle");
+
+	if (lua_type(L, 3) == LUA_TSTRING) {
+		msg = lua_tolstring(L, 3, &msglen);
+	} else {
+		ifd = luaL_checkinteger(L, 3);
+	}
+
+	if (DKIM_STAT_OK != (stat = dkim_getsighdr_d(dkim->ctx, strlen(DKIM_SIGNHEADER) + 2, &hdr, &hdrlen)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	iov[0].iov_base = DKIM_SIGNHEADER;
+	iov[0].iov_len = strlen(DKIM_SIGNHEADER);
+	iov[1].iov_base = ": ";
+	iov[1].iov_len = 2;
+	iov[2].iov_base = hdr;
+	iov[2].iov_len = hdrlen;
+	iov[3].iov_base = (void *)eol;
+	iov[3].iov_len = eollen;
+	iov[4].iov_base = (void *)msg;
+	iov[4].iov_len = msglen;
+
+	if ((error = aux_writev(ofd, iov, (msg)? 5 : 4, &count)))
+		goto error;
+
+	if (!msg && (error = aux_copyfd(ofd, ifd, &count)))
+		goto error;
+
+	lua_pushinteger(L, count);
+
+	return 1;
+error:
+	lua_pushnil(L);
+	auxL_strerror(L, error);
+	lua_pushinteger(L, error);
+	lua_pushinteger(L, count);
+
+	return 4;
+} /* DKIM_write_signed() */
+
+#if HAVE_OPENSSL
+static int DKIM_stamper(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	unsigned char *hdr = NULL;
+	size_t hdrlen = 0;
+	DKIM_STAT stat;
+
+	luaL_argcheck(L, dkim_getmode(dkim->ctx) == DKIM_MODE_SIGN, 1, "not a signing handle");
+
+	if (DKIM_STAT_OK != (stat = dkim_getsighdr_d(dkim->ctx, strlen(DKIM_SIGNHEADER) + 2, &hdr, &hdrlen)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	auxL_getref(L, dkim->ref.key);
+
+	return DKIM_STAMP_new(L, (char *)hdr, hdrlen, -1);
+} /* DKIM_stamper() */
+#endif
+
+static int DKIM_privkey_load(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_privkey_load(dkim->ctx)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_privkey_load() */
+
+static int DKIM_set_margin(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int margin = luaL_optinteger(L, 2, DKIM_HDRMARGIN);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_set_margin(dkim->ctx, margin)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_set_margin() */
+
+static int DKIM_set_signer(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const void *signer = luaL_checkstring(L, 2);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_set_signer(dkim->ctx, signer)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_set_signer() */
+
+static int DKIM_setpartial(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	_Bool value = auxL_checkboolean(L, 2);
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_setpartial(dkim->ctx, value)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_setpartial() */
+
+static int DKIM_signhdrs(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char **hdrlist;
+	size_t i, n;
+	DKIM_STAT stat;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+
+	hdrlist = lua_newuserdata(L, sizeof *hdrlist * (n + 1));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		hdrlist[i] = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	}
+
+	hdrlist[n] = NULL;
+
+	if (DKIM_STAT_OK != (stat = dkim_signhdrs(dkim->ctx, hdrlist)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_signhdrs() */
+
+static int DKIM_getsiglist(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO **siglist = NULL;
+	int sigcount = 0, i;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_getsiglist(dkim->ctx, &siglist, &sigcount)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_createtable(L, sigcount, 0);
+
+	for (i = 0; i < sigcount; i++) {
+		DKIM_SIGINFO_push(L, 1, siglist[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+} /* DKIM_getsiglist() */
+
+static int DKIM_getsignature(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO *siginfo;
+
+	if (!(siginfo = dkim->vcache.signature) && !(siginfo = dkim_getsignature(dkim->ctx)))
+		return 0;
+
+	DKIM_SIGINFO_push(L, 1, siginfo);
+
+	return 1;
+} /* DKIM_getsignature() */
+
+static int DKIM_getsslbuf(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushstring(L, dkim_getsslbuf(dkim->ctx));
+
+	return 1;
+} /* DKIM_getsslbuf() */
+
+static int DKIM_getuser(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushstring(L, (const char *)dkim_getuser(dkim->ctx));
+
+	return 1;
+} /* DKIM_getuser() */
+
+static int DKIM_minbody(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_STAT stat;
+
+	/* coalesced data counts toward what libopendkim has seen */
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, dkim_minbody(dkim->ctx));
+
+	return 1;
+} /* DKIM_minbody() */
+
+static int DKIM_ohdrs(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = (lua_isnoneornil(L, 2))? NULL : DKIM_SIGINFO_checkself(L, 2);
+	unsigned char **hdrlist;
+	int hdrlimit = (128 / 2), hdrcount, i;
+	DKIM_STAT stat;
+
+	/* loop, doubling the array size until the list fits */
+	do {
+		lua_settop(L, 2);
+
+		if (INT_MAX / 2 < hdrlimit)
+			goto overflow;
+
+		hdrlimit *= 2;
+
+		if (SIZE_MAX / sizeof *hdrlist < (size_t)hdrlimit)
+			goto overflow;
+
+		hdrlist = lua_newuserdata(L, sizeof *hdrlist * hdrlimit);
+
+		hdrcount = hdrlimit;
+		if (DKIM_STAT_OK != (stat = dkim_ohdrs(dkim->ctx, siginfo->ctx, hdrlist, &hdrcount)))
+			return auxL_pushstat(L, stat, "~$#");
+	} while (hdrcount > hdrlimit);
+
+	lua_createtable(L, hdrcount, 0);
+
+	for (i = 0; i < hdrcount; i++) {
+		lua_pushstring(L, (char *)hdrlist[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	return 1;
+overflow:
+	return auxL_pushstat(L, DKIM_STAT_NORESOURCE, "~$#");
+} /* DKIM_ohdrs() */
+
+static int DKIM_sig_getcanonlen(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+	ssize_t msglen, canonlen, signlen;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	if (DKIM_STAT_OK != (stat = dkim_sig_getcanonlen(dkim->ctx, siginfo->ctx, &msglen, &canonlen, &signlen)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, msglen);
+	lua_pushinteger(L, canonlen);
+	lua_pushinteger(L, signlen);
+
+	return 3;
+} /* DKIM_sig_getcanonlen() */
+
+static int DKIM_sig_getidentity(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = (lua_isnoneornil(L, 2))? NULL : DKIM_SIGINFO_checkself(L, 2);
+
+	return DKIM_SIGINFO_getidentity_(L, dkim, siginfo);
+} /* DKIM_sig_getidentity() */
+
+static int DKIM_sig_getqueries(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+
+	return DKIM_SIGINFO_getqueries_(L, dkim, siginfo);
+} /* DKIM_sig_getqueries() */
+
+static int DKIM_sig_getreportinfo(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+
+	return DKIM_SIGINFO_getreportinfo_(L, dkim, siginfo);
+} /* DKIM_sig_getreportinfo() */
+
+static int DKIM_sig_process(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+
+	return DKIM_SIGINFO_process_(L, dkim, siginfo);
+} /* DKIM_sig_process() */
+
+/*
+ * Copy the value of tag from the tag=value list src to dst with all
+ * whitespace removed. Returns the length, or 0 if not found or too long.
+ */
+static size_t DKIM_gettag(const char *src, size_t len, char tag, char *dst, size_t lim) {
+	const char *p = src, *pe = src + len;
+	size_t n;
+
+	while (p < pe) {
+		while (p < pe && isspace((unsigned char)*p))
+			p++;
+
+		if (p < pe && *p == tag) {
+			const char *q = p + 1;
+
+			while (q < pe && isspace((unsigned char)*q))
+				q++;
+
+			if (q < pe && *q == '=') {
+				for (q++, n = 0; q < pe && *q != ';'; q++) {
+					if (isspace((unsigned char)*q))
+						continue;
+					if (n + 1 >= lim)
+						return 0;
+
+					dst[n++] = tolower((unsigned char)*q);
+				}
+
+				dst[n] = '\0';
+
+				return n;
+			}
+		}
+
+		while (p < pe && *p != ';')
+			p++;
+
+		if (p < pe)
+			p++;
+	}
+
+	return 0;
+} /* DKIM_gettag() */
+
+/*
+ * If hdr is a DKIM-Signature field, queue a prefetch of its key so the
+ * application can start the query while the rest of the message arrives.
+ * Returns true if a prefetch was queued.
+ */
+static _Bool DKIM_prefetch(DKIM_State *dkim, const char *hdr, size_t len) {
+	size_t namelen = strlen(DKIM_SIGNHEADER), n;
+	char d[AUX_KEYDB_MAXNAME], s[AUX_KEYDB_MAXNAME], *name;
+	const char *p = hdr + namelen, *pe = hdr + len;
+	int i;
+
+	if (dkim->lib->prefetch == LUA_NOREF || dkim->prefetch.count >= DKIM_PREFETCH_MAX)
+		return 0;
+	if (len <= namelen || strncasecmp(hdr, DKIM_SIGNHEADER, namelen))
+		return 0;
+
+	while (p < pe && (*p == ' ' || *p == '\t'))
+		p++;
+
+	if (p >= pe || *p++ != ':')
+		return 0;
+
+	if (!DKIM_gettag(p, pe - p, 'd', d, sizeof d) || !DKIM_gettag(p, pe - p, 's', s, sizeof s))
+		return 0;
+
+	name = dkim->prefetch.entry[dkim->prefetch.count].name;
+	n = snprintf(name, AUX_KEYDB_MAXNAME, "%s._domainkey.%s", s, d);
+
+	if (n >= AUX_KEYDB_MAXNAME)
+		return 0;
+
+	for (i = 0; i < dkim->prefetch.count; i++) {
+		if (!strcmp(dkim->prefetch.entry[i].name, name))
+			return 0;
+	}
+
+	dkim->prefetch.entry[i].txt = NULL;
+	dkim->prefetch.entry[i].ref = LUA_NOREF;
+	dkim->prefetch.entry[i].state = DKIM_PREFETCH_PENDING;
+	dkim->prefetch.count++;
+
+	return 1;
+} /* DKIM_prefetch() */
+
+/*
+ * Return the prefetched key record for name, if any.
+ */
+static const char *DKIM_prefetch_find(DKIM_State *dkim, const char *name) {
+	int i;
+
+	for (i = 0; i < dkim->prefetch.count; i++) {
+		if (dkim->prefetch.entry[i].txt && !strcasecmp(dkim->prefetch.entry[i].name, name))
+			return dkim->prefetch.entry[i].txt;
+	}
+
+	return NULL;
+} /* DKIM_prefetch_find() */
+
+/*
+ * Hash of the key named by the d= and s= tags of a DKIM-Signature field,
+ * or 0 if a tag is missing or an accepted field already named the key.
+ */
+static uint64_t DKIM_newkey(DKIM_State *dkim, const char *tags, size_t len) {
+	char d[AUX_KEYDB_MAXNAME], s[AUX_KEYDB_MAXNAME];
+	uint64_t hash;
+	unsigned long i;
+
+	if (!DKIM_gettag(tags, len, 'd', d, sizeof d) || !DKIM_gettag(tags, len, 's', s, sizeof s))
+		return 0;
+
+	hash = aux_fnv1a(AUX_FNV1A_INIT, s, strlen(s));
+	hash = aux_fnv1a(hash, ".", 1);
+	hash = aux_fnv1a(hash, d, strlen(d));
+	hash = (hash)? hash : 1;
+
+	for (i = 0; i < dkim->usage.lookups; i++) {
+		if (dkim->usage.keys[i] == hash)
+			return 0;
+	}
+
+	return hash;
+} /* DKIM_newkey() */
+
+/*
+ * Pass a header field to dkim_header after checking it against the
+ * library's per-message limits. A field over a limit is not passed on
+ * and not counted, so the caller may skip it and carry on.
+ */
+static DKIM_STAT DKIM_header_(DKIM_State *dkim, const char *hdr, size_t len) {
+	const DKIM_LIB_State *lib = dkim->lib;
+	size_t namelen = strlen(DKIM_SIGNHEADER);
+	uint64_t key = 0;
+	_Bool issig = 0;
+	DKIM_STAT stat;
+
+	if (lib->limits.headers && dkim->usage.headers >= lib->limits.headers)
+		return DKIM_STAT_MAXHDRS;
+	if (lib->limits.hdrbytes && len > lib->limits.hdrbytes - dkim->usage.hdrbytes)
+		return DKIM_STAT_MAXHDRBYTES;
+
+	if ((lib->limits.signatures || lib->limits.lookups) && len > namelen && !strncasecmp(hdr, DKIM_SIGNHEADER, namelen)) {
+		const char *p = &hdr[namelen], *pe = &hdr[len];
+
+		while (p < pe && (*p == ' ' || *p == '\t'))
+			p++;
+
+		issig = (p < pe && *p == ':');
+
+		if (issig && lib->limits.signatures && dkim->usage.signatures >= lib->limits.signatures)
+			return DKIM_STAT_MAXSIGS;
+
+		/* each distinct key costs a lookup once libopendkim parses it */
+		if (issig && lib->limits.lookups && (key = DKIM_newkey(dkim, p + 1, pe - p - 1))) {
+			uint64_t *keys;
+
+			if (dkim->usage.lookups >= lib->limits.lookups)
+				return DKIM_STAT_MAXLOOKUPS;
+
+			if (!(keys = realloc(dkim->usage.keys, (dkim->usage.lookups + 1) * sizeof *keys)))
+				return DKIM_STAT_NORESOURCE;
+
+			dkim->usage.keys = keys;
+		}
+	}
+
+	if (DKIM_STAT_OK != (stat = dkim_header(dkim->ctx, (void *)hdr, len)))
+		return stat;
+
+	dkim->usage.headers++;
+	dkim->usage.hdrbytes += len;
+	dkim->usage.signatures += issig;
+
+	if (key)
+		dkim->usage.keys[dkim->usage.lookups++] = key;
+
+	return DKIM_STAT_OK;
+} /* DKIM_header_() */
+
+/* statuses of DKIM_header_ for a field it skipped */
+static _Bool DKIM_overlimit(DKIM_STAT stat) {
+	return stat == DKIM_STAT_MAXHDRS || stat == DKIM_STAT_MAXHDRBYTES || stat == DKIM_STAT_MAXSIGS || stat == DKIM_STAT_MAXLOOKUPS;
+} /* DKIM_overlimit() */
+
+static int DKIM_header(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	void *hdr;
+	size_t len;
+	DKIM_STAT stat;
+
+	hdr = (void *)luaL_checklstring(L, 2, &len);
+
+	if (DKIM_STAT_OK != (stat = DKIM_header_(dkim, hdr, len)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	if (DKIM_prefetch(dkim, hdr, len)) {
+		lua_pushboolean(L, 1); /* prefetch pending */
+
+		return 2;
+	}
+
+	return 1;
+} /* DKIM_header() */
+
+/*
+ * Feed one field of a header block, stripped of its final line ending.
+ * Folded lines are passed through as-is, but bare LF line endings are
+ * rewritten to CRLF in *buf, which is grown as needed.
+ */
+static DKIM_STAT DKIM_header_field(DKIM_State *dkim, const char *hdr, size_t len, char **buf, size_t *bufsiz, _Bool *prefetch) {
+	const char *p, *pe = hdr + len;
+	size_t n = 0, bare = 0;
+	DKIM_STAT stat;
+
+	for (p = hdr; (p = memchr(p, '\n', pe - p)); p++) {
+		if (p == hdr || p[-1] != '\r')
+			bare++;
+	}
+
+	if (bare) {
+		if (*bufsiz < len + bare) {
+			char *tmp;
+
+			if (!(tmp = realloc(*buf, len + bare)))
+				return DKIM_STAT_NORESOURCE;
+
+			*buf = tmp;
+			*bufsiz = len + bare;
+		}
+
+		for (p = hdr; p < pe; p++) {
+			if (*p == '\n' && (p == hdr || p[-1] != '\r'))
+				(*buf)[n++] = '\r';
+			(*buf)[n++] = *p;
+		}
+
+		hdr = *buf;
+		len = n;
+	}
+
+	if (DKIM_STAT_OK != (stat = DKIM_header_(dkim, hdr, len)))
+		return stat;
+
+	if (DKIM_prefetch(dkim, hdr, len))
+		*prefetch = 1;
+
+	return DKIM_STAT_OK;
+} /* DKIM_header_field() */
+
+/*
+ * dkim:header_block(raw) - Split a raw header section, with LF or CRLF
+ * line endings, into fields and feed each to dkim_header. Returns the
+ * position in raw where the body starts (or #raw + 1 if there's no
+ * empty line) and, like dkim:header, a second true value if a key
+ * prefetch was queued.
+ */
+static int DKIM_header_block(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *raw, *p, *pe, *eol, *next, *field = NULL, *fieldend = NULL;
+	size_t len, bufsiz = 0;
+	char *buf = NULL;
+	_Bool prefetch = 0;
+	DKIM_STAT stat;
+
+	raw = luaL_checklstring(L, 2, &len);
+	p = raw;
+	pe = raw + len;
+
+	while (p < pe) {
+		if ((eol = memchr(p, '\n', pe - p))) {
+			next = eol + 1;
+
+			if (eol > p && eol[-1] == '\r')
+				eol--;
+		} else {
+			next = eol = pe;
+		}
+
+		if (eol == p) { /* empty line ends the header */
+			p = next;
+
+			break;
+		} else if (*p == ' ' || *p == '\t') {
+			if (!field) {
+				stat = DKIM_STAT_SYNTAX;
+				goto error;
+			}
+		} else {
+			if (field && DKIM_STAT_OK != (stat = DKIM_header_field(dkim, field, fieldend - field, &buf, &bufsiz, &prefetch)))
+				goto error;
+
+			field = p;
+		}
+
+		fieldend = eol;
+		p = next;
+	}
+
+	if (field && DKIM_STAT_OK != (stat = DKIM_header_field(dkim, field, fieldend - field, &buf, &bufsiz, &prefetch)))
+		goto error;
+
+	free(buf);
+
+	lua_pushinteger(L, (p - raw) + 1);
+
+	if (prefetch) {
+		lua_pushboolean(L, 1); /* prefetch pending */
+
+		return 2;
+	}
+
+	return 1;
+error:
+	free(buf);
+
+	return auxL_pushstat(L, stat, "0$#");
+} /* DKIM_header_block() */
+
+static int DKIM_eoh(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_STAT stat;
+
+	if (DKIM_expired(dkim))
+		return auxL_pushstat(L, DKIM_STAT_TIMEOUT, "0$#");
+
+	/* a last header field fed without a following line */
+	if (dkim->pump.state == DKIM_PUMP_HEADER && dkim->pump.tail > dkim->pump.head) {
+		_Bool prefetch = 0;
+
+		if (DKIM_STAT_OK != (stat = DKIM_pump_header(dkim, 1, &prefetch)))
+			return auxL_pushstat(L, stat, "0$#");
+	}
+
+	DKIM_enter(dkim);
+	stat = DKIM_leave(dkim, dkim_eoh(dkim->ctx));
+
+	if (DKIM_STAT_OK != stat)
+		return auxL_pushstat(L, stat, "0$#");
+
+	dkim->pump.eoh = 1;
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_eoh() */
+
+/*
+ * Pass any coalesced body data to dkim_body. Must be called before
+ * anything else which feeds or finishes the body.
+ */
+static DKIM_STAT DKIM_flush(DKIM_State *dkim) {
+	size_t count = dkim->bodybuf.count;
+
+	if (!count)
+		return DKIM_STAT_OK;
+
+	dkim->bodybuf.count = 0;
+
+	return dkim_body(dkim->ctx, (void *)dkim->bodybuf.data, count);
+} /* DKIM_flush() */
+
+/*
+ * Feed body data, copying small writes into the coalescing buffer so
+ * per-line feeds don't each pay for a dkim_body call. An error may be
+ * that of a previous write.
+ */
+static DKIM_STAT DKIM_body_(DKIM_State *dkim, const char *p, size_t len) {
+	DKIM_STAT stat;
+
+	if (len >= dkim->bodybuf.size) {
+		if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+			return stat;
+
+		return dkim_body(dkim->ctx, (void *)p, len);
+	}
+
+	if (!dkim->bodybuf.data && !(dkim->bodybuf.data = malloc(dkim->bodybuf.size)))
+		return dkim_body(dkim->ctx, (void *)p, len);
+
+	if (len > dkim->bodybuf.size - dkim->bodybuf.count) {
+		if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+			return stat;
+	}
+
+	memcpy(&dkim->bodybuf.data[dkim->bodybuf.count], p, len);
+	dkim->bodybuf.count += len;
+
+	return DKIM_STAT_OK;
+} /* DKIM_body_() */
+
+/*
+ * Feed body data which already sits in a buffer, that of dkim:pump or
+ * the string given to dkim:feed_smtp_data, without copying it again into
+ * the coalescing one.
+ */
+static DKIM_STAT DKIM_body_direct(DKIM_State *dkim, const char *p, size_t len) {
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return stat;
+
+	return dkim_body(dkim->ctx, (void *)p, len);
+} /* DKIM_body_direct() */
+
+static int DKIM_body(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *body;
+	size_t len;
+	DKIM_STAT stat;
+
+	body = luaL_checklstring(L, 2, &len);
+
+	if (DKIM_STAT_OK != (stat = DKIM_body_(dkim, body, len)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_body() */
+
+/*
+ * dkim:body_iov(t) - Feed each string of the array t, in order, as if by
+ * dkim:body.
+ */
+static int DKIM_body_iov(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *body;
+	size_t i, n, len;
+	DKIM_STAT stat;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_rawlen(L, 2);
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		body = luaL_checklstring(L, -1, &len);
+
+		if (DKIM_STAT_OK != (stat = DKIM_body_(dkim, body, len)))
+			return auxL_pushstat(L, stat, "0$#");
+
+		lua_pop(L, 1);
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_body_iov() */
+
+/*
+ * dkim:set_body_buffer(size) - Set the size of the buffer used to
+ * coalesce small body writes, or disable it with 0. Pending data is
+ * flushed first.
+ */
+static int DKIM_set_body_buffer(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	DKIM_STAT stat;
+
+	luaL_argcheck(L, size >= 0, 2, "negative buffer size");
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	free(dkim->bodybuf.data);
+	dkim->bodybuf.data = NULL;
+	dkim->bodybuf.size = size;
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_set_body_buffer() */
+
+/*
+ * Feed every complete header field buffered by dkim:pump. A field is
+ * complete once the first byte of the following line shows it isn't a
+ * continuation. On EOF whatever remains is the last field. A field over
+ * a lib:set_limits limit is consumed before its status is returned, so
+ * the next call carries on after it.
+ */
+static DKIM_STAT DKIM_pump_header(DKIM_State *dkim, _Bool eof, _Bool *prefetch) {
+	char *data = dkim->pump.data, *buf = NULL;
+	const char *field, *fieldend, *p, *pe, *eol, *next;
+	size_t bufsiz = 0;
+	DKIM_STAT stat = DKIM_STAT_OK;
+
+	field = fieldend = p = &data[dkim->pump.head];
+	pe = &data[dkim->pump.tail];
+
+	while (p < pe) {
+		if (p > field && *p != ' ' && *p != '\t') {
+			stat = DKIM_header_field(dkim, field, fieldend - field, &buf, &bufsiz, prefetch);
+
+			if (stat != DKIM_STAT_OK && !DKIM_overlimit(stat))
+				goto done;
+
+			field = fieldend = p;
+			dkim->pump.head = p - data;
+
+			if (stat != DKIM_STAT_OK)
+				goto done;
+		}
+
+		if ((eol = memchr(p, '\n', pe - p))) {
+			next = eol + 1;
+
+			if (eol > p && eol[-1] == '\r')
+				eol--;
+		} else if (eof) {
+			next = eol = pe;
+		} else {
+			break;
+		}
+
+		if (p == field) {
+			if (eol == p) { /* empty line ends the header */
+				dkim->pump.head = next - data;
+				dkim->pump.state = DKIM_PUMP_EOH;
+
+				goto done;
+			} else if (*p == ' ' || *p == '\t') {
+				stat = DKIM_STAT_SYNTAX;
+
+				goto done;
+			}
+		}
+
+		fieldend = eol;
+		p = next;
+	}
+
+	if (eof && fieldend > field) {
+		stat = DKIM_header_field(dkim, field, fieldend - field, &buf, &bufsiz, prefetch);
+
+		if (stat != DKIM_STAT_OK && !DKIM_overlimit(stat))
+			goto done;
+
+		dkim->pump.head = dkim->pump.tail;
+		dkim->pump.state = DKIM_PUMP_EOH;
+	}
+done:
+	free(buf);
+
+	return stat;
+} /* DKIM_pump_header() */
+
+static int DKIM_inflate_open(DKIM_State *dkim, int codec) {
+	if (!(dkim->inflate.data = malloc(DKIM_INFLATE_BUFSIZ)))
+		return errno;
+
+	switch (codec) {
+#if HAVE_ZLIB
+	case DKIM_CODEC_GZIP:
+		memset(&dkim->inflate.zs, 0, sizeof dkim->inflate.zs);
+
+		/* +32 detects either a gzip or zlib header */
+		if (Z_OK != inflateInit2(&dkim->inflate.zs, 15 + 32))
+			goto nomem;
+
+		break;
+#endif
+#if HAVE_ZSTD
+	case DKIM_CODEC_ZSTD:
+		if (!(dkim->inflate.zds = ZSTD_createDStream()))
+			goto nomem;
+
+		ZSTD_initDStream(dkim->inflate.zds);
+
+		break;
+#endif
+	default:
+		free(dkim->inflate.data);
+		dkim->inflate.data = NULL;
+
+		return ENOTSUP;
+	}
+
+	dkim->inflate.codec = codec;
+
+	return 0;
+#if HAVE_ZLIB || HAVE_ZSTD
+nomem:
+	free(dkim->inflate.data);
+	dkim->inflate.data = NULL;
+
+	return ENOMEM;
+#endif
+} /* DKIM_inflate_open() */
+
+static void DKIM_inflate_close(DKIM_State *dkim) {
+	switch (dkim->inflate.codec) {
+#if HAVE_ZLIB
+	case DKIM_CODEC_GZIP:
+		inflateEnd(&dkim->inflate.zs);
+
+		break;
+#endif
+#if HAVE_ZSTD
+	case DKIM_CODEC_ZSTD:
+		ZSTD_freeDStream(dkim->inflate.zds);
+		dkim->inflate.zds = NULL;
+
+		break;
+#endif
+	}
+
+	free(dkim->inflate.data);
+	dkim->inflate.data = NULL;
+	dkim->inflate.codec = DKIM_CODEC_NONE;
+} /* DKIM_inflate_close() */
+
+/*
+ * Decompress up to size bytes into buf, reading more input from fd as
+ * needed, with the semantics of read(2). Corrupt or truncated input
+ * fails with EILSEQ. Both formats allow several concatenated streams,
+ * so the end is only known once EOF follows the end of a stream.
+ */
+static ssize_t DKIM_inflate_read(DKIM_State *dkim, int fd, char *buf, size_t size) {
+	size_t count = 0;
+	ssize_t n;
+
+	while (count == 0 && !dkim->inflate.end) {
+		if (dkim->inflate.head == dkim->inflate.tail && !dkim->inflate.eof) {
+			dkim->inflate.head = dkim->inflate.tail = 0;
+
+			if (-1 == (n = read(fd, dkim->inflate.data, DKIM_INFLATE_BUFSIZ))) {
+				if (errno == EINTR)
+					continue;
+
+				return -1;
+			}
+
+			dkim->inflate.tail = n;
+			dkim->inflate.eof = (n == 0);
+		}
+
+		if (dkim->inflate.boundary) {
+			if (dkim->inflate.head == dkim->inflate.tail && dkim->inflate.eof) {
+				dkim->inflate.end = 1;
+				break;
+			}
+
+#if HAVE_ZLIB
+			if (dkim->inflate.codec == DKIM_CODEC_GZIP)
+				inflateReset(&dkim->inflate.zs);
+#endif
+			dkim->inflate.boundary = 0;
+		}
+
+		switch (dkim->inflate.codec) {
+#if HAVE_ZLIB
+		case DKIM_CODEC_GZIP: {
+			z_stream *zs = &dkim->inflate.zs;
+			int rv;
+
+			zs->next_in = (Bytef *)&dkim->inflate.data[dkim->inflate.head];
+			zs->avail_in = dkim->inflate.tail - dkim->inflate.head;
+			zs->next_out = (Bytef *)buf;
+			zs->avail_out = size;
+
+			rv = inflate(zs, Z_NO_FLUSH);
+
+			dkim->inflate.head = dkim->inflate.tail - zs->avail_in;
+			count = size - zs->avail_out;
+
+			if (rv == Z_STREAM_END)
+				dkim->inflate.boundary = 1;
+			else if (rv != Z_OK && rv != Z_BUF_ERROR)
+				goto corrupt;
+
+			break;
+		}
+#endif
+#if HAVE_ZSTD
+		case DKIM_CODEC_ZSTD: {
+			ZSTD_inBuffer in = { dkim->inflate.data, dkim->inflate.tail, dkim->inflate.head };
+			ZSTD_outBuffer out = { buf, size, 0 };
+			size_t rv;
+
+			rv = ZSTD_decompressStream(dkim->inflate.zds, &out, &in);
+
+			if (ZSTD_isError(rv))
+				goto corrupt;
+
+			dkim->inflate.head = in.pos;
+			count = out.pos;
+			dkim->inflate.boundary = (rv == 0); /* frame complete */
+
+			break;
+		}
+#endif
+		default:
+			(void)buf; (void)size;
+			errno = ENOTSUP;
+
+			return -1;
+		}
+
+		if (count == 0 && dkim->inflate.eof && dkim->inflate.head == dkim->inflate.tail && !dkim->inflate.boundary)
+			goto corrupt; /* truncated */
+	}
+
+	return count;
+corrupt:
+	errno = EILSEQ;
+
+	return -1;
+} /* DKIM_inflate_read() */
+
+/*
+ * Make room for at least len more bytes in the dkim:pump buffer, first
+ * by discarding consumed data, then by growing it up to the header limit.
+ */
+static DKIM_STAT DKIM_pump_reserve(DKIM_State *dkim, size_t len) {
+	size_t size;
+	char *tmp;
+
+	if (dkim->pump.size - dkim->pump.tail >= len)
+		return DKIM_STAT_OK;
+
+	if (dkim->pump.head > 0) {
+		memmove(dkim->pump.data, &dkim->pump.data[dkim->pump.head], dkim->pump.tail - dkim->pump.head);
+		dkim->pump.tail -= dkim->pump.head;
+		dkim->pump.head = 0;
+	}
+
+	for (size = (dkim->pump.size)? dkim->pump.size : DKIM_PUMP_BUFSIZ; size - dkim->pump.tail < len; size *= 2)
+		;
+
+	if (size == dkim->pump.size)
+		return DKIM_STAT_OK;
+
+	if (size > DKIM_PUMP_MAXHDR || !(tmp = realloc(dkim->pump.data, size)))
+		return DKIM_STAT_NORESOURCE;
+
+	dkim->pump.data = tmp;
+	dkim->pump.size = size;
+
+	return DKIM_STAT_OK;
+} /* DKIM_pump_reserve() */
+
+/*
+ * Write what's left of the last read to ofd. Fails with EAGAIN if ofd
+ * is still full, which DKIM_pump_blocked reports as such.
+ */
+static int DKIM_pump_flush(DKIM_State *dkim, int ofd) {
+	struct iovec iov;
+	size_t count = 0;
+	int error;
+
+	if (dkim->pump.out.head >= dkim->pump.out.tail)
+		return 0;
+
+	iov.iov_base = &dkim->pump.out.data[dkim->pump.out.head];
+	iov.iov_len = dkim->pump.out.tail - dkim->pump.out.head;
+
+	error = aux_writev(ofd, &iov, 1, &count);
+	dkim->pump.out.head += count;
+
+	if (dkim->pump.out.head == dkim->pump.out.tail)
+		dkim->pump.out.head = dkim->pump.out.tail = 0;
+
+	return error;
+} /* DKIM_pump_flush() */
+
+/*
+ * Keep the bytes of buf which ofd didn't take, to be written by
+ * DKIM_pump_flush before anything more is read.
+ */
+static int DKIM_pump_defer(DKIM_State *dkim, const char *buf, size_t len) {
+	char *tmp;
+
+	if (dkim->pump.out.size < len) {
+		if (!(tmp = realloc(dkim->pump.out.data, len)))
+			return errno;
+
+		dkim->pump.out.data = tmp;
+		dkim->pump.out.size = len;
+	}
+
+	memcpy(dkim->pump.out.data, buf, len);
+	dkim->pump.out.head = 0;
+	dkim->pump.out.tail = len;
+
+	return 0;
+} /* DKIM_pump_defer() */
+
+/*
+ * Read for dkim:pump and, if ofd isn't -1, copy to ofd. Between two pipes
+ * tee(2) duplicates the data into ofd without copying it through user
+ * space, and a read then consumes what was duplicated; it also leaves
+ * fd untouched if ofd is full. Otherwise the data is written to ofd
+ * after it has been read, and whatever ofd won't take is kept and
+ * written first on the next call; until then nothing more is read.
+ */
+static ssize_t DKIM_pump_read(DKIM_State *dkim, int fd, int ofd, char *buf, size_t size) {
+	struct iovec iov;
+	size_t count = 0;
+	ssize_t n;
+	int error;
+
+	if (dkim->inflate.codec != DKIM_CODEC_NONE)
+		return DKIM_inflate_read(dkim, fd, buf, size);
+
+	if (ofd == -1)
+		return read(fd, buf, size);
+
+#if HAVE_TEE
+	if (!dkim->pump.notee) {
+		if (-1 == (n = tee(fd, ofd, size, SPLICE_F_NONBLOCK))) {
+			if (errno != EINVAL)
+				return -1;
+
+			dkim->pump.notee = 1; /* not both pipes */
+		} else if (n == 0) {
+			return 0;
+		} else {
+			ssize_t m;
+
+			/* the duplicated bytes are already sitting in fd */
+			while (-1 == (m = read(fd, buf, n)) && errno == EINTR)
+				;
+
+			return m;
+		}
+	}
+#endif
+
+	if ((error = DKIM_pump_flush(dkim, ofd))) {
+		errno = error;
+
+		return -1;
+	}
+
+	if (-1 == (n = read(fd, buf, size)) || n == 0)
+		return n;
+
+	iov.iov_base = buf;
+	iov.iov_len = n;
+
+	if ((error = aux_writev(ofd, &iov, 1, &count))) {
+		if (error != EAGAIN && error != EWOULDBLOCK)
+			goto error;
+
+		/* n bytes were consumed, so they're returned all the same */
+		if ((error = DKIM_pump_defer(dkim, &buf[count], n - count)))
+			goto error;
+	}
+
+	return n;
+error:
+	errno = error;
+
+	return -1;
+} /* DKIM_pump_read() */
+
+/*
+ * tee(2) fails with EAGAIN both when fd is empty and when ofd is full, so
+ * check which, lest a caller polling fd spin while ofd drains. Without
+ * tee(2), EAGAIN from ofd leaves unwritten bytes behind.
+ */
+static _Bool DKIM_pump_blocked(DKIM_State *dkim, int ofd) {
+#if HAVE_TEE
+	struct pollfd pfd = { .fd = ofd, .events = POLLOUT };
+
+	if (ofd == -1)
+		return 0;
+	if (dkim->pump.notee)
+		return dkim->pump.out.head < dkim->pump.out.tail;
+
+	return 0 == poll(&pfd, 1, 0);
+#else
+	return ofd != -1 && dkim->pump.out.head < dkim->pump.out.tail;
+#endif
+} /* DKIM_pump_blocked() */
+
+/*
+ * dkim:pump(fd[, maxbytes]) - Read up to maxbytes from the non-blocking
+ * descriptor fd and feed them to libopendkim, header fields first and
+ * then the body. Returns the number of bytes read and, if pumping
+ * stopped short, why: "eoh" once the header is complete and dkim:eoh
+ * must be called, "again" if fd would block, "blocked" if dkim:tee's
+ * ofd is full, or "eof" at end of file.
+ * A third true value means a key prefetch was queued.
+ */
+static int DKIM_pump_(lua_State *L, DKIM_State *dkim, int fd, int ofd, size_t maxbytes) {
+	size_t count = 0, size;
+	const char *why = NULL;
+	_Bool prefetch = 0;
+	ssize_t n;
+	DKIM_STAT stat;
+
+	if (dkim->pump.state == DKIM_PUMP_EOH) {
+		if (!dkim->pump.eoh) {
+			why = "eoh";
+			goto done;
+		}
+
+		/* body data read along with the end of the header */
+		stat = DKIM_body_direct(dkim, &dkim->pump.data[dkim->pump.head], dkim->pump.tail - dkim->pump.head);
+		dkim->pump.head = dkim->pump.tail = 0;
+		dkim->pump.state = DKIM_PUMP_BODY;
+
+		if (DKIM_STAT_OK != stat)
+			return auxL_pushstat(L, stat, "0$#");
+	} else if (dkim->pump.state == DKIM_PUMP_HEADER && dkim->pump.eoh) {
+		dkim->pump.state = DKIM_PUMP_BODY;
+	} else if (dkim->pump.state == DKIM_PUMP_HEADER && dkim->pump.head < dkim->pump.tail) {
+		/* fields left buffered after one over a limit was skipped */
+		if (DKIM_STAT_OK != (stat = DKIM_pump_header(dkim, 0, &prefetch)))
+			goto error;
+
+		if (dkim->pump.state == DKIM_PUMP_EOH) {
+			why = "eoh";
+			goto done;
+		}
+	}
+
+	while (count < maxbytes) {
+		if (dkim->pump.state == DKIM_PUMP_BODY)
+			dkim->pump.head = dkim->pump.tail = 0;
+
+		if (DKIM_STAT_OK != (stat = DKIM_pump_reserve(dkim, 1)))
+			return auxL_pushstat(L, stat, "0$#");
+
+		size = dkim->pump.size - dkim->pump.tail;
+
+		if (size > maxbytes - count)
+			size = maxbytes - count;
+
+		if (-1 == (n = DKIM_pump_read(dkim, fd, ofd, &dkim->pump.data[dkim->pump.tail], size))) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				why = (DKIM_pump_blocked(dkim, ofd))? "blocked" : "again";
+				break;
+			}
+
+			return auxL_pusherror(L, errno, "0$#");
+		}
+
+		count += n;
+		dkim->pump.tail += n;
+
+		if (dkim->pump.state == DKIM_PUMP_BODY) {
+			if (n > 0 && DKIM_STAT_OK != (stat = DKIM_body_direct(dkim, dkim->pump.data, n)))
+				return auxL_pushstat(L, stat, "0$#");
+		} else if (DKIM_STAT_OK != (stat = DKIM_pump_header(dkim, n == 0, &prefetch))) {
+			goto error;
+		}
+
+		if (n == 0) {
+			why = "eof";
+			break;
+		} else if (dkim->pump.state == DKIM_PUMP_EOH) {
+			why = "eoh";
+			break;
+		}
+	}
+done:
+	lua_pushinteger(L, count);
+
+	if (!why && !prefetch)
+		return 1;
+
+	if (why)
+		lua_pushstring(L, why);
+	else
+		lua_pushnil(L);
+
+	if (!prefetch)
+		return 2;
+
+	lua_pushboolean(L, 1); /* prefetch pending */
+
+	return 3;
+error:
+	if (!DKIM_overlimit(stat))
+		return auxL_pushstat(L, stat, "0$#");
+
+	/* the field was skipped, so pumping can carry on */
+	auxL_pushstat(L, stat, "0$#");
+	lua_pushinteger(L, count);
+
+	return 4;
+} /* DKIM_pump_() */
+
+static int DKIM_pump(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int fd = luaL_checkinteger(L, 2);
+	size_t maxbytes = luaL_optinteger(L, 3, DKIM_PUMP_DEFAULT);
+
+	return DKIM_pump_(L, dkim, fd, -1, maxbytes);
+} /* DKIM_pump() */
+
+/*
+ * dkim:tee(in_fd, out_fd[, len]) - Like dkim:pump, but also copy the
+ * bytes read to out_fd, so a message can be forwarded and verified in
+ * one pass.
+ */
+static int DKIM_tee(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int fd = luaL_checkinteger(L, 2);
+	int ofd = luaL_checkinteger(L, 3);
+	size_t maxbytes = luaL_optinteger(L, 4, DKIM_PUMP_DEFAULT);
+
+	luaL_argcheck(L, ofd >= 0, 3, "invalid descriptor");
+
+	return DKIM_pump_(L, dkim, fd, ofd, maxbytes);
+} /* DKIM_tee() */
+
+/*
+ * dkim:feed_compressed(fd, codec[, maxbytes]) - Like dkim:pump, but fd
+ * holds the message compressed with codec, "gzip" or "zstd". Data is
+ * decompressed in bounded blocks, and maxbytes counts decompressed bytes.
+ */
+static int DKIM_feed_compressed(lua_State *L) {
+	static const char *const codecs[] = { "none", "gzip", "zstd", NULL };
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int fd = luaL_checkinteger(L, 2);
+	int codec = luaL_checkoption(L, 3, NULL, codecs);
+	size_t maxbytes = luaL_optinteger(L, 4, DKIM_PUMP_DEFAULT);
+	int error;
+
+	luaL_argcheck(L, codec != DKIM_CODEC_NONE, 3, "invalid codec");
+
+	if (dkim->inflate.codec == DKIM_CODEC_NONE) {
+		if ((error = DKIM_inflate_open(dkim, codec)))
+			return auxL_pusherror(L, error, "0$#");
+	} else {
+		luaL_argcheck(L, codec == dkim->inflate.codec, 3, "codec changed");
+	}
+
+	return DKIM_pump_(L, dkim, fd, -1, maxbytes);
+} /* DKIM_feed_compressed() */
+
+/*
+ * Feed data already stripped of SMTP transparency: into the dkim:pump
+ * buffer while in the header, where each completed line is parsed, or
+ * else as body data.
+ */
+static DKIM_STAT DKIM_smtp_emit(DKIM_State *dkim, const char *p, size_t len, _Bool *prefetch) {
+	DKIM_STAT stat;
+
+	if (dkim->pump.state == DKIM_PUMP_BODY)
+		return DKIM_body_direct(dkim, p, len);
+
+	if (DKIM_STAT_OK != (stat = DKIM_pump_reserve(dkim, len)))
+		return stat;
+
+	memcpy(&dkim->pump.data[dkim->pump.tail], p, len);
+	dkim->pump.tail += len;
+
+	if (len > 0 && p[len - 1] == '\n')
+		return DKIM_pump_header(dkim, 0, prefetch);
+
+	return DKIM_STAT_OK;
+} /* DKIM_smtp_emit() */
+
+/*
+ * dkim:feed_smtp_data(buf[, mode]) - Feed wire data from an SMTP DATA
+ * command, removing dot-stuffing and stopping at the terminating
+ * CRLF.CRLF. With mode "bdat" the data, e.g. from BDAT chunks, is fed
+ * as-is. Returns the number of bytes of buf consumed and, if it stopped
+ * short, why: "eoh" once the header is complete and dkim:eoh must be
+ * called before feeding the rest, or "end" after the terminator. A third
+ * true value means a key prefetch was queued.
+ */
+static int DKIM_feed_smtp_data(lua_State *L) {
+	static const char *const modes[] = { "data", "bdat", NULL };
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	size_t len;
+	const char *buf = luaL_checklstring(L, 2, &len);
+	_Bool raw = luaL_checkoption(L, 3, "data", modes);
+	const char *p = buf, *pe = buf + len, *eol, *next;
+	const char *why = NULL;
+	_Bool prefetch = 0;
+	DKIM_STAT stat;
+
+	if (dkim->smtp == DKIM_SMTP_END) {
+		why = "end";
+		goto done;
+	}
+
+	if (dkim->pump.state == DKIM_PUMP_EOH) {
+		if (!dkim->pump.eoh) {
+			why = "eoh";
+			goto done;
+		}
+
+		dkim->pump.head = dkim->pump.tail = 0;
+		dkim->pump.state = DKIM_PUMP_BODY;
+	} else if (dkim->pump.state == DKIM_PUMP_HEADER && dkim->pump.eoh) {
+		dkim->pump.state = DKIM_PUMP_BODY;
+	}
+
+	while (p < pe) {
+		if (!raw) {
+			switch (dkim->smtp) {
+			case DKIM_SMTP_BOL:
+				if (*p == '.') {
+					p++;
+					dkim->smtp = DKIM_SMTP_DOT;
+					continue;
+				}
+
+				break;
+			case DKIM_SMTP_DOT:
+				if (*p == '\r') {
+					p++;
+					dkim->smtp = DKIM_SMTP_DOTCR;
+					continue;
+				} else if (*p == '\n') {
+					p++;
+					goto end;
+				}
+
+				break;
+			case DKIM_SMTP_DOTCR:
+				if (*p == '\n') {
+					p++;
+					goto end;
+				}
+
+				/* a stuffed line beginning with a bare CR */
+				if (DKIM_STAT_OK != (stat = DKIM_smtp_emit(dkim, "\r", 1, &prefetch)))
+					goto error;
+
+				break;
+			}
+		}
+
+		/* memchr is where the scan for "\n." is vectorized */
+		if ((eol = memchr(p, '\n', pe - p))) {
+			next = eol + 1;
+			dkim->smtp = DKIM_SMTP_BOL;
+		} else {
+			next = pe;
+			dkim->smtp = DKIM_SMTP_MID;
+		}
+
+		stat = DKIM_smtp_emit(dkim, p, next - p, &prefetch);
+		p = next;
+
+		if (DKIM_STAT_OK != stat)
+			goto error;
+
+		if (dkim->pump.state == DKIM_PUMP_EOH) {
+			why = "eoh";
+			break;
+		}
+	}
+
+	goto done;
+end:
+	dkim->smtp = DKIM_SMTP_END;
+	why = "end";
+
+	if (dkim->pump.state == DKIM_PUMP_HEADER && DKIM_STAT_OK != (stat = DKIM_pump_header(dkim, 1, &prefetch)))
+		goto error;
+done:
+	lua_pushinteger(L, p - buf);
+
+	if (!why && !prefetch)
+		return 1;
+
+	if (why)
+		lua_pushstring(L, why);
+	else
+		lua_pushnil(L);
+
+	if (!prefetch)
+		return 2;
+
+	lua_pushboolean(L, 1); /* prefetch pending */
+
+	return 3;
+error:
+	if (!DKIM_overlimit(stat))
+		return auxL_pushstat(L, stat, "0$#");
+
+	/* the field was skipped, so feeding can carry on after p */
+	auxL_pushstat(L, stat, "0$#");
+	lua_pushinteger(L, p - buf);
+
+	return 4;
+} /* DKIM_feed_smtp_data() */
+
+/*
+ * Charge the time spent in dkim_eom to the algorithm of each signature
+ * made or verified. libopendkim verifies every signature within one
+ * dkim_eom call, so the time is split evenly between them.
+ */
+static void DKIM_algstats(DKIM_State *dkim, DKIM_STAT stat) {
+	DKIM_SIGINFO **siglist = NULL;
+	int sigcount = 0, nproc = 0, i;
+	unsigned flags;
+	dkim_alg_t alg;
+
+	if (stat == DKIM_STAT_CBTRYAGAIN)
+		return;
+
+	if (dkim_getmode(dkim->ctx) == DKIM_MODE_SIGN) {
+		if (dkim->signalg >= 0 && dkim->signalg < DKIM_ALGSTATS_MAX) {
+			dkim->lib->algstats[dkim->signalg].count++;
+			dkim->lib->algstats[dkim->signalg].passed += (stat == DKIM_STAT_OK);
+			dkim->lib->algstats[dkim->signalg].failed += (stat != DKIM_STAT_OK);
+			dkim->lib->algstats[dkim->signalg].time += dkim->eomtime;
+		}
+
+		goto done;
+	}
+
+	if (DKIM_STAT_OK != dkim_getsiglist(dkim->ctx, &siglist, &sigcount))
+		goto done;
+
+	for (i = 0; i < sigcount; i++) {
+		if ((dkim_sig_getflags(siglist[i]) & (DKIM_SIGFLAG_PROCESSED|DKIM_SIGFLAG_IGNORE)) == DKIM_SIGFLAG_PROCESSED)
+			nproc++;
+	}
+
+	for (i = 0; i < sigcount; i++) {
+		flags = dkim_sig_getflags(siglist[i]);
+
+		if ((flags & (DKIM_SIGFLAG_PROCESSED|DKIM_SIGFLAG_IGNORE)) != DKIM_SIGFLAG_PROCESSED)
+			continue;
+		if (DKIM_STAT_OK != dkim_sig_getsignalg(siglist[i], &alg) || alg < 0 || alg >= DKIM_ALGSTATS_MAX)
+			continue;
+
+		dkim->lib->algstats[alg].count++;
+
+		if ((flags & DKIM_SIGFLAG_PASSED) && dkim_sig_getbh(siglist[i]) == DKIM_SIGBH_MATCH) {
+			dkim->lib->algstats[alg].passed++;
+		} else {
+			dkim->lib->algstats[alg].failed++;
+		}
+
+		dkim->lib->algstats[alg].time += dkim->eomtime / nproc;
+	}
+done:
+	dkim->eomtime = 0;
+} /* DKIM_algstats() */
+
+/*
+ * Record the outcome, key size and key lookup time of each signature in
+ * the per-domain sketch once dkim:eom is done.
+ */
+static void DKIM_domstats(DKIM_State *dkim, DKIM_STAT stat) {
+	DKIM_SIGINFO **siglist = NULL;
+	const struct aux_vresult *cached;
+	struct aux_topk_slot *slot;
+	struct DKIM_sigstate *sig;
+	unsigned flags, bits;
+	int sigcount = 0, bh, i;
+
+	if (!dkim->lib->domstats.size || stat == DKIM_STAT_CBTRYAGAIN || stat == DKIM_STAT_TIMEOUT)
+		return;
+	if (dkim_getmode(dkim->ctx) != DKIM_MODE_VERIFY)
+		return;
+	if (DKIM_STAT_OK != dkim_getsiglist(dkim->ctx, &siglist, &sigcount))
+		return;
+
+	for (i = 0; i < sigcount; i++) {
+		if ((cached = DKIM_vcache_result(dkim, siglist[i]))) {
+			flags = cached->flags;
+			bh = cached->bh;
+			bits = cached->keybits;
+		} else {
+			flags = dkim_sig_getflags(siglist[i]);
+			bh = dkim_sig_getbh(siglist[i]);
+
+			if (DKIM_STAT_OK != dkim_sig_getkeysize(siglist[i], &bits))
+				bits = 0;
+
+			if (flags & DKIM_SIGFLAG_IGNORE)
+				continue;
+		}
+
+		if (!(slot = aux_topk_hit(&dkim->lib->domstats, (char *)dkim_sig_getdomain(siglist[i]), (char *)dkim_sig_getselector(siglist[i]))))
+			return;
+
+		if ((flags & DKIM_SIGFLAG_PASSED) && bh == DKIM_SIGBH_MATCH) {
+			slot->passed++;
+		} else {
+			slot->failed++;
+		}
+
+		if (bits)
+			slot->keybits = bits;
+
+		if ((sig = DKIM_sigstate(dkim, siglist[i], 0)) && sig->looked) {
+			slot->lookups++;
+			slot->lookuptime += sig->lookup;
+		}
+	}
+} /* DKIM_domstats() */
+
+static int DKIM_eom(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_STAT stat;
+	_Bool testkey;
+	double begin;
+
+	if (DKIM_expired(dkim))
+		return auxL_pushstat(L, DKIM_STAT_TIMEOUT, "0$#");
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	DKIM_enter(dkim);
+	begin = aux_monotime();
+	stat = dkim_eom(dkim->ctx, &testkey);
+	dkim->eomtime += aux_monotime() - begin;
+	DKIM_algstats(dkim, stat);
+	stat = DKIM_leave(dkim, stat);
+	stat = DKIM_vcache_store(dkim, stat, &testkey);
+	DKIM_domstats(dkim, stat);
+
+	if (DKIM_STAT_OK != stat)
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+	lua_pushboolean(L, testkey);
+
+	return 2;
+} /* DKIM_eom() */
+
+static int DKIM_chunk(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	void *chunk;
+	size_t len;
+	DKIM_STAT stat;
+
+	chunk = (void *)luaL_optlstring(L, 2, NULL, &len);
+
+	if (DKIM_expired(dkim))
+		return auxL_pushstat(L, DKIM_STAT_TIMEOUT, "0$#");
+
+	if (DKIM_STAT_OK != (stat = DKIM_flush(dkim)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	DKIM_enter(dkim);
+	stat = DKIM_leave(dkim, dkim_chunk(dkim->ctx, chunk, len));
+
+	if (DKIM_STAT_OK != stat) {
+		if (stat == DKIM_STAT_CBTRYAGAIN) {
+			/*
+			 * NB: dkim_chunk cannot recover if dkim_eoh fails.
+			 * Calling dkim_chunk again after the callback will
+			 * simply result in a perplexing DKIM_STAT_INVALID
+			 * error.
+			 *
+			 * For non-blocking DNS the caller should use
+			 * dkim_header, dkim_eoh, and dkim_body.
+			 *
+			 * TODO: Implement our own restartable dkim_chunk.
+			 */
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "dkim_chunk not restartable");
+			lua_pushinteger(L, DKIM_STAT_CBINVALID);
+
+			return 3;
+		}
+
+		return auxL_pushstat(L, stat, "0$#");
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_chunk() */
+
+static int DKIM_set_deadline(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	dkim->deadline = (lua_isnoneornil(L, 2))? 0 : luaL_checknumber(L, 2);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_set_deadline() */
+
+static int DKIM_get_deadline(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	if (dkim->deadline <= 0)
+		return 0;
+
+	lua_pushnumber(L, dkim->deadline);
+	lua_pushnumber(L, AUX_MAX(dkim->deadline - aux_monotime(), 0));
+
+	return 2;
+} /* DKIM_get_deadline() */
+
+static int DKIM_getid(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	lua_pushstring(L, dkim_getid(dkim->ctx));
+
+	return 1;
+} /* DKIM_getid() */
+
+/*
+ * dkim:getctx() - Return the libopendkim handle as a light userdata, for
+ * calling libopendkim directly, e.g. through the LuaJIT FFI. The pointer
+ * is only valid until dkim:close or garbage collection of the object. A
+ * second true value means header limits are in force (see
+ * lib:set_limits), so fields must not be passed to dkim_header directly.
+ */
+static int DKIM_getctx(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const DKIM_LIB_State *lib = dkim->lib;
+
+	lua_pushlightuserdata(L, dkim->ctx);
+	/* header fields must go through dkim:header to be counted */
+	lua_pushboolean(L, lib->limits.signatures || lib->limits.headers || lib->limits.hdrbytes);
+
+	return 2;
+} /* DKIM_getctx() */
+
+#if 0 /* not implemented (documentation out of date) */
+static int DKIM_get_msgdate(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	uint64_t ts;
+
+	if (0 == (ts = dkim_get_msgdate(dkim->ctx))) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "Date: header field was not found, or one was found but could not be parsed, or the feature was not enabled when the DKIM library was compiled");
+
+		return 2;
+	}
+
+	lua_pushnumber(L, ts);
+
+	return 1;
+} /* DKIM_get_msgdate() */
+#endif
+
+static int DKIM_get_sigsubstring(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_SIGINFO_State *siginfo = DKIM_SIGINFO_checkself(L, 2);
+
+	return DKIM_SIGINFO_get_sigsubstring_(L, dkim, siginfo);
+} /* DKIM_get_sigsubstring() */
+
+static int DKIM_key_syntax(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *src;
+	size_t len;
+	unsigned char *buf;
+	DKIM_STAT stat;
+
+	src = luaL_checklstring(L, 2, &len);
+	buf = lua_newuserdata(L, len + 1);
+	memcpy(buf, src, len + 1);
+
+	if (DKIM_STAT_OK != (stat = dkim_key_syntax(dkim->ctx, buf, len)))
+		return auxL_pushstat(L, stat, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_key_syntax() */
+
+/*
+ * Apply the order of the signature table returned by the final callback,
+ * which libopendkim follows when processing. Signatures left out keep
+ * their relative order after the listed ones.
+ */
+static void DKIM_post_final_sort(lua_State *L, DKIM_State *dkim, int index) {
+	DKIM_SIGINFO **siglist = dkim->cb.final.siglist, **sorted, *ctx;
+	int sigcount = dkim->cb.final.sigcount, n = 0, i, j;
+	size_t count = lua_rawlen(L, index), k;
+
+	sorted = lua_newuserdata(L, sizeof *sorted * (sigcount + 1));
+
+	for (k = 1; k <= count; k++) {
+		lua_rawgeti(L, index, k);
+		ctx = DKIM_SIGINFO_checkself(L, -1)->ctx;
+		lua_pop(L, 1);
+
+		for (i = 0; i < sigcount && siglist[i] != ctx; i++)
+			;
+
+		luaL_argcheck(L, i < sigcount, index, "signature not from this message");
+
+		for (j = 0; j < n && sorted[j] != ctx; j++)
+			;
+
+		if (j == n)
+			sorted[n++] = ctx;
+	}
+
+	for (i = 0; i < sigcount; i++) {
+		for (j = 0; j < n && sorted[j] != siglist[i]; j++)
+			;
+
+		if (j == n)
+			sorted[n++] = siglist[i];
+	}
+
+	memcpy(siglist, sorted, sizeof *siglist * sigcount);
+	lua_pop(L, 1);
+} /* DKIM_post_final_sort() */
+
+static int DKIM_post_final(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_CBSTAT stat = auxL_checkcbstat(L, 2);
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		if (dkim->cb.final.siglist)
+			DKIM_post_final_sort(L, dkim, 3);
+	}
+
+	dkim->cb.final.stat = stat;
 	dkim->cb.done |= DKIM_CB_FINAL;
 
-	return 0;
-} /* DKIM_post_final() */
+	return 0;
+} /* DKIM_post_final() */
+
+static int DKIM_post_key_lookup(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *txt = NULL;
+	DKIM_CBSTAT stat;
+
+	lua_settop(L, 3);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		stat = DKIM_CBSTAT_CONTINUE;
+
+		/* XXX: Detect embedded NULs in the txt record? */
+		txt = luaL_checkstring(L, 2);
+		auxL_ref(L, 2, &dkim->ref.txt); /* anchor txt string */
+		dkim->cb.key_lookup.ttl = luaL_optnumber(L, 3, 0);
+	} else {
+		/* don't leave parked handles waiting on a lookup that raised */
+		if (dkim->lib->coalesce.flights && lua_type(L, 2) != LUA_TNUMBER)
+			DKIM_forfeit(L, dkim, dkim->cb.key_lookup.siginfo);
+
+		stat = auxL_checkcbstat(L, 2);
+		auxL_unref(L, &dkim->ref.txt);
+	}
+
+	dkim->cb.key_lookup.stat = stat;
+	dkim->cb.key_lookup.txt = txt;
+	dkim->cb.done |= DKIM_CB_KEY_LOOKUP;
+
+	if (dkim->lib->coalesce.flights)
+		DKIM_resolve(L, dkim, dkim->cb.key_lookup.siginfo, stat, txt);
+
+	return 0;
+} /* DKIM_post_key_lookup() */
+
+static int DKIM_post_park(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+
+	dkim->cb.done |= DKIM_CB_PARK;
+
+	return 0;
+} /* DKIM_post_park() */
+
+static int DKIM_post_prescreen(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	DKIM_CBSTAT stat = auxL_checkcbstat(L, 2);
+
+	dkim->cb.prescreen.stat = stat;
+	dkim->cb.done |= DKIM_CB_PRESCREEN;
+
+	return 0;
+} /* DKIM_post_prescreen() */
+
+static void DKIM_prefetch_set(lua_State *L, DKIM_State *dkim, int i, int index) {
+	if (lua_type(L, index) == LUA_TSTRING) {
+		auxL_ref(L, index, &dkim->prefetch.entry[i].ref);
+		dkim->prefetch.entry[i].txt = lua_tostring(L, index);
+	}
+
+	dkim->prefetch.entry[i].state = DKIM_PREFETCH_DONE;
+} /* DKIM_prefetch_set() */
+
+static int DKIM_post_prefetch(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int i = lua_tointeger(L, lua_upvalueindex(1));
+
+	lua_settop(L, 2);
+
+	if (i >= 0 && i < dkim->prefetch.count)
+		DKIM_prefetch_set(L, dkim, i, 2);
+
+	return 0;
+} /* DKIM_post_prefetch() */
+
+/*
+ * dkim:prefetched(name, txt) - Deliver a key record for a prefetch whose
+ * callback returned before the answer was known.
+ */
+static int DKIM_prefetched(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	int i;
+
+	luaL_checkstring(L, 3);
+
+	for (i = 0; i < dkim->prefetch.count; i++) {
+		if (!strcasecmp(dkim->prefetch.entry[i].name, name)) {
+			DKIM_prefetch_set(L, dkim, i, 3);
+			lua_pushboolean(L, 1);
+
+			return 1;
+		}
+	}
+
+	lua_pushboolean(L, 0);
+
+	return 1;
+} /* DKIM_prefetched() */
+
+static int DKIM_getpending(lua_State *L) {
+	DKIM_State *dkim = DKIM_checkself(L, 1);
+	int exec = dkim->cb.exec & ~dkim->cb.done;
+	int i;
+
+	/* stop issuing callbacks; the retried call reports the timeout */
+	if (DKIM_expired(dkim))
+		return 0;
+
+	if (DKIM_CB_FINAL & exec) {
+		lua_pushcfunction(L, DKIM_post_final);
+		auxL_getref(L, dkim->lib->final);
+		lua_pushvalue(L, 1);
+		lua_createtable(L, dkim->cb.final.sigcount, 0);
+
+		for (i = 0; i < dkim->cb.final.sigcount; i++) {
+			DKIM_SIGINFO_push(L, 1, dkim->cb.final.siglist[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+
+		return 4;
+	} else if (DKIM_CB_KEY_LOOKUP & exec) {
+		lua_pushcfunction(L, DKIM_post_key_lookup);
+		auxL_getref(L, dkim->lib->key_lookup);
+		lua_pushvalue(L, 1);
+		DKIM_SIGINFO_push(L, 1, dkim->cb.key_lookup.siginfo);
+
+		return 4;
+	} else if ((DKIM_CB_PARK & exec) && dkim->parked) {
+		lua_pushcfunction(L, DKIM_post_park);
+		auxL_getref(L, dkim->lib->coalesce.wait);
+		lua_pushvalue(L, 1);
+		lua_pushstring(L, dkim->parked->name);
+
+		return 4;
+	} else if (DKIM_CB_PRESCREEN & exec) {
+		lua_pushcfunction(L, DKIM_post_prescreen);
+		auxL_getref(L, dkim->lib->prescreen);
+		lua_pushvalue(L, 1);
+		lua_createtable(L, dkim->cb.prescreen.sigcount, 0);
+
+		for (i = 0; i < dkim->cb.prescreen.sigcount; i++) {
+			DKIM_SIGINFO_push(L, 1, dkim->cb.prescreen.siglist[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+
+		return 4;
+	}
+
+	for (i = 0; i < dkim->prefetch.count; i++) {
+		if (dkim->prefetch.entry[i].state != DKIM_PREFETCH_PENDING)
+			continue;
+
+		dkim->prefetch.entry[i].state = DKIM_PREFETCH_EXEC;
+
+		lua_pushinteger(L, i);
+		lua_pushcclosure(L, DKIM_post_prefetch, 1);
+		auxL_getref(L, dkim->lib->prefetch);
+		lua_pushvalue(L, 1);
+		lua_pushstring(L, dkim->prefetch.entry[i].name);
+
+		return 4;
+	}
+
+	return 0;
+} /* DKIM_getpending() */
+
+/*
+ * Store or give up on a refreshed key cache record. The message itself
+ * was already verified with the record the cache held.
+ */
+static int DKIM_post_refresh(lua_State *L) {
+	DKIM_State *dkim = luaL_checkudata(L, 1, "DKIM*"); /* may be closed */
+	const char *name = lua_tostring(L, lua_upvalueindex(1));
+	struct aux_kentry *ent;
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		DKIM_LIB_kcache_store(dkim->lib, name, lua_tostring(L, 2), luaL_optnumber(L, 3, 0));
+	} else if ((ent = aux_kcache_lookup(&dkim->lib->kcache, name))) {
+		/* back off before the next hit tries again */
+		ent->refresh = aux_walltime();
+		ent->failures++;
+	}
+
+	return 0;
+} /* DKIM_post_refresh() */
+
+/*
+ * Like dkim:getpending, but for the key cache refreshes queued while the
+ * message was processed. See dkim:refresh in opendkim.lua.
+ */
+static int DKIM_getrefresh(lua_State *L) {
+	DKIM_State *dkim = luaL_checkudata(L, 1, "DKIM*"); /* may be closed */
+	DKIM_SIGINFO *siginfo;
+
+	if (!dkim->ctx || dkim->refresh.count == 0 || dkim->lib->key_lookup == LUA_NOREF)
+		return 0;
+
+	siginfo = dkim->refresh.siginfo[--dkim->refresh.count];
+
+	/* by name, as the callback may close the handle and free siginfo */
+	lua_pushfstring(L, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo));
+	lua_pushcclosure(L, DKIM_post_refresh, 1);
+	auxL_getref(L, dkim->lib->key_lookup);
+	lua_pushvalue(L, 1);
+	DKIM_SIGINFO_push(L, 1, siginfo);
+
+	return 4;
+} /* DKIM_getrefresh() */
+
+/* release the claims of refreshes never issued, so another handle can */
+static void DKIM_refresh_drop(DKIM_State *dkim) {
+	char name[AUX_KEYDB_MAXNAME];
+	struct aux_kentry *ent;
+	DKIM_SIGINFO *siginfo;
+
+	while (dkim->refresh.count > 0) {
+		siginfo = dkim->refresh.siginfo[--dkim->refresh.count];
+
+		if (DKIM_keyname(name, siginfo)
+		&&  (ent = aux_kcache_lookup(&dkim->lib->kcache, name)) && !ent->failures)
+			ent->refresh = 0;
+	}
+} /* DKIM_refresh_drop() */
+
+static void DKIM_close_(DKIM_State *dkim) {
+	if (dkim->ctx) {
+		DKIM_refresh_drop(dkim);
+
+		dkim_free(dkim->ctx);
+		dkim->ctx = NULL;
+	}
+
+	free(dkim->bodybuf.data);
+	dkim->bodybuf.data = NULL;
+	dkim->bodybuf.count = 0;
+
+	free(dkim->pump.data);
+	dkim->pump.data = NULL;
+	dkim->pump.size = 0;
+	dkim->pump.head = 0;
+	dkim->pump.tail = 0;
+
+	free(dkim->pump.out.data);
+	dkim->pump.out.data = NULL;
+	dkim->pump.out.size = 0;
+	dkim->pump.out.head = 0;
+	dkim->pump.out.tail = 0;
+
+	free(dkim->usage.keys);
+	dkim->usage.keys = NULL;
+
+	DKIM_inflate_close(dkim);
+
+	/* must come after dkim_free, which still uses the arena */
+	aux_arena_reset(&dkim->arena);
+} /* DKIM_close_() */
+
+static void DKIM_unref_(lua_State *L, DKIM_State *dkim) {
+	int i;
+
+	auxL_unref(L, &dkim->ref.txt);
+	auxL_unref(L, &dkim->ref.key);
+
+	for (i = 0; i < dkim->prefetch.count; i++) {
+		auxL_unref(L, &dkim->prefetch.entry[i].ref);
+		dkim->prefetch.entry[i].txt = NULL;
+	}
+
+	dkim->prefetch.count = 0;
+} /* DKIM_unref_() */
+
+static int DKIM_close(lua_State *L) {
+	DKIM_State *dkim = luaL_checkudata(L, 1, "DKIM*");
+
+	DKIM_close_(dkim);
+	DKIM_unref_(L, dkim);
+
+	if (dkim->lib)
+		DKIM_abandon(L, dkim, 1);
+
+	return 0;
+} /* DKIM_close() */
+
+static int DKIM__gc(lua_State *L) {
+	DKIM_State *dkim = luaL_checkudata(L, 1, "DKIM*");
+
+	DKIM_close_(dkim);
+	DKIM_unref_(L, dkim);
+
+	if (dkim->lib)
+		DKIM_abandon(L, dkim, 0);
+
+	dkim->lib = NULL;
+	auxL_unref(L, &dkim->ref.lib);
+
+	return 0;
+} /* DKIM__gc() */
+
+static luaL_Reg DKIM_methods[] = {
+	/* administration methods */
+	{ "geterror", DKIM_geterror },
+	{ "getmode", DKIM_getmode },
+	{ "get_signer", DKIM_get_signer },
+
+	/* signing methods */
+	{ "add_querymethod", DKIM_add_querymethod },
+	{ "add_xtag", DKIM_add_xtag },
+	{ "getpartial", DKIM_getpartial },
+	{ "getsighdr", DKIM_getsighdr },
+	{ "privkey_load", DKIM_privkey_load },
+	{ "set_margin", DKIM_set_margin },
+	{ "set_signer", DKIM_set_signer },
+	{ "setpartial", DKIM_setpartial },
+	{ "signhdrs", DKIM_signhdrs },
+	{ "write_signed", DKIM_write_signed },
+#if HAVE_OPENSSL
+	{ "stamper", DKIM_stamper },
+#endif
+
+	/* verification methods */
+#if 0 /* does not support asynchronous DNS */
+	{ "atps_check", DKIM_atps_check },
+#endif
+#if 0 /* not necessary */
+	{ "diffheaders", DKIM_diffheaders },
+#endif
+#if 0 /* experimental; documented but not actually implemented in OpenDKIM */
+	{ "get_reputation", DKIM_dkim_get_reputation },
+#endif
+	{ "getsiglist", DKIM_getsiglist },
+	{ "getsignature", DKIM_getsignature },
+	{ "getsslbuf", DKIM_getsslbuf },
+	{ "getuser", DKIM_getuser },
+	{ "minbody", DKIM_minbody },
+	{ "ohdrs", DKIM_ohdrs },
+	{ "sig_getcanonlen", DKIM_sig_getcanonlen },
+	{ "sig_getidentity", DKIM_sig_getidentity },
+	{ "sig_getqueries", DKIM_sig_getqueries },
+	{ "sig_getreportinfo", DKIM_sig_getreportinfo },
+	{ "sig_process", DKIM_sig_process },
+
+	/* processing methods */
+	{ "header", DKIM_header },
+	{ "header_block", DKIM_header_block },
+	{ "eoh", DKIM_eoh },
+	{ "body", DKIM_body },
+	{ "body_iov", DKIM_body_iov },
+	{ "set_body_buffer", DKIM_set_body_buffer },
+	{ "pump", DKIM_pump },
+	{ "tee", DKIM_tee },
+	{ "feed_smtp_data", DKIM_feed_smtp_data },
+	{ "feed_compressed", DKIM_feed_compressed },
+	{ "eom", DKIM_eom },
+	{ "chunk", DKIM_chunk },
+
+	/* utility methods */
+	{ "getid", DKIM_getid },
+	{ "getctx", DKIM_getctx },
+	{ "set_deadline", DKIM_set_deadline },
+	{ "get_deadline", DKIM_get_deadline },
+#if 0 /* not implemented (documentation out of date) */
+	{ "get_msgdate", DKIM_get_msgdate },
+#endif
+	{ "get_sigsubstring", DKIM_get_sigsubstring },
+	{ "key_syntax", DKIM_key_syntax },
+
+	/* module auxiliary routines */
+	{ "getpending", DKIM_getpending },
+	{ "getrefresh", DKIM_getrefresh },
+	{ "prefetched", DKIM_prefetched },
+	{ "close", DKIM_close },
+	{ NULL, NULL },
+}; /* DKIM_methods[] */
+
+static luaL_Reg DKIM_metamethods[] = {
+	{ "__gc", &DKIM__gc },
+	{ NULL,   NULL },
+}; /* DKIM_metamethods[] */
+
+
+/*
+ * (DKIM_KEYSTORE *) B I N D I N G S
+ *
+ * In-memory table of signing keys loaded from a directory laid out as
+ * DIR/DOMAIN/SELECTOR.private, as produced by opendkim-genkey. A reload
+ * builds a complete new table before swapping it in, so a failed reload
+ * leaves the previous keys in place. libopendkim copies the key into each
+ * DKIM handle, so in-flight handles are never disturbed.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define DKIM_KEYSTORE_SUFFIX ".private"
+
+#if HAVE_INOTIFY
+#define DKIM_KEYSTORE_INMASK (IN_CREATE|IN_DELETE|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF)
+#endif
+
+typedef struct {
+	auxref_t dir; /* directory path string */
+	auxref_t keys; /* domain => { default = selector, mtime = time, keys = { selector => key } } */
+	uint64_t stamp; /* fingerprint of key files at last load */
+	int inotify; /* inotify descriptor, or -1 when polling */
+	double interval; /* polling interval */
+} DKIM_KEYSTORE_State;
+
+static const DKIM_KEYSTORE_State DKIM_KEYSTORE_initializer = {
+	.dir = LUA_NOREF,
+	.keys = LUA_NOREF,
+	.inotify = -1,
+};
+
+static DKIM_KEYSTORE_State *DKIM_KEYSTORE_checkself(lua_State *L, int index) {
+	return luaL_checkudata(L, index, "DKIM_KEYSTORE*");
+} /* DKIM_KEYSTORE_checkself() */
+
+static void DKIM_KEYSTORE_watch(DKIM_KEYSTORE_State *ks, const char *path) {
+#if HAVE_INOTIFY
+	if (ks->inotify != -1)
+		inotify_add_watch(ks->inotify, path, DKIM_KEYSTORE_INMASK);
+#else
+	(void)ks; (void)path;
+#endif
+} /* DKIM_KEYSTORE_watch() */
+
+/*
+ * Load the key at path into the domain table at index. The most recently
+ * modified key of a domain becomes its default selector.
+ */
+static int DKIM_KEYSTORE_add(lua_State *L, int index, const char *domain, const char *selector, size_t sellen, const char *path, time_t mtime) {
+	int entry, replace, error;
+
+	auxL_pushlower(L, domain);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, index);
+
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_setfield(L, -2, "keys");
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, index);
+	}
+
+	entry = lua_gettop(L);
+
+	lua_getfield(L, entry, "keys");
+	lua_pushlstring(L, selector, sellen);
+
+	if ((error = auxL_readfile(L, path))) {
+		lua_settop(L, entry - 2);
+
+		return error;
+	}
+
+	lua_rawset(L, -3);
+
+	lua_getfield(L, entry, "mtime");
+	lua_getfield(L, entry, "default");
+
+	if (lua_isnil(L, -2)) {
+		replace = 1;
+	} else if (mtime != (time_t)lua_tonumber(L, -2)) {
+		replace = mtime > (time_t)lua_tonumber(L, -2);
+	} else {
+		lua_pushlstring(L, selector, sellen);
+		replace = strcmp(lua_tostring(L, -1), luaL_optstring(L, -2, "")) > 0;
+	}
+
+	if (replace) {
+		lua_pushlstring(L, selector, sellen);
+		lua_setfield(L, entry, "default");
+		lua_pushnumber(L, mtime);
+		lua_setfield(L, entry, "mtime");
+	}
+
+	lua_settop(L, entry - 2);
+
+	return 0;
+} /* DKIM_KEYSTORE_add() */
+
+/*
+ * Walk the key directory, computing an order-independent fingerprint over
+ * each key file's name, inode, size and mtime so that polling can detect
+ * changes with stat(2) alone. If load is true, also push a new domain
+ * table.
+ */
+static int DKIM_KEYSTORE_scan(lua_State *L, DKIM_KEYSTORE_State *ks, _Bool load, uint64_t *stamp) {
+	char dpath[PATH_MAX], fpath[PATH_MAX];
+	const char *dir;
+	DIR *dp = NULL, *sp = NULL;
+	struct dirent *dent, *sent;
+	struct stat st;
+	size_t len, suflen = strlen(DKIM_KEYSTORE_SUFFIX);
+	uint64_t h, sum = 0;
+	int top = lua_gettop(L), error;
+
+	auxL_getref(L, ks->dir);
+	dir = lua_tostring(L, -1);
+
+	if (load)
+		lua_newtable(L);
+
+	if (!(dp = opendir(dir)))
+		goto syerr;
+
+	DKIM_KEYSTORE_watch(ks, dir);
+
+	while ((dent = readdir(dp))) {
+		if (dent->d_name[0] == '.')
+			continue;
+		if (sizeof dpath <= (size_t)snprintf(dpath, sizeof dpath, "%s/%s", dir, dent->d_name))
+			continue;
+		if (0 != stat(dpath, &st) || !S_ISDIR(st.st_mode))
+			continue;
+
+		DKIM_KEYSTORE_watch(ks, dpath);
+
+		if (!(sp = opendir(dpath)))
+			goto syerr;
+
+		while ((sent = readdir(sp))) {
+			len = strlen(sent->d_name);
+
+			if (sent->d_name[0] == '.' || len <= suflen || strcmp(&sent->d_name[len - suflen], DKIM_KEYSTORE_SUFFIX))
+				continue;
+			if (sizeof fpath <= (size_t)snprintf(fpath, sizeof fpath, "%s/%s", dpath, sent->d_name))
+				continue;
+			if (0 != stat(fpath, &st) || !S_ISREG(st.st_mode))
+				continue;
+
+			h = aux_fnv1a(AUX_FNV1A_INIT, fpath, strlen(fpath));
+			h = aux_fnv1a(h, &st.st_ino, sizeof st.st_ino);
+			h = aux_fnv1a(h, &st.st_size, sizeof st.st_size);
+			h = aux_fnv1a(h, &st.st_mtime, sizeof st.st_mtime);
+			sum += h;
+
+			if (load && (error = DKIM_KEYSTORE_add(L, top + 2, dent->d_name, sent->d_name, len - suflen, fpath, st.st_mtime)))
+				goto error;
+		}
+
+		closedir(sp);
+		sp = NULL;
+	}
+
+	closedir(dp);
+
+	*stamp = sum;
+	lua_remove(L, top + 1); /* directory path */
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	if (sp)
+		closedir(sp);
+	if (dp)
+		closedir(dp);
+
+	lua_settop(L, top);
+
+	return error;
+} /* DKIM_KEYSTORE_scan() */
+
+static int DKIM_KEYSTORE_reload_(lua_State *L, DKIM_KEYSTORE_State *ks) {
+	uint64_t stamp;
+	int error;
+
+	if ((error = DKIM_KEYSTORE_scan(L, ks, 1, &stamp)))
+		return error;
+
+	auxL_ref(L, -1, &ks->keys); /* atomically replace previous table */
+	lua_pop(L, 1);
+	ks->stamp = stamp;
+
+	return 0;
+} /* DKIM_KEYSTORE_reload_() */
+
+/*
+ * Push key and selector for domain, using the default selector if
+ * selector is NULL. Returns the number of values pushed, 0 if not found.
+ */
+static int DKIM_KEYSTORE_lookup(lua_State *L, DKIM_KEYSTORE_State *ks, const char *domain, const char *selector) {
+	int top = lua_gettop(L);
+
+	auxL_getref(L, ks->keys);
+
+	if (!lua_istable(L, -1))
+		goto notfound;
+
+	auxL_pushlower(L, domain);
+	lua_rawget(L, top + 1);
+
+	if (!lua_istable(L, -1))
+		goto notfound;
+
+	if (selector) {
+		lua_pushstring(L, selector);
+	} else {
+		lua_getfield(L, top + 2, "default");
+	}
+
+	lua_getfield(L, top + 2, "keys");
+	lua_pushvalue(L, top + 3);
+	lua_rawget(L, -2);
+
+	if (!lua_isstring(L, -1))
+		goto notfound;
+
+	lua_replace(L, top + 1); /* key */
+	lua_settop(L, top + 3);
+	lua_remove(L, top + 2); /* selector */
+
+	return 2;
+notfound:
+	lua_settop(L, top);
+
+	return 0;
+} /* DKIM_KEYSTORE_lookup() */
+
+static int DKIM_KEYSTORE_get(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+	const char *domain = luaL_checkstring(L, 2);
+	const char *selector = luaL_optstring(L, 3, NULL);
+
+	return DKIM_KEYSTORE_lookup(L, ks, domain, selector);
+} /* DKIM_KEYSTORE_get() */
+
+static int DKIM_KEYSTORE_reload(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+	int error;
+
+	if ((error = DKIM_KEYSTORE_reload_(L, ks)))
+		return auxL_pusherror(L, error, "~$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_KEYSTORE_reload() */
+
+/*
+ * Reload if the directory changed. With inotify this drains the pending
+ * events, otherwise it compares the fingerprint of the key files.
+ */
+static int DKIM_KEYSTORE_check(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+	_Bool changed = 0;
+	uint64_t stamp;
+	int error;
+
+#if HAVE_INOTIFY
+	if (ks->inotify != -1) {
+		char buf[4096];
+		ssize_t n;
+
+		while ((n = read(ks->inotify, buf, sizeof buf)) > 0 || (n == -1 && errno == EINTR)) {
+			if (n > 0)
+				changed = 1;
+		}
+
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return auxL_pusherror(L, errno, "~$#");
+
+		goto reload;
+	}
+#endif
+
+	if ((error = DKIM_KEYSTORE_scan(L, ks, 0, &stamp)))
+		return auxL_pusherror(L, error, "~$#");
+
+	changed = (stamp != ks->stamp);
+#if HAVE_INOTIFY
+reload:
+#endif
+	if (changed && (error = DKIM_KEYSTORE_reload_(L, ks)))
+		return auxL_pusherror(L, error, "~$#");
+
+	lua_pushboolean(L, changed);
+
+	return 1;
+} /* DKIM_KEYSTORE_check() */
+
+static int DKIM_KEYSTORE_pollfd(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+
+	if (ks->inotify == -1)
+		return 0;
+
+	lua_pushinteger(L, ks->inotify);
+
+	return 1;
+} /* DKIM_KEYSTORE_pollfd() */
+
+static int DKIM_KEYSTORE_events(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+
+	if (ks->inotify == -1)
+		return 0;
+
+	lua_pushliteral(L, "r");
+
+	return 1;
+} /* DKIM_KEYSTORE_events() */
+
+static int DKIM_KEYSTORE_timeout(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = DKIM_KEYSTORE_checkself(L, 1);
+
+	if (ks->inotify != -1)
+		return 0;
+
+	lua_pushnumber(L, ks->interval);
+
+	return 1;
+} /* DKIM_KEYSTORE_timeout() */
+
+static int DKIM_KEYSTORE__gc(lua_State *L) {
+	DKIM_KEYSTORE_State *ks = luaL_checkudata(L, 1, "DKIM_KEYSTORE*");
+
+	if (ks->inotify != -1) {
+		close(ks->inotify);
+		ks->inotify = -1;
+	}
+
+	auxL_unref(L, &ks->dir);
+	auxL_unref(L, &ks->keys);
+
+	return 0;
+} /* DKIM_KEYSTORE__gc() */
+
+static luaL_Reg DKIM_KEYSTORE_methods[] = {
+	{ "get",     DKIM_KEYSTORE_get },
+	{ "reload",  DKIM_KEYSTORE_reload },
+	{ "check",   DKIM_KEYSTORE_check },
+	{ "pollfd",  DKIM_KEYSTORE_pollfd },
+	{ "events",  DKIM_KEYSTORE_events },
+	{ "timeout", DKIM_KEYSTORE_timeout },
+	{ NULL,      NULL },
+}; /* DKIM_KEYSTORE_methods[] */
+
+static luaL_Reg DKIM_KEYSTORE_metamethods[] = {
+	{ "__gc", &DKIM_KEYSTORE__gc },
+	{ NULL,   NULL },
+}; /* DKIM_KEYSTORE_metamethods[] */
+
+
+/*
+ * (DKIM_LIB *) B I N D I N G S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static DKIM_LIB_State *DKIM_LIB_checkself(lua_State *L, int index) {
+	DKIM_LIB_State *lib = luaL_checkudata(L, index, "DKIM_LIB*");
+
+	luaL_argcheck(L, lib->ctx, index, "attempt to use a closed DKIM_LIB handle");
+
+	return lib;
+} /* DKIM_LIB_checkself() */
+
+static DKIM_LIB_State *DKIM_LIB_prep(lua_State *L) {
+	DKIM_LIB_State *lib;
+
+	lib = lua_newuserdata(L, sizeof *lib);
+	*lib = DKIM_LIB_initializer;
+	luaL_setmetatable(L, "DKIM_LIB*");
+
+	return lib;
+} /* DKIM_LIB_prep() */
+
+static int DKIM_LIB_flush_cache(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	int n;
+	
+	if ((n = dkim_flush_cache(lib->ctx)) >= 0) {
+		lua_pushinteger(L, n);
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* DKIM_LIB_flush_cache() */
+
+static int DKIM_LIB_getcachestats(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	_Bool reset = auxL_optboolean(L, 2, 0);
+	unsigned int queries, hits, expired, keys;
+	DKIM_STAT stat;
+
+	if (DKIM_STAT_OK != (stat = dkim_getcachestats(lib->ctx, &queries, &hits, &expired, &keys, reset)))
+		return auxL_pushstat(L, stat, "~$#");
+
+	lua_pushinteger(L, queries);
+	lua_pushinteger(L, hits);
+	lua_pushinteger(L, expired);
+	lua_pushinteger(L, keys);
+
+	return 4;
+} /* DKIM_LIB_getcachestats() */
+
+static int DKIM_LIB_libfeature(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	lua_pushboolean(L, dkim_libfeature(lib->ctx, luaL_checkinteger(L, 2)));
+
+	return 1;
+} /* DKIM_LIB_libfeature() */
+
+/*
+ * Hash of the key record for siginfo if one is at hand without a query,
+ * otherwise 0.
+ */
+static uint64_t DKIM_vcache_keyhash(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	char name[AUX_KEYDB_MAXNAME];
+	const char *txt;
+	size_t len;
+
+	if ((size_t)snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo)) >= sizeof name)
+		return 0;
+
+	if ((txt = DKIM_prefetch_find(dkim, name)))
+		return aux_fnv1a(AUX_FNV1A_INIT, txt, strlen(txt));
+
+	if ((txt = aux_keydb_find(&dkim->lib->keydb, name, &len)))
+		return aux_fnv1a(AUX_FNV1A_INIT, txt, len);
+
+	if ((txt = aux_kcache_find(&dkim->lib->kcache, name, aux_walltime())))
+		return aux_fnv1a(AUX_FNV1A_INIT, txt, strlen(txt));
+
+	return 0;
+} /* DKIM_vcache_keyhash() */
+
+/*
+ * Called from the final callback, after the message hashes are complete
+ * but before any signature is verified. Signatures with a cached outcome
+ * are marked ignored so libopendkim skips the public key operation, and
+ * the binding reports the cached outcome in their place.
+ */
+static void DKIM_vcache_probe(DKIM_State *dkim, DKIM_SIGINFO **siglist, int sigcount) {
+	struct aux_vcache *cache = &dkim->lib->vcache;
+	const struct aux_ventry *ent;
+	struct DKIM_sigstate *sig;
+	void *hh, *bh;
+	size_t hhlen, bhlen;
+	const char *b;
+	double now;
+	int i;
+
+	if (!cache->size)
+		return;
+
+	now = aux_monotime();
+
+	for (i = 0; i < sigcount; i++) {
+		if (dkim_sig_getflags(siglist[i]) & (DKIM_SIGFLAG_IGNORE|DKIM_SIGFLAG_PROCESSED))
+			continue;
+		if (dkim_sig_geterror(siglist[i]) != DKIM_SIGERROR_UNKNOWN)
+			continue;
+		if (DKIM_STAT_OK != dkim_sig_gethashes(siglist[i], &hh, &hhlen, &bh, &bhlen) || !hh || !bh)
+			continue;
+		if (!(b = (char *)dkim_sig_gettagvalue(siglist[i], 0, (unsigned char *)"b")))
+			continue;
+
+		if (!(ent = aux_vcache_find(cache, hh, hhlen, bh, bhlen, b, DKIM_vcache_keyhash(dkim, siglist[i]), now)))
+			continue;
+
+		if (!(sig = DKIM_sigstate(dkim, siglist[i], 1)))
+			continue;
+
+		sig->hit = 1;
+		sig->result = ent->result;
+		dkim_sig_ignore(siglist[i]);
+	}
+} /* DKIM_vcache_probe() */
+
+/*
+ * Called after dkim_eom. Store the outcome of every signature libopendkim
+ * verified, and substitute cached outcomes for the ones it skipped.
+ */
+static DKIM_STAT DKIM_vcache_store(DKIM_State *dkim, DKIM_STAT stat, _Bool *testkey) {
+	struct aux_vcache *cache = &dkim->lib->vcache;
+	struct DKIM_sigstate *sig;
+	DKIM_SIGINFO **siglist = NULL, *pass = NULL, *fail = NULL;
+	struct aux_vresult result;
+	void *hh, *bh;
+	size_t hhlen, bhlen;
+	const char *b;
+	double now;
+	int sigcount = 0, i;
+
+	if (!cache->size || stat == DKIM_STAT_CBTRYAGAIN || stat == DKIM_STAT_TIMEOUT)
+		return stat;
+
+	if (DKIM_STAT_OK != dkim_getsiglist(dkim->ctx, &siglist, &sigcount))
+		return stat;
+
+	now = aux_monotime();
+
+	for (i = 0; i < sigcount; i++) {
+		sig = DKIM_sigstate(dkim, siglist[i], 0);
+
+		if (sig && sig->hit) {
+			if ((sig->result.flags & DKIM_SIGFLAG_PASSED) && sig->result.bh == DKIM_SIGBH_MATCH) {
+				if (!pass)
+					pass = siglist[i];
+			} else if (!fail) {
+				fail = siglist[i];
+			}
+
+			continue;
+		}
+
+		result.flags = dkim_sig_getflags(siglist[i]);
+		result.error = dkim_sig_geterror(siglist[i]);
+		result.bh = dkim_sig_getbh(siglist[i]);
+
+		/* only cache outcomes of the public key operation itself */
+		if (!(result.flags & DKIM_SIGFLAG_PROCESSED) || (result.flags & DKIM_SIGFLAG_IGNORE))
+			continue;
+		if (result.error != DKIM_SIGERROR_OK && result.error != DKIM_SIGERROR_BADSIG)
+			continue;
+		if (DKIM_STAT_OK != dkim_sig_getkeysize(siglist[i], &result.keybits))
+			continue;
+		if (DKIM_STAT_OK != dkim_sig_gethashes(siglist[i], &hh, &hhlen, &bh, &bhlen) || !hh || !bh)
+			continue;
+		if (!(b = (char *)dkim_sig_gettagvalue(siglist[i], 0, (unsigned char *)"b")))
+			continue;
+
+		aux_vcache_store(cache, hh, hhlen, bh, bhlen, b, (sig)? sig->keyhash : 0, &result, now);
+	}
+
+	if (stat == DKIM_STAT_OK || (!pass && !fail))
+		return stat;
+
+	if (pass) {
+		dkim->vcache.signature = pass;
+		*testkey = !!(DKIM_vcache_result(dkim, pass)->flags & DKIM_SIGFLAG_TESTKEY);
+
+		return DKIM_STAT_OK;
+	}
+
+	/* every signature we skipped failed, and libopendkim saw none */
+	if (stat == DKIM_STAT_NOSIG) {
+		dkim->vcache.signature = fail;
+
+		return DKIM_STAT_BADSIG;
+	}
+
+	return stat;
+} /* DKIM_vcache_store() */
+
+static int aux_strcasecmpp(const void *a, const void *b) {
+	return strcasecmp(*(const char **)a, *(const char **)b);
+} /* aux_strcasecmpp() */
+
+/* true if sub is dom or one of its subdomains */
+static _Bool aux_isdomainof(const char *sub, const char *dom) {
+	size_t n = strlen(sub), m = strlen(dom);
+
+	if (n < m || strcasecmp(&sub[n - m], dom))
+		return 0;
+
+	return n == m || sub[n - m - 1] == '.';
+} /* aux_isdomainof() */
+
+/*
+ * Whether a pass by siginfo settles the message under the early exit
+ * policy. Alignment is relaxed: either domain may be a subdomain of the
+ * other.
+ */
+static _Bool DKIM_acceptable(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	int flags = dkim->lib->early.flags;
+	const char *d = (char *)dkim_sig_getdomain(siginfo), *from;
+
+	if (!d)
+		return 0;
+	if (flags & DKIM_EARLY_ANY)
+		return 1;
+	if ((flags & DKIM_EARLY_LISTED) && bsearch(&d, dkim->lib->early.domain, dkim->lib->early.count, sizeof *dkim->lib->early.domain, &aux_strcasecmpp))
+		return 1;
+	if ((flags & DKIM_EARLY_ALIGNED) && (from = (char *)dkim_getdomain(dkim->ctx)))
+		return aux_isdomainof(d, from) || aux_isdomainof(from, d);
+
+	return 0;
+} /* DKIM_acceptable() */
+
+static _Bool DKIM_passed(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	const struct aux_vresult *result;
+	unsigned int flags;
+
+	if ((result = DKIM_vcache_result(dkim, siginfo)))
+		return (result->flags & DKIM_SIGFLAG_PASSED) && result->bh == DKIM_SIGBH_MATCH;
+
+	flags = dkim_sig_getflags(siginfo);
+
+	return (flags & DKIM_SIGFLAG_PROCESSED) && (flags & DKIM_SIGFLAG_PASSED) && dkim_sig_getbh(siginfo) == DKIM_SIGBH_MATCH;
+} /* DKIM_passed() */
+
+/*
+ * Verify siglist in order ahead of libopendkim, and once a signature has
+ * passed that settles the message mark the rest ignored, so no query or
+ * public key operation is done for them. Resumes at dkim->early.next
+ * when a key lookup asks to try again.
+ */
+static DKIM_CBSTAT DKIM_early_exit(DKIM_State *dkim, DKIM_SIGINFO **siglist, int sigcount) {
+	int i;
+
+	for (i = dkim->early.next; i < sigcount; i++) {
+		if (!(dkim_sig_getflags(siglist[i]) & (DKIM_SIGFLAG_IGNORE|DKIM_SIGFLAG_PROCESSED))) {
+			if (DKIM_STAT_CBTRYAGAIN == dkim_sig_process(dkim->ctx, siglist[i])) {
+				dkim->early.next = i;
 
-static int DKIM_post_key_lookup(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	const char *txt = NULL;
-	DKIM_CBSTAT stat;
+				return DKIM_CBSTAT_TRYAGAIN;
+			}
+		}
 
-	lua_settop(L, 2);
+		if (DKIM_passed(dkim, siglist[i]) && DKIM_acceptable(dkim, siglist[i]))
+			break;
+	}
 
-	if (lua_type(L, 2) == LUA_TSTRING) {
-		stat = DKIM_CBSTAT_CONTINUE;
+	for (i++; i < sigcount; i++) {
+		if (!(dkim_sig_getflags(siglist[i]) & DKIM_SIGFLAG_PROCESSED))
+			dkim_sig_ignore(siglist[i]);
+	}
 
-		/* XXX: Detect embedded NULs in the txt record? */
-		txt = luaL_checkstring(L, 2);
-		auxL_ref(L, 2, &dkim->ref.txt); /* anchor txt string */
-	} else {
-		stat = auxL_checkcbstat(L, 2);
-		auxL_unref(L, &dkim->ref.txt);
+	dkim->early.next = 0;
+	dkim->cb.exec &= ~DKIM_CB_EARLY;
+
+	return DKIM_CBSTAT_CONTINUE;
+} /* DKIM_early_exit() */
+
+/*
+ * Relative cost of settling the message with siginfo; lower is cheaper.
+ * Acceptable signatures come first as only they can end processing,
+ * then those whose key is at hand, then Ed25519 before RSA.
+ */
+static int DKIM_sigcost(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	dkim_alg_t alg;
+	int cost = 0;
+
+	/* cached or skipped, so free */
+	if (dkim_sig_getflags(siginfo) & DKIM_SIGFLAG_IGNORE)
+		return 0;
+
+	if (!DKIM_acceptable(dkim, siginfo))
+		cost += 4;
+	if (!DKIM_vcache_keyhash(dkim, siginfo))
+		cost += 2;
+#if defined DKIM_SIGN_ED25519SHA256
+	if (DKIM_STAT_OK != dkim_sig_getsignalg(siginfo, &alg) || alg != DKIM_SIGN_ED25519SHA256)
+		cost += 1;
+#else
+	(void)alg;
+	cost += 1;
+#endif
+
+	return cost;
+} /* DKIM_sigcost() */
+
+/*
+ * Stable insertion sort of siglist by DKIM_sigcost. Costs of more than
+ * DKIM_SIGSTATE_MAX signatures go on the heap, and should that fail only
+ * the first DKIM_SIGSTATE_MAX are sorted, ahead of the rest.
+ */
+static void DKIM_sigsort(DKIM_State *dkim, DKIM_SIGINFO **siglist, int sigcount) {
+	int buf[DKIM_SIGSTATE_MAX], *cost = buf, i, j;
+
+	if (sigcount > DKIM_SIGSTATE_MAX && !(cost = malloc(sigcount * sizeof *cost))) {
+		cost = buf;
+		sigcount = DKIM_SIGSTATE_MAX;
 	}
 
-	dkim->cb.key_lookup.stat = stat;
-	dkim->cb.key_lookup.txt = txt;
-	dkim->cb.done |= DKIM_CB_KEY_LOOKUP;
+	for (i = 0; i < sigcount; i++)
+		cost[i] = DKIM_sigcost(dkim, siglist[i]);
 
-	return 0;
-} /* DKIM_post_key_lookup() */
+	for (i = 1; i < sigcount; i++) {
+		DKIM_SIGINFO *sig = siglist[i];
+		int c = cost[i];
 
-static int DKIM_post_prescreen(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	DKIM_CBSTAT stat = auxL_checkcbstat(L, 2);
+		for (j = i; j > 0 && cost[j - 1] > c; j--) {
+			siglist[j] = siglist[j - 1];
+			cost[j] = cost[j - 1];
+		}
 
-	dkim->cb.prescreen.stat = stat;
-	dkim->cb.done |= DKIM_CB_PRESCREEN;
+		siglist[j] = sig;
+		cost[j] = c;
+	}
 
-	return 0;
-} /* DKIM_post_prescreen() */
+	if (cost != buf)
+		free(cost);
+} /* DKIM_sigsort() */
 
-static int DKIM_getpending(lua_State *L) {
-	DKIM_State *dkim = DKIM_checkself(L, 1);
-	int exec = dkim->cb.exec & ~dkim->cb.done;
-	int i;
+static DKIM_CBSTAT DKIM_on_final_(DKIM_State *dkim, DKIM *_dkim, DKIM_SIGINFO **siglist, int sigcount) {
+	DKIM_CBSTAT stat;
 
-	if (DKIM_CB_FINAL & exec) {
-		lua_pushcfunction(L, DKIM_post_final);
-		auxL_getref(L, dkim->lib->final);
-		lua_pushvalue(L, 1);
-		lua_createtable(L, dkim->cb.final.sigcount, 0);
+	if (!(dkim->cb.exec & DKIM_CB_FINAL)) {
+		DKIM_vcache_probe(dkim, siglist, sigcount);
 
-		for (i = 0; i < dkim->cb.final.sigcount; i++) {
-			DKIM_SIGINFO_push(L, 1, dkim->cb.final.siglist[i]);
-			lua_rawseti(L, -2, i + 1);
+		if (dkim->lib->early.flags)
+			DKIM_sigsort(dkim, siglist, sigcount);
+
+		if (dkim->lib->native.final.f) {
+			stat = dkim->lib->native.final.f(dkim->lib->native.final.arg, _dkim, siglist, sigcount);
+
+			if (stat != DKIM_CBSTAT_DEFAULT)
+				return stat;
 		}
 
-		return 4;
-	} else if (DKIM_CB_KEY_LOOKUP & exec) {
-		lua_pushcfunction(L, DKIM_post_key_lookup);
-		auxL_getref(L, dkim->lib->key_lookup);
-		lua_pushvalue(L, 1);
-		DKIM_SIGINFO_push(L, 1, dkim->cb.key_lookup.siginfo);
+		/* installed only for the verification cache, early exit or a C module */
+		if (dkim->lib->final == LUA_NOREF)
+			return DKIM_CBSTAT_CONTINUE;
+	}
 
-		return 4;
-	} else if (DKIM_CB_PRESCREEN & exec) {
-		lua_pushcfunction(L, DKIM_post_prescreen);
-		auxL_getref(L, dkim->lib->prescreen);
-		lua_pushvalue(L, 1);
-		lua_createtable(L, dkim->cb.prescreen.sigcount, 0);
+	if (!(dkim->cb.exec & DKIM_CB_FINAL))
+		goto tryagain;
+	if (!(dkim->cb.done & DKIM_CB_FINAL))
+		goto tryagain;
+	if (dkim->cb.final.siglist != siglist)
+		goto tryagain;
 
-		for (i = 0; i < dkim->cb.prescreen.sigcount; i++) {
-			DKIM_SIGINFO_push(L, 1, dkim->cb.prescreen.siglist[i]);
-			lua_rawseti(L, -2, i + 1);
+	stat = dkim->cb.final.stat;
+
+	dkim->cb.final = DKIM_initializer.cb.final;
+	dkim->cb.exec &= ~DKIM_CB_FINAL;
+	dkim->cb.done &= ~DKIM_CB_FINAL;
+
+	return stat;
+tryagain:
+	dkim->cb.final = DKIM_initializer.cb.final;
+	dkim->cb.final.siglist = siglist;
+	dkim->cb.final.sigcount = sigcount;
+
+	dkim->cb.exec |= DKIM_CB_FINAL;
+
+	return DKIM_CBSTAT_TRYAGAIN;
+} /* DKIM_on_final_() */
+
+static DKIM_CBSTAT DKIM_on_final(DKIM *_dkim, DKIM_SIGINFO **siglist, int sigcount) {
+	DKIM_State *dkim;
+	DKIM_CBSTAT stat;
+
+	if (!(dkim = dkim_get_user_context(_dkim)))
+		return DKIM_CBSTAT_ERROR;
+
+	/* final closure already answered; still verifying for early exit */
+	if (dkim->cb.exec & DKIM_CB_EARLY)
+		return DKIM_early_exit(dkim, siglist, sigcount);
+
+	stat = DKIM_on_final_(dkim, _dkim, siglist, sigcount);
+
+	if (stat != DKIM_CBSTAT_CONTINUE || !dkim->lib->early.flags)
+		return stat;
+
+	dkim->early.next = 0;
+	dkim->cb.exec |= DKIM_CB_EARLY;
+
+	return DKIM_early_exit(dkim, siglist, sigcount);
+} /* DKIM_on_final() */
+
+static int DKIM_LIB_set_final(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	auxL_getref(L, lib->final); /* load previous callback */
+	auxL_ref(L, 2, &lib->final); /* anchor new callback */
+	dkim_set_final(lib->ctx, &DKIM_on_final);
+
+	return 1; /* return previous callback */
+} /* DKIM_LIB_set_final() */
+
+static void DKIM_LIB_early_reset(DKIM_LIB_State *lib) {
+	size_t i;
+
+	for (i = 0; i < lib->early.count; i++)
+		free(lib->early.domain[i]);
+
+	free(lib->early.domain);
+	lib->early = DKIM_LIB_initializer.early;
+} /* DKIM_LIB_early_reset() */
+
+/*
+ * lib:set_early_exit(accept) - Stop verifying once a signature passes
+ * that settles the message: any (true), one aligned with the From domain
+ * ("aligned"), or one whose domain is in the array accept, which may
+ * also set accept.aligned. nil or false disables it.
+ */
+static int DKIM_LIB_set_early_exit(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	size_t count, i;
+	int error;
+
+	DKIM_LIB_early_reset(lib);
+
+	switch (lua_type(L, 2)) {
+	case LUA_TNONE:
+	case LUA_TNIL:
+		break;
+	case LUA_TBOOLEAN:
+		lib->early.flags = (lua_toboolean(L, 2))? DKIM_EARLY_ANY : 0;
+
+		break;
+	case LUA_TSTRING:
+		luaL_argcheck(L, !strcmp(lua_tostring(L, 2), "aligned"), 2, "expected \"aligned\"");
+		lib->early.flags = DKIM_EARLY_ALIGNED;
+
+		break;
+	default:
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		lua_getfield(L, 2, "aligned");
+		if (lua_toboolean(L, -1))
+			lib->early.flags |= DKIM_EARLY_ALIGNED;
+		lua_pop(L, 1);
+
+		if (!(count = lua_rawlen(L, 2)))
+			break;
+
+		if (!(lib->early.domain = calloc(count, sizeof *lib->early.domain)))
+			goto syerr;
+
+		for (i = 0; i < count; i++) {
+			lua_rawgeti(L, 2, i + 1);
+
+			if (!lua_isstring(L, -1)) {
+				DKIM_LIB_early_reset(lib);
+
+				return luaL_argerror(L, 2, "expected array of domain names");
+			}
+
+			if (!(lib->early.domain[i] = strdup(lua_tostring(L, -1))))
+				goto syerr;
+
+			lib->early.count++;
+			lua_pop(L, 1);
 		}
 
-		return 4;
+		qsort(lib->early.domain, lib->early.count, sizeof *lib->early.domain, &aux_strcasecmpp);
+		lib->early.flags |= DKIM_EARLY_LISTED;
+
+		break;
+	}
+
+	if (lib->early.flags)
+		dkim_set_final(lib->ctx, &DKIM_on_final);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+syerr:
+	error = errno;
+	DKIM_LIB_early_reset(lib);
+
+	return auxL_pusherror(L, error, "0$#");
+} /* DKIM_LIB_set_early_exit() */
+
+static lua_Integer DKIM_LIB_optlimit(lua_State *L, int index, const char *name) {
+	lua_Integer n;
+
+	lua_getfield(L, index, name);
+	n = luaL_optinteger(L, -1, 0);
+	luaL_argcheck(L, n >= 0, index, name);
+	lua_pop(L, 1);
+
+	return n;
+} /* DKIM_LIB_optlimit() */
+
+/*
+ * lib:set_limits(t) - Set per-message resource limits from the fields of
+ * t: signatures, headers, header_bytes and key_lookups. Missing or zero
+ * fields mean no limit.
+ */
+static int DKIM_LIB_set_limits(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lib->limits.signatures = DKIM_LIB_optlimit(L, 2, "signatures");
+	lib->limits.headers = DKIM_LIB_optlimit(L, 2, "headers");
+	lib->limits.hdrbytes = DKIM_LIB_optlimit(L, 2, "header_bytes");
+	lib->limits.lookups = DKIM_LIB_optlimit(L, 2, "key_lookups");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_limits() */
+
+static int DKIM_LIB_set_verify_cache(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 0);
+	lua_Number ttl = luaL_optnumber(L, 3, 300);
+	int error;
+
+	luaL_argcheck(L, size >= 0, 2, "negative cache size");
+	luaL_argcheck(L, ttl > 0, 3, "cache ttl must be positive");
+
+	if ((error = aux_vcache_open(&lib->vcache, size, ttl)))
+		return auxL_pusherror(L, error, "0$#");
+
+	if (size)
+		dkim_set_final(lib->ctx, &DKIM_on_final);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_verify_cache() */
+
+static int DKIM_LIB_getalgstats(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	_Bool reset = auxL_optboolean(L, 2, 0);
+	int alg;
+
+	lua_newtable(L);
+
+	for (alg = 0; alg < DKIM_ALGSTATS_MAX; alg++) {
+		if (!lib->algstats[alg].count)
+			continue;
+
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, lib->algstats[alg].count);
+		lua_setfield(L, -2, "count");
+		lua_pushinteger(L, lib->algstats[alg].passed);
+		lua_setfield(L, -2, "passed");
+		lua_pushinteger(L, lib->algstats[alg].failed);
+		lua_setfield(L, -2, "failed");
+		lua_pushnumber(L, lib->algstats[alg].time);
+		lua_setfield(L, -2, "time");
+		lua_rawseti(L, -2, alg);
 	}
 
+	if (reset)
+		memset(lib->algstats, 0, sizeof lib->algstats);
+
+	return 1;
+} /* DKIM_LIB_getalgstats() */
+
+static int DKIM_LIB_set_domain_stats(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 0);
+	int error;
+
+	luaL_argcheck(L, size >= 0, 2, "negative sketch size");
+
+	if ((error = aux_topk_open(&lib->domstats, size)))
+		return auxL_pusherror(L, error, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_domain_stats() */
+
+/*
+ * One comparator per order, as qsort passes them no state. Each sorts
+ * descending, with ties broken by count.
+ */
+static int DKIM_LIB_domain_stats_bycount(const void *_a, const void *_b) {
+	const struct aux_topk_slot *a = *(const struct aux_topk_slot **)_a;
+	const struct aux_topk_slot *b = *(const struct aux_topk_slot **)_b;
+
+	if (a->count != b->count)
+		return (a->count < b->count)? 1 : -1;
+
 	return 0;
-} /* DKIM_getpending() */
+} /* DKIM_LIB_domain_stats_bycount() */
 
-static int DKIM__gc(lua_State *L) {
-	DKIM_State *dkim = luaL_checkudata(L, 1, "DKIM*");
+static int DKIM_LIB_domain_stats_byfailed(const void *_a, const void *_b) {
+	const struct aux_topk_slot *a = *(const struct aux_topk_slot **)_a;
+	const struct aux_topk_slot *b = *(const struct aux_topk_slot **)_b;
 
-	if (dkim->ctx) {
-		dkim_free(dkim->ctx);
-		dkim->ctx = NULL;
+	if (a->failed != b->failed)
+		return (a->failed < b->failed)? 1 : -1;
+
+	return DKIM_LIB_domain_stats_bycount(_a, _b);
+} /* DKIM_LIB_domain_stats_byfailed() */
+
+static int DKIM_LIB_domain_stats_bylookup(const void *_a, const void *_b) {
+	const struct aux_topk_slot *a = *(const struct aux_topk_slot **)_a;
+	const struct aux_topk_slot *b = *(const struct aux_topk_slot **)_b;
+
+	if (a->lookuptime != b->lookuptime)
+		return (a->lookuptime < b->lookuptime)? 1 : -1;
+
+	return DKIM_LIB_domain_stats_bycount(_a, _b);
+} /* DKIM_LIB_domain_stats_bylookup() */
+
+/*
+ * lib:domain_stats([n][, order]) - Return the top n counters of the
+ * per-domain sketch, by count, failures or key lookup time.
+ */
+static int DKIM_LIB_domain_stats(lua_State *L) {
+	static const char *const orders[] = { "count", "failed", "lookup_time", NULL };
+	static int (*const cmps[])(const void *, const void *) = {
+		&DKIM_LIB_domain_stats_bycount,
+		&DKIM_LIB_domain_stats_byfailed,
+		&DKIM_LIB_domain_stats_bylookup,
+	};
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	struct aux_topk *tk = &lib->domstats;
+	lua_Integer n = luaL_optinteger(L, 2, tk->used);
+	int order = luaL_checkoption(L, 3, "count", orders);
+	const struct aux_topk_slot **list;
+	size_t i;
+
+	list = lua_newuserdata(L, (tk->used + 1) * sizeof *list);
+
+	for (i = 0; i < tk->used; i++)
+		list[i] = &tk->slot[i];
+
+	qsort(list, tk->used, sizeof *list, cmps[order]);
+
+	n = AUX_MAX(0, AUX_MIN(n, (lua_Integer)tk->used));
+	lua_createtable(L, n, 0);
+
+	for (i = 0; i < (size_t)n; i++) {
+		lua_createtable(L, 0, 9);
+		lua_pushstring(L, list[i]->domain);
+		lua_setfield(L, -2, "domain");
+		lua_pushstring(L, list[i]->selector);
+		lua_setfield(L, -2, "selector");
+		lua_pushinteger(L, list[i]->count);
+		lua_setfield(L, -2, "count");
+		lua_pushinteger(L, list[i]->error);
+		lua_setfield(L, -2, "error");
+		lua_pushinteger(L, list[i]->passed);
+		lua_setfield(L, -2, "passed");
+		lua_pushinteger(L, list[i]->failed);
+		lua_setfield(L, -2, "failed");
+		lua_pushinteger(L, list[i]->keybits);
+		lua_setfield(L, -2, "keybits");
+		lua_pushinteger(L, list[i]->lookups);
+		lua_setfield(L, -2, "lookups");
+		lua_pushnumber(L, list[i]->lookuptime);
+		lua_setfield(L, -2, "lookup_time");
+		lua_rawseti(L, -2, i + 1);
 	}
 
-	dkim->lib = NULL;
-	auxL_unref(L, &dkim->ref.lib);
-	auxL_unref(L, &dkim->ref.txt);
+	return 1;
+} /* DKIM_LIB_domain_stats() */
+
+static int DKIM_LIB_getverifystats(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	_Bool reset = auxL_optboolean(L, 2, 0);
+
+	lua_pushinteger(L, lib->vcache.hits);
+	lua_pushinteger(L, lib->vcache.misses);
+
+	if (reset)
+		lib->vcache.hits = lib->vcache.misses = 0;
+
+	return 2;
+} /* DKIM_LIB_getverifystats() */
+
+static _Bool DKIM_LIB_keydb_lookup(DKIM_LIB_State *lib, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz) {
+	char name[AUX_KEYDB_MAXNAME];
+	const char *txt;
+	size_t len, n;
+
+	n = snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo));
+
+	if (n >= sizeof name || !(txt = aux_keydb_find(&lib->keydb, name, &len)))
+		return 0;
+
+	if (bufsiz > 0) {
+		len = AUX_MIN(len, bufsiz - 1);
+		memcpy(buf, txt, len);
+		buf[len] = '\0';
+	}
+
+	return 1;
+} /* DKIM_LIB_keydb_lookup() */
+
+/* hot means verifiably among the most frequent pairs in the sketch */
+static _Bool DKIM_kcache_hot(DKIM_State *dkim, DKIM_SIGINFO *siginfo) {
+	struct aux_topk *tk = &dkim->lib->krefresh.hot;
+	struct aux_topk_slot *slot;
+
+	if (!(slot = aux_topk_hit(tk, (char *)dkim_sig_getdomain(siginfo), (char *)dkim_sig_getselector(siginfo))))
+		return 0;
+
+	return slot->count - slot->error >= tk->slot[tk->heap[0]].count;
+} /* DKIM_kcache_hot() */
+
+/*
+ * Serve a record from the key cache. An expired record is still served
+ * within the grace period, and a hot one is served as usual near the end
+ * of its TTL, but either way a refresh through the key_lookup callback is
+ * queued on the handle unless another handle already holds one.
+ */
+static _Bool DKIM_kcache_lookup(DKIM_State *dkim, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz) {
+	DKIM_LIB_State *lib = dkim->lib;
+	char name[AUX_KEYDB_MAXNAME];
+	struct aux_kentry *ent;
+	_Bool hot;
+	double now;
+	size_t len, n;
 
-	return 0;
-} /* DKIM__gc() */
+	n = snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo));
 
-static luaL_Reg DKIM_methods[] = {
-	/* administration methods */
-	{ "geterror", DKIM_geterror },
-	{ "getmode", DKIM_getmode },
-	{ "get_signer", DKIM_get_signer },
+	if (n >= sizeof name || !(ent = aux_kcache_lookup(&lib->kcache, name)))
+		return 0;
 
-	/* signing methods */
-	{ "add_querymethod", DKIM_add_querymethod },
-	{ "add_xtag", DKIM_add_xtag },
-	{ "getpartial", DKIM_getpartial },
-	{ "getsighdr", DKIM_getsighdr },
-	{ "privkey_load", DKIM_privkey_load },
-	{ "set_margin", DKIM_set_margin },
-	{ "set_signer", DKIM_set_signer },
-	{ "setpartial", DKIM_setpartial },
-	{ "signhdrs", DKIM_signhdrs },
+	now = aux_walltime();
 
-	/* verification methods */
-#if 0 /* does not support asynchronous DNS */
-	{ "atps_check", DKIM_atps_check },
-#endif
-#if 0 /* not necessary */
-	{ "diffheaders", DKIM_diffheaders },
-#endif
-#if 0 /* experimental; documented but not actually implemented in OpenDKIM */
-	{ "get_reputation", DKIM_dkim_get_reputation },
-#endif
-	{ "getsiglist", DKIM_getsiglist },
-	{ "getsignature", DKIM_getsignature },
-	{ "getsslbuf", DKIM_getsslbuf },
-	{ "getuser", DKIM_getuser },
-	{ "minbody", DKIM_minbody },
-	{ "ohdrs", DKIM_ohdrs },
-	{ "sig_getcanonlen", DKIM_sig_getcanonlen },
-	{ "sig_getidentity", DKIM_sig_getidentity },
-	{ "sig_getqueries", DKIM_sig_getqueries },
-	{ "sig_getreportinfo", DKIM_sig_getreportinfo },
-	{ "sig_process", DKIM_sig_process },
+	if (ent->expires + lib->krefresh.grace <= now)
+		return 0;
 
-	/* processing methods */
-	{ "header", DKIM_header },
-	{ "eoh", DKIM_eoh },
-	{ "body", DKIM_body },
-	{ "eom", DKIM_eom },
-	{ "chunk", DKIM_chunk },
+	hot = DKIM_kcache_hot(dkim, siginfo);
 
-	/* utility methods */
-	{ "getid", DKIM_getid },
-#if 0 /* not implemented (documentation out of date) */
-	{ "get_msgdate", DKIM_get_msgdate },
-#endif
-	{ "get_sigsubstring", DKIM_get_sigsubstring },
-	{ "key_syntax", DKIM_key_syntax },
+	if ((ent->expires <= now || (hot && ent->expires - lib->krefresh.ahead <= now))
+	&&  (!ent->refresh || ent->refresh + (DKIM_REFRESH_TIMEOUT << AUX_MIN(ent->failures, DKIM_REFRESH_BACKOFF)) <= now)
+	&&  dkim->refresh.count < DKIM_REFRESH_MAX
+	&&  lib->key_lookup != LUA_NOREF) {
+		dkim->refresh.siginfo[dkim->refresh.count++] = siginfo;
+		ent->refresh = now;
+	}
 
-	/* module auxiliary routines */
-	{ "getpending", DKIM_getpending },
-	{ NULL, NULL },
-}; /* DKIM_methods[] */
+	if (bufsiz > 0) {
+		len = strnlen(ent->txt, bufsiz - 1);
+		memcpy(buf, ent->txt, len);
+		buf[len] = '\0';
+	}
 
-static luaL_Reg DKIM_metamethods[] = {
-	{ "__gc", &DKIM__gc },
-	{ NULL,   NULL },
-}; /* DKIM_metamethods[] */
+	return 1;
+} /* DKIM_kcache_lookup() */
 
+static void DKIM_LIB_kcache_store(DKIM_LIB_State *lib, const char *name, const char *txt, double ttl) {
+	aux_kcache_store(&lib->kcache, name, txt, strlen(txt), aux_walltime() + ((ttl > 0)? ttl : lib->kcache.ttl));
+} /* DKIM_LIB_kcache_store() */
 
 /*
- * (DKIM_LIB *) B I N D I N G S
- *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ * Single-flight key lookups. The first handle to need a name issues the
+ * key_lookup callback, and others needing the same name meanwhile park
+ * in the lib:set_key_coalesce wait callback until the answer is posted
+ * (see DKIM_resolve). A handle whose wait returned with no answer while
+ * the same handle still leads, as when the wait timed out, takes the
+ * lookup over. waited says the wait callback has returned. Returns true
+ * with *stat set if the lookup was settled or parked, false if this
+ * handle should issue it.
+ */
+static _Bool DKIM_coalesce(DKIM_State *dkim, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz, _Bool waited, DKIM_CBSTAT *stat) {
+	DKIM_LIB_State *lib = dkim->lib;
+	char name[AUX_KEYDB_MAXNAME];
+	struct DKIM_flight *fl;
 
-static DKIM_LIB_State *DKIM_LIB_checkself(lua_State *L, int index) {
-	DKIM_LIB_State *lib = luaL_checkudata(L, index, "DKIM_LIB*");
+	if (!DKIM_keyname(name, siginfo))
+		return 0;
 
-	luaL_argcheck(L, lib->ctx, index, "attempt to use a closed DKIM_LIB handle");
+	if (!(fl = DKIM_LIB_flight(lib, name))) {
+		/* on failure just look it up without coalescing */
+		if (!(fl = calloc(1, sizeof *fl)))
+			return 0;
 
-	return lib;
-} /* DKIM_LIB_checkself() */
+		memcpy(fl->name, name, sizeof fl->name);
+		fl->lead = dkim;
+		fl->next = lib->coalesce.flights;
+		lib->coalesce.flights = fl;
 
-static DKIM_LIB_State *DKIM_LIB_prep(lua_State *L) {
-	DKIM_LIB_State *lib;
+		return 0;
+	}
 
-	lib = lua_newuserdata(L, sizeof *lib);
-	*lib = DKIM_LIB_initializer;
-	luaL_setmetatable(L, "DKIM_LIB*");
+	if (fl->done) {
+		if (bufsiz > 0) {
+			const char *txt = (fl->txt)? fl->txt : "";
+			size_t len = strnlen(txt, bufsiz - 1);
 
-	return lib;
-} /* DKIM_LIB_prep() */
+			memcpy(buf, txt, len);
+			buf[len] = '\0';
+		}
 
-static int DKIM_LIB_flush_cache(lua_State *L) {
-	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
-	int n;
-	
-	if ((n = dkim_flush_cache(lib->ctx)) >= 0) {
-		lua_pushinteger(L, n);
-	} else {
-		lua_pushnil(L);
-	}
+		*stat = fl->stat;
 
-	return 1;
-} /* DKIM_LIB_flush_cache() */
+		if (dkim->parked == fl) {
+			fl->waiters--;
+			dkim->parked = NULL;
+		}
 
-static int DKIM_LIB_getcachestats(lua_State *L) {
-	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
-	_Bool reset = auxL_optboolean(L, 2, 0);
-	unsigned int queries, hits, expired, keys;
-	DKIM_STAT stat;
+		DKIM_LIB_flight_release(lib, fl);
 
-	if (DKIM_STAT_OK != (stat = dkim_getcachestats(lib->ctx, &queries, &hits, &expired, &keys, reset)))
-		return auxL_pushstat(L, stat, "~$#");
+		return 1;
+	}
 
-	lua_pushinteger(L, queries);
-	lua_pushinteger(L, hits);
-	lua_pushinteger(L, expired);
-	lua_pushinteger(L, keys);
+	/* abandoned by its handle, or stuck, so take it over */
+	if (!fl->lead || fl->lead == dkim || (waited && dkim->parked == fl && dkim->parkgen == fl->gen)) {
+		if (dkim->parked == fl) {
+			fl->waiters--;
+			dkim->parked = NULL;
+		}
 
-	return 4;
-} /* DKIM_LIB_getcachestats() */
+		if (fl->lead != dkim) {
+			fl->lead = dkim;
+			fl->gen++;
+		}
 
-static int DKIM_LIB_libfeature(lua_State *L) {
-	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+		return 0;
+	}
 
-	lua_pushboolean(L, dkim_libfeature(lib->ctx, luaL_checkinteger(L, 2)));
+	if (dkim->parked != fl) {
+		fl->waiters++;
+		dkim->parked = fl;
+	}
+
+	dkim->parkgen = fl->gen;
+
+	dkim->cb.exec |= DKIM_CB_PARK;
+	*stat = DKIM_CBSTAT_TRYAGAIN;
 
 	return 1;
-} /* DKIM_LIB_libfeature() */
+} /* DKIM_coalesce() */
 
-static DKIM_CBSTAT DKIM_on_final(DKIM *_dkim, DKIM_SIGINFO **siglist, int sigcount) {
-	DKIM_State *dkim;
+static DKIM_CBSTAT DKIM_on_key_lookup_(DKIM_State *dkim, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz) {
+	_Bool waited = !!(dkim->cb.done & DKIM_CB_PARK);
 	DKIM_CBSTAT stat;
-	
-	if (!(dkim = dkim_get_user_context(_dkim)))
-		return DKIM_CBSTAT_ERROR;
 
-	if (!(dkim->cb.exec & DKIM_CB_FINAL))
-		goto tryagain;
-	if (!(dkim->cb.done & DKIM_CB_FINAL))
-		goto tryagain;
-	if (dkim->cb.final.siglist != siglist)
-		goto tryagain;
+	dkim->cb.exec &= ~DKIM_CB_PARK;
+	dkim->cb.done &= ~DKIM_CB_PARK;
 
-	stat = dkim->cb.final.stat;
+	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP) && dkim->prefetch.count > 0) {
+		char name[AUX_KEYDB_MAXNAME];
+		const char *txt;
 
-	dkim->cb.final = DKIM_initializer.cb.final;
-	dkim->cb.exec &= ~DKIM_CB_FINAL;
-	dkim->cb.done &= ~DKIM_CB_FINAL;
+		if ((size_t)snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo)) < sizeof name
+		&&  (txt = DKIM_prefetch_find(dkim, name))) {
+			if (bufsiz > 0) {
+				size_t len = strnlen(txt, bufsiz - 1);
 
-	return stat;
-tryagain:
-	dkim->cb.final = DKIM_initializer.cb.final;
-	dkim->cb.final.siglist = siglist;
-	dkim->cb.final.sigcount = sigcount;
+				memcpy(buf, txt, len);
+				buf[len] = '\0';
+			}
 
-	dkim->cb.exec |= DKIM_CB_FINAL;
+			return DKIM_CBSTAT_CONTINUE;
+		}
+	}
 
-	return DKIM_CBSTAT_TRYAGAIN;
-} /* DKIM_on_final() */
+	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP) && (dkim->lib->keydb.map || dkim->lib->kcache.size)) {
+		if (dkim->lib->keydb.map && DKIM_LIB_keydb_lookup(dkim->lib, siginfo, buf, bufsiz))
+			return DKIM_CBSTAT_CONTINUE;
 
-static int DKIM_LIB_set_final(lua_State *L) {
-	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+		if (dkim->lib->kcache.size && DKIM_kcache_lookup(dkim, siginfo, buf, bufsiz))
+			return DKIM_CBSTAT_CONTINUE;
+	}
 
-	luaL_checktype(L, 2, LUA_TFUNCTION);
-	auxL_getref(L, lib->final); /* load previous callback */
-	auxL_ref(L, 2, &lib->final); /* anchor new callback */
-	dkim_set_final(lib->ctx, &DKIM_on_final);
+	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP) && dkim->lib->native.key_lookup.f) {
+		stat = dkim->lib->native.key_lookup.f(dkim->lib->native.key_lookup.arg, dkim->ctx, siginfo, buf, bufsiz);
 
-	return 1; /* return previous callback */
-} /* DKIM_LIB_set_final() */
+		if (stat != DKIM_CBSTAT_DEFAULT)
+			return stat;
+	}
 
-static DKIM_CBSTAT DKIM_on_key_lookup(DKIM *_dkim, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz) {
-	DKIM_State *dkim;
-	DKIM_CBSTAT stat;
-	
-	if (!(dkim = dkim_get_user_context(_dkim)))
-		return DKIM_CBSTAT_ERROR;
+	/* installed only for the key database or a C module */
+	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP) && dkim->lib->key_lookup == LUA_NOREF)
+		return DKIM_CBSTAT_NOTFOUND;
+
+	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP) && dkim->lib->coalesce.wait != LUA_NOREF && DKIM_coalesce(dkim, siginfo, buf, bufsiz, waited, &stat))
+		return stat;
 
 	if (!(dkim->cb.exec & DKIM_CB_KEY_LOOKUP))
 		goto tryagain;
@@ -1689,6 +6557,13 @@ static DKIM_CBSTAT DKIM_on_key_lookup(DKIM *_dkim, DKIM_SIGINFO *siginfo, unsign
 
 	stat = dkim->cb.key_lookup.stat;
 
+	if (stat == DKIM_CBSTAT_CONTINUE && dkim->cb.key_lookup.txt && dkim->lib->kcache.size) {
+		char name[AUX_KEYDB_MAXNAME];
+
+		if ((size_t)snprintf(name, sizeof name, "%s._domainkey.%s", (char *)dkim_sig_getselector(siginfo), (char *)dkim_sig_getdomain(siginfo)) < sizeof name)
+			DKIM_LIB_kcache_store(dkim->lib, name, dkim->cb.key_lookup.txt, dkim->cb.key_lookup.ttl);
+	}
+
 	dkim->cb.key_lookup = DKIM_initializer.cb.key_lookup;
 	dkim->cb.exec &= ~DKIM_CB_KEY_LOOKUP;
 	dkim->cb.done &= ~DKIM_CB_KEY_LOOKUP;
@@ -1698,21 +6573,214 @@ tryagain:
 	dkim->cb.key_lookup = DKIM_initializer.cb.key_lookup;
 	dkim->cb.key_lookup.siginfo = siginfo;
 
-	dkim->cb.exec |= DKIM_CB_KEY_LOOKUP;
+	dkim->cb.exec |= DKIM_CB_KEY_LOOKUP;
+
+	return DKIM_CBSTAT_TRYAGAIN;
+} /* DKIM_on_key_lookup_() */
+
+static DKIM_CBSTAT DKIM_on_key_lookup(DKIM *_dkim, DKIM_SIGINFO *siginfo, unsigned char *buf, size_t bufsiz) {
+	DKIM_State *dkim;
+	struct DKIM_sigstate *sig;
+	DKIM_CBSTAT stat;
+
+	if (!(dkim = dkim_get_user_context(_dkim)))
+		return DKIM_CBSTAT_ERROR;
+
+	stat = DKIM_on_key_lookup_(dkim, siginfo, buf, bufsiz);
+
+	if (!dkim->lib->vcache.size && !dkim->lib->domstats.size)
+		return stat;
+
+	if (!(sig = DKIM_sigstate(dkim, siginfo, 1)))
+		return stat;
+
+	/* time from first deferral to the answer, see DKIM_domstats */
+	if (stat == DKIM_CBSTAT_TRYAGAIN) {
+		if (!sig->begin)
+			sig->begin = aux_monotime();
+	} else if (!sig->looked) {
+		if (sig->begin)
+			sig->lookup += aux_monotime() - sig->begin;
+
+		sig->looked = 1;
+	}
+
+	/* remember which record verified the signature, see DKIM_vcache_store */
+	if (stat == DKIM_CBSTAT_CONTINUE && bufsiz > 0)
+		sig->keyhash = aux_fnv1a(AUX_FNV1A_INIT, buf, strlen((char *)buf));
+
+	return stat;
+} /* DKIM_on_key_lookup() */
+
+/*
+ * libopendkim only queries DNS itself while no key_lookup hook is set, so
+ * ours is installed only while something needs it.
+ */
+static void DKIM_LIB_hook_key_lookup(DKIM_LIB_State *lib) {
+	if (lib->keydb.map || lib->key_lookup != LUA_NOREF || lib->native.key_lookup.f)
+		dkim_set_key_lookup(lib->ctx, &DKIM_on_key_lookup);
+	else
+		dkim_set_key_lookup(lib->ctx, NULL);
+} /* DKIM_LIB_hook_key_lookup() */
+
+static int DKIM_LIB_set_key_db(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	const char *path = luaL_optstring(L, 2, NULL);
+	struct aux_keydb keydb = { NULL, 0 };
+	int error;
+
+	if (path && (error = aux_keydb_open(&keydb, path)))
+		return auxL_pusherror(L, error, "0$#");
+
+	/* lookups copy out of the map, so nothing references the old one */
+	aux_keydb_close(&lib->keydb);
+	lib->keydb = keydb;
+
+	DKIM_LIB_hook_key_lookup(lib);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_key_db() */
+
+static int DKIM_LIB_set_key_prefetch(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	auxL_getref(L, lib->prefetch); /* load previous callback */
+
+	if (lua_isnoneornil(L, 2)) {
+		auxL_unref(L, &lib->prefetch);
+	} else {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		auxL_ref(L, 2, &lib->prefetch); /* anchor new callback */
+	}
+
+	return 1; /* return previous callback */
+} /* DKIM_LIB_set_key_prefetch() */
+
+static int DKIM_LIB_set_key_lookup(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	auxL_getref(L, lib->key_lookup); /* load previous callback */
+	auxL_ref(L, 2, &lib->key_lookup); /* anchor new callback */
+	DKIM_LIB_hook_key_lookup(lib);
+
+	return 1; /* return previous callback */
+} /* DKIM_LIB_set_key_lookup() */
+
+static int DKIM_LIB_set_key_coalesce(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+
+	lua_settop(L, 3);
+	auxL_getref(L, lib->coalesce.wait); /* load previous callback */
+
+	if (lua_isnil(L, 2)) {
+		auxL_unref(L, &lib->coalesce.wait);
+		auxL_unref(L, &lib->coalesce.wake);
+	} else {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		auxL_ref(L, 2, &lib->coalesce.wait); /* anchor new callbacks */
+
+		if (lua_isnil(L, 3)) {
+			auxL_unref(L, &lib->coalesce.wake);
+		} else {
+			luaL_checktype(L, 3, LUA_TFUNCTION);
+			auxL_ref(L, 3, &lib->coalesce.wake);
+		}
+	}
+
+	return 1; /* return previous callback */
+} /* DKIM_LIB_set_key_coalesce() */
+
+static int DKIM_LIB_set_key_cache(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 0);
+	lua_Number ttl = luaL_optnumber(L, 3, 3600);
+	const char *path = luaL_optstring(L, 4, NULL);
+	char *copy = NULL;
+	int error;
+
+	luaL_argcheck(L, size >= 0, 2, "negative cache size");
+	luaL_argcheck(L, ttl > 0, 3, "cache ttl must be positive");
+
+	if (path && !(copy = strdup(path)))
+		return auxL_pusherror(L, errno, "0$#");
+
+	if ((error = aux_kcache_open(&lib->kcache, size, ttl))) {
+		free(copy);
+
+		return auxL_pusherror(L, error, "0$#");
+	}
+
+	free(lib->kcachepath);
+	lib->kcachepath = copy;
+
+	/* a missing snapshot just means a cold start */
+	if (size && path && (error = aux_kcache_load(&lib->kcache, path, aux_walltime())) && error != ENOENT)
+		return auxL_pusherror(L, error, "0$#");
+
+	/* the cache fronts the key_lookup closure, and isn't needed without it */
+	DKIM_LIB_hook_key_lookup(lib);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_key_cache() */
+
+static int DKIM_LIB_save_key_cache(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	const char *path = luaL_optstring(L, 2, lib->kcachepath);
+	int error;
+
+	if (!path)
+		return luaL_argerror(L, 2, "no key cache snapshot path");
+
+	if ((error = aux_kcache_save(&lib->kcache, path, aux_walltime())))
+		return auxL_pusherror(L, error, "0$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_save_key_cache() */
+
+static int DKIM_LIB_load_key_cache(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	const char *path = luaL_optstring(L, 2, lib->kcachepath);
+	int error;
+
+	if (!path)
+		return luaL_argerror(L, 2, "no key cache snapshot path");
 
-	return DKIM_CBSTAT_TRYAGAIN;
-} /* DKIM_on_key_lookup() */
+	if ((error = aux_kcache_load(&lib->kcache, path, aux_walltime())))
+		return auxL_pusherror(L, error, "0$#");
 
-static int DKIM_LIB_set_key_lookup(lua_State *L) {
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_load_key_cache() */
+
+static int DKIM_LIB_set_key_refresh(lua_State *L) {
 	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	lua_Number grace = luaL_optnumber(L, 2, 0);
+	lua_Number ahead = luaL_optnumber(L, 3, 0);
+	lua_Integer hot = luaL_optinteger(L, 4, 64);
+	int error;
 
-	luaL_checktype(L, 2, LUA_TFUNCTION);
-	auxL_getref(L, lib->key_lookup); /* load previous callback */
-	auxL_ref(L, 2, &lib->key_lookup); /* anchor new callback */
-	dkim_set_key_lookup(lib->ctx, &DKIM_on_key_lookup);
+	luaL_argcheck(L, grace >= 0, 2, "negative grace period");
+	luaL_argcheck(L, ahead >= 0, 3, "negative refresh period");
+	luaL_argcheck(L, hot >= 0, 4, "negative hot key count");
 
-	return 1; /* return previous callback */
-} /* DKIM_LIB_set_key_lookup() */
+	if ((error = aux_topk_open(&lib->krefresh.hot, (ahead > 0)? hot : 0)))
+		return auxL_pusherror(L, error, "0$#");
+
+	lib->krefresh.grace = grace;
+	lib->krefresh.ahead = ahead;
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* DKIM_LIB_set_key_refresh() */
 
 static DKIM_CBSTAT DKIM_on_prescreen(DKIM *_dkim, DKIM_SIGINFO **siglist, int sigcount) {
 	DKIM_State *dkim;
@@ -1721,6 +6789,19 @@ static DKIM_CBSTAT DKIM_on_prescreen(DKIM *_dkim, DKIM_SIGINFO **siglist, int si
 	if (!(dkim = dkim_get_user_context(_dkim)))
 		return DKIM_CBSTAT_ERROR;
 
+	if (!(dkim->cb.exec & DKIM_CB_PRESCREEN)) {
+		if (dkim->lib->native.prescreen.f) {
+			stat = dkim->lib->native.prescreen.f(dkim->lib->native.prescreen.arg, _dkim, siglist, sigcount);
+
+			if (stat != DKIM_CBSTAT_DEFAULT)
+				return stat;
+		}
+
+		/* installed only for a C module */
+		if (dkim->lib->prescreen == LUA_NOREF)
+			return DKIM_CBSTAT_CONTINUE;
+	}
+
 	if (!(dkim->cb.exec & DKIM_CB_PRESCREEN))
 		goto tryagain;
 	if (!(dkim->cb.done & DKIM_CB_PRESCREEN))
@@ -1745,6 +6826,14 @@ tryagain:
 	return DKIM_CBSTAT_TRYAGAIN;
 } /* DKIM_on_prescreen() */
 
+/* see DKIM_LIB_hook_key_lookup */
+static void DKIM_LIB_hook_prescreen(DKIM_LIB_State *lib) {
+	if (lib->prescreen != LUA_NOREF || lib->native.prescreen.f)
+		dkim_set_prescreen(lib->ctx, &DKIM_on_prescreen);
+	else
+		dkim_set_prescreen(lib->ctx, NULL);
+} /* DKIM_LIB_hook_prescreen() */
+
 static int DKIM_LIB_set_prescreen(lua_State *L) {
 	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
 
@@ -1753,34 +6842,109 @@ static int DKIM_LIB_set_prescreen(lua_State *L) {
 	auxL_getref(L, lib->prescreen); /* load previous callback */
 	auxL_ref(L, 2, &lib->prescreen); /* anchor new callback */
 
-	dkim_set_prescreen(lib->ctx, &DKIM_on_prescreen);
+	DKIM_LIB_hook_prescreen(lib);
 
 	return 1; /* return previous callback */
 } /* DKIM_LIB_set_prescreen() */
 
+/*
+ * Default signing algorithm for a key. Ed25519 keys are at most a couple
+ * hundred bytes in any encoding, so longer keys are taken to be RSA
+ * without parsing them.
+ */
+static dkim_alg_t DKIM_LIB_keyalg(const char *key, size_t len) {
+#if HAVE_OPENSSL && defined EVP_PKEY_ED25519 && defined DKIM_SIGN_ED25519SHA256
+	EVP_PKEY *pkey;
+	int type;
+
+	if (len > 256 || !(pkey = aux_loadkey(key, len)))
+		return DKIM_SIGN_RSASHA256;
+
+	type = EVP_PKEY_id(pkey);
+	EVP_PKEY_free(pkey);
+
+	if (type == EVP_PKEY_ED25519)
+		return DKIM_SIGN_ED25519SHA256;
+#else
+	(void)key; (void)len;
+#endif
+	return DKIM_SIGN_RSASHA256;
+} /* DKIM_LIB_keyalg() */
+
 static int DKIM_LIB_sign(lua_State *L) {
 	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
 	const unsigned char *id = (void *)luaL_checkstring(L, 2);
-	const dkim_sigkey_t secretkey = (void *)luaL_checkstring(L, 3);
-	const unsigned char *selector = (void *)luaL_checkstring(L, 4);
+	dkim_sigkey_t secretkey;
+	const unsigned char *selector;
 	const unsigned char *domain = (void *)luaL_checkstring(L, 5);
 	dkim_canon_t hdrcanon_alg = luaL_optinteger(L, 6, DKIM_CANON_SIMPLE);
 	dkim_canon_t bodycanon_alg = luaL_optinteger(L, 7, DKIM_CANON_SIMPLE);
 	dkim_alg_t sign_alg = luaL_optinteger(L, 8, DKIM_SIGN_RSASHA256);
+	size_t keylen;
 	ssize_t length = luaL_optinteger(L, 9, -1);
 	DKIM_State *dkim;
 	DKIM_STAT stat;
+	int key = 3;
+
+	lua_settop(L, 9);
+
+	if (lua_isnil(L, 3)) {
+		/* take key, and selector if unspecified, from the keystore */
+		auxL_getref(L, lib->keystore);
+		luaL_argcheck(L, !lua_isnil(L, -1), 3, "no key given and no keystore");
+
+		if (!DKIM_KEYSTORE_lookup(L, DKIM_KEYSTORE_checkself(L, -1), (void *)domain, luaL_optstring(L, 4, NULL)))
+			return auxL_pushstat(L, DKIM_STAT_NOKEY, "~$#");
+
+		secretkey = (void *)lua_tolstring(L, -2, &keylen);
+		selector = (void *)lua_tostring(L, -1);
+		key = lua_gettop(L) - 1;
+	} else {
+		secretkey = (void *)luaL_checklstring(L, 3, &keylen);
+		selector = (void *)luaL_checkstring(L, 4);
+	}
+
+	if (lua_isnil(L, 8))
+		sign_alg = DKIM_LIB_keyalg((void *)secretkey, keylen);
 
 	dkim = DKIM_prep(L, 1);
 
-	if (!(dkim->ctx = dkim_sign(lib->ctx, id, NULL, secretkey, selector, domain, hdrcanon_alg, bodycanon_alg, sign_alg, length, &stat)))
+	if (!(dkim->ctx = dkim_sign(lib->ctx, id, &dkim->arena, secretkey, selector, domain, hdrcanon_alg, bodycanon_alg, sign_alg, length, &stat)))
 		return auxL_pushstat(L, stat, "~$#");
 
 	dkim_set_user_context(dkim->ctx, dkim);
+	auxL_ref(L, key, &dkim->ref.key);
+	dkim->signalg = sign_alg;
 
 	return 1;
 } /* DKIM_LIB_sign() */
 
+static int DKIM_LIB_keystore(lua_State *L) {
+	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
+	double interval = luaL_optnumber(L, 3, 5.0);
+	DKIM_KEYSTORE_State *ks;
+	int error;
+
+	luaL_checkstring(L, 2);
+
+	ks = lua_newuserdata(L, sizeof *ks);
+	*ks = DKIM_KEYSTORE_initializer;
+	luaL_setmetatable(L, "DKIM_KEYSTORE*");
+
+	auxL_ref(L, 2, &ks->dir);
+	ks->interval = interval;
+#if HAVE_INOTIFY
+	ks->inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC); /* fall back to polling on failure */
+#endif
+
+	if ((error = DKIM_KEYSTORE_reload_(L, ks)))
+		return auxL_pusherror(L, error, "~$#");
+
+	auxL_ref(L, -1, &lib->keystore);
+
+	return 1;
+} /* DKIM_LIB_keystore() */
+
 static int DKIM_LIB_verify(lua_State *L) {
 	DKIM_LIB_State *lib = DKIM_LIB_checkself(L, 1);
 	const unsigned char *id = (void *)luaL_checkstring(L, 2);
@@ -1789,7 +6953,7 @@ static int DKIM_LIB_verify(lua_State *L) {
 
 	dkim = DKIM_prep(L, 1);
 
-	if (!(dkim->ctx = dkim_verify(lib->ctx, id, NULL, &stat)))
+	if (!(dkim->ctx = dkim_verify(lib->ctx, id, &dkim->arena, &stat)))
 		return auxL_pushstat(L, stat, "~$#");
 
 	dkim_set_user_context(dkim->ctx, dkim);
@@ -2019,15 +7183,32 @@ static int DKIM_LIB_on_dns_waitreply(void *_lib, void *qry, struct timeval *time
 	int status;
 	const char *p;
 	size_t n;
+	double budget;
 
 	(void)qry;
 	*replylen = 0;
 	*error = 0;
 	*dnssec = 0;
 
+	budget = (timeout)? timeout->tv_sec + (timeout->tv_usec / 1000000.0) : -1;
+
+	if (lib->dns.deadline > 0) {
+		double remaining = lib->dns.deadline - aux_monotime();
+
+		if (remaining <= 0)
+			return DKIM_DNS_EXPIRED;
+
+		budget = (budget < 0)? remaining : AUX_MIN(budget, remaining);
+	}
+
 	lua_settop(L, 0);
 	auxL_getref(L, lib->dns.waitreply);
-	lua_pushnumber(L, timeout->tv_sec + (timeout->tv_usec / 1000000.0));
+
+	if (budget < 0) {
+		lua_pushnil(L);
+	} else {
+		lua_pushnumber(L, budget);
+	}
 
 	if (LUA_OK != (status = lua_pcall(L, 1, 3, 0)))
 		return DKIM_DNS_ERROR;
@@ -2113,6 +7294,7 @@ static int DKIM_LIB_dns_set_cancel(lua_State *L) {
 
 static int DKIM_LIB__gc(lua_State *L) {
 	DKIM_LIB_State *lib = luaL_checkudata(L, 1, "DKIM_LIB*");
+	struct DKIM_flight *fl;
 
 	if (lib->ctx) {
 		dkim_close(lib->ctx);
@@ -2122,6 +7304,16 @@ static int DKIM_LIB__gc(lua_State *L) {
 	auxL_unref(L, &lib->final);
 	auxL_unref(L, &lib->key_lookup);
 	auxL_unref(L, &lib->prescreen);
+	auxL_unref(L, &lib->keystore);
+	auxL_unref(L, &lib->prefetch);
+	auxL_unref(L, &lib->coalesce.wait);
+	auxL_unref(L, &lib->coalesce.wake);
+
+	while ((fl = lib->coalesce.flights)) {
+		lib->coalesce.flights = fl->next;
+		free(fl->txt);
+		free(fl);
+	}
 
 	auxL_unref(L, &lib->dns.thread);
 	auxL_unref(L, &lib->dns.start);
@@ -2129,18 +7321,46 @@ static int DKIM_LIB__gc(lua_State *L) {
 	auxL_unref(L, &lib->dns.waitreply);
 	auxL_unref(L, &lib->dns.trustanchor);
 
+	if (lib->kcachepath && lib->kcache.size)
+		aux_kcache_save(&lib->kcache, lib->kcachepath, aux_walltime());
+
+	free(lib->kcachepath);
+	lib->kcachepath = NULL;
+
+	aux_keydb_close(&lib->keydb);
+	aux_kcache_close(&lib->kcache);
+	aux_topk_close(&lib->krefresh.hot);
+	aux_vcache_close(&lib->vcache);
+	aux_topk_close(&lib->domstats);
+	DKIM_LIB_early_reset(lib);
+
 	return 0;
 } /* DKIM_LIB__gc() */
 
 static luaL_Reg DKIM_LIB_methods[] = {
 	{ "flush_cache",    DKIM_LIB_flush_cache },
 	{ "getcachestats",  DKIM_LIB_getcachestats },
+	{ "getverifystats", DKIM_LIB_getverifystats },
+	{ "getalgstats",    DKIM_LIB_getalgstats },
 	{ "libfeature",     DKIM_LIB_libfeature },
 	{ "set_final",      DKIM_LIB_set_final },
 	{ "set_key_lookup", DKIM_LIB_set_key_lookup },
+	{ "set_key_db",     DKIM_LIB_set_key_db },
+	{ "set_key_prefetch", DKIM_LIB_set_key_prefetch },
+	{ "set_key_cache",  DKIM_LIB_set_key_cache },
+	{ "save_key_cache", DKIM_LIB_save_key_cache },
+	{ "load_key_cache", DKIM_LIB_load_key_cache },
+	{ "set_key_refresh", DKIM_LIB_set_key_refresh },
+	{ "set_key_coalesce", DKIM_LIB_set_key_coalesce },
 	{ "set_prescreen",  DKIM_LIB_set_prescreen },
+	{ "set_verify_cache", DKIM_LIB_set_verify_cache },
+	{ "set_early_exit", DKIM_LIB_set_early_exit },
+	{ "set_limits", DKIM_LIB_set_limits },
+	{ "set_domain_stats", DKIM_LIB_set_domain_stats },
+	{ "domain_stats",   DKIM_LIB_domain_stats },
 	{ "sign",           DKIM_LIB_sign },
 	{ "verify",         DKIM_LIB_verify },
+	{ "keystore",       DKIM_LIB_keystore },
 	{ "options",        DKIM_LIB_options },
 	{ "dns_set_start",  DKIM_LIB_dns_set_start },
 	{ "dns_set_waitreply", DKIM_LIB_dns_set_waitreply },
@@ -2166,7 +7386,7 @@ static int opendkim_init(lua_State *L) {
 
 	lib = DKIM_LIB_prep(L);
 
-	if (!(lib->ctx = dkim_init(NULL, NULL)))
+	if (!(lib->ctx = dkim_init(&aux_arena_mallocf, &aux_arena_freef)))
 		return auxL_pusherror(L, ENOMEM, "~$#");
 
 	return 1;
@@ -2184,14 +7404,107 @@ static int opendkim_ssl_version(lua_State *L) {
 	return 1;
 } /* opendkim_ssl_version() */
 
+#if HAVE_OPENSSL
+/*
+ * opendkim.genkey([type][, bits]) - Generate a signing key, returning the
+ * private key in PEM form for lib:sign and the TXT record to publish.
+ * Meant for tests and benchmarks; use opendkim-genkey in production.
+ */
+static int opendkim_genkey(lua_State *L) {
+	static const char *const types[] = { "rsa", "ed25519", NULL };
+	int type = luaL_checkoption(L, 1, "rsa", types);
+	int bits = luaL_optinteger(L, 2, 2048);
+	EVP_PKEY_CTX *pctx = NULL;
+	EVP_PKEY *pkey = NULL;
+	unsigned char *pub = NULL, *p;
+	char *b64 = NULL, *pem;
+	int publen;
+	long pemlen;
+	BIO *bio = NULL;
+	int nret = 0;
+
+	if (type == 0) {
+		if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL)))
+			goto sslerr;
+		if (1 != EVP_PKEY_keygen_init(pctx))
+			goto sslerr;
+		if (1 != EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, bits))
+			goto sslerr;
+	} else {
+#if defined EVP_PKEY_ED25519
+		if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL)))
+			goto sslerr;
+		if (1 != EVP_PKEY_keygen_init(pctx))
+			goto sslerr;
+#else
+		return auxL_pusherror(L, ENOSYS, "~$#");
+#endif
+	}
+
+	if (1 != EVP_PKEY_keygen(pctx, &pkey))
+		goto sslerr;
+
+	if (!(bio = BIO_new(BIO_s_mem())) || !PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL))
+		goto sslerr;
+
+	pemlen = BIO_get_mem_data(bio, &pem);
+	lua_pushlstring(L, pem, pemlen);
+
+	/* k=rsa publishes SubjectPublicKeyInfo, k=ed25519 the raw key */
+	if (type == 0) {
+		if ((publen = i2d_PUBKEY(pkey, NULL)) <= 0 || !(pub = malloc(publen)))
+			goto sslerr;
+
+		p = pub;
+		i2d_PUBKEY(pkey, &p);
+	} else {
+#if defined EVP_PKEY_ED25519
+		size_t rawlen = 0;
+
+		if (1 != EVP_PKEY_get_raw_public_key(pkey, NULL, &rawlen) || !(pub = malloc(rawlen)))
+			goto sslerr;
+		if (1 != EVP_PKEY_get_raw_public_key(pkey, pub, &rawlen))
+			goto sslerr;
+
+		publen = rawlen;
+#endif
+	}
+
+	if (!(b64 = malloc(((publen + 2) / 3) * 4 + 1)))
+		goto sslerr;
+
+	EVP_EncodeBlock((unsigned char *)b64, pub, publen);
+	lua_pushfstring(L, "v=DKIM1; k=%s; p=%s", types[type], b64);
+
+	nret = 2;
+sslerr:
+	free(b64);
+	free(pub);
+	BIO_free(bio);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_CTX_free(pctx);
+
+	if (!nret)
+		return auxL_pushstat(L, DKIM_STAT_INTERNAL, "~$#");
+
+	return nret;
+} /* opendkim_genkey() */
+#endif
+
+static int opendkim_monotime(lua_State *L) {
+	lua_pushnumber(L, aux_monotime());
+
+	return 1;
+} /* opendkim_monotime() */
+
 static int opendkim_getresultstr(lua_State *L) {
-	lua_pushstring(L, dkim_getresultstr(luaL_checkinteger(L, 1)));
+	auxL_pushresultstr(L, luaL_checkinteger(L, 1));
 
 	return 1;
 } /* opendkim_getresultstr() */
 
 static int opendkim_sig_geterrorstr(lua_State *L) {
-	lua_pushstring(L, dkim_sig_geterrorstr(luaL_checkinteger(L, 1)));
+	auxL_pushsigerrorstr(L, luaL_checkinteger(L, 1));
 
 	return 1;
 } /* opendkim_sig_geterrorstr() */
@@ -2234,6 +7547,239 @@ static int opendkim_mail_parse_multi(lua_State *L) {
 } /* opendkim_mail_parse_multi() */
 #endif
 
+struct opendkim_keydb_rec {
+	char name[AUX_KEYDB_MAXNAME];
+	size_t namelen;
+	const char *txt;
+	size_t txtlen;
+	uint32_t bucket;
+	uint32_t offset;
+}; /* struct opendkim_keydb_rec */
+
+static int opendkim_keydb_cmp(const void *a, const void *b) {
+	const struct opendkim_keydb_rec *const *x = a, *const *y = b;
+
+	return ((*x)->bucket > (*y)->bucket) - ((*x)->bucket < (*y)->bucket);
+} /* opendkim_keydb_cmp() */
+
+static int opendkim_keydb_namecmp(const void *a, const void *b) {
+	const struct opendkim_keydb_rec *const *x = a, *const *y = b;
+
+	return strcmp((*x)->name, (*y)->name);
+} /* opendkim_keydb_namecmp() */
+
+struct opendkim_keydb_range {
+	size_t first, count;
+	uint32_t bucket;
+}; /* struct opendkim_keydb_range */
+
+static int opendkim_keydb_rangecmp(const void *a, const void *b) {
+	const struct opendkim_keydb_range *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+} /* opendkim_keydb_rangecmp() */
+
+/*
+ * Assign a displacement to each bucket, largest buckets first, such that
+ * every record lands in a distinct slot. Returns 0 on success, or -1 if
+ * some bucket couldn't be placed and the table should be enlarged.
+ */
+static int opendkim_keydb_place(struct opendkim_keydb_rec **order, struct opendkim_keydb_range *range, size_t nranges, uint32_t *disp, uint32_t *slot, uint32_t nslots, unsigned char *taken) {
+	size_t r, i, j;
+	uint32_t d, s[16];
+
+	memset(taken, 0, nslots);
+
+	for (r = 0; r < nranges; r++) {
+		struct opendkim_keydb_range *rg = &range[r];
+
+		if (rg->count > sizeof s / sizeof *s)
+			return -1;
+
+		for (d = 0; d < AUX_KEYDB_MAXDISP; d++) {
+			for (i = 0; i < rg->count; i++) {
+				struct opendkim_keydb_rec *rec = order[rg->first + i];
+
+				s[i] = aux_keydb_hash(d + 1, rec->name, rec->namelen) % nslots;
+
+				if (taken[s[i]])
+					break;
+
+				for (j = 0; j < i && s[j] != s[i]; j++)
+					;
+
+				if (j < i)
+					break;
+			}
+
+			if (i == rg->count)
+				break;
+		}
+
+		if (d == AUX_KEYDB_MAXDISP)
+			return -1;
+
+		disp[rg->bucket] = d;
+
+		for (i = 0; i < rg->count; i++) {
+			taken[s[i]] = 1;
+			slot[s[i]] = order[rg->first + i]->offset;
+		}
+	}
+
+	return 0;
+} /* opendkim_keydb_place() */
+
+/*
+ * opendkim.keydb_build(path, records) - Compile a table of query name =>
+ * TXT record into a key database for lib:set_key_db. The file is written
+ * to a temporary path and renamed into place, so processes which have the
+ * previous file mapped are unaffected.
+ */
+static int opendkim_keydb_build(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	struct aux_keydb_header hdr;
+	struct opendkim_keydb_rec *rec, **order;
+	struct opendkim_keydb_range *range;
+	size_t n = 0, nranges, i, off;
+	uint32_t nbuckets, nslots, *disp, *slot;
+	unsigned char *taken;
+	static const char pad[4];
+	char *tmp;
+	FILE *fp = NULL;
+	int error, try;
+
+	lua_settop(L, 2);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	for (lua_pushnil(L); lua_next(L, 2); lua_pop(L, 1))
+		n++;
+
+	if (n >= UINT32_MAX / 4)
+		return auxL_pusherror(L, EOVERFLOW, "~$#");
+
+	rec = lua_newuserdata(L, sizeof *rec * (n + 1));
+	order = lua_newuserdata(L, sizeof *order * (n + 1));
+	range = lua_newuserdata(L, sizeof *range * (n + 1));
+
+	i = 0;
+
+	for (lua_pushnil(L); lua_next(L, 2); lua_pop(L, 1)) {
+		size_t len;
+		const char *name;
+
+		luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING, 2, "expected table of string => string");
+
+		name = lua_tolstring(L, -2, &len);
+
+		if (!(rec[i].namelen = aux_keydb_normalize(rec[i].name, name, len)))
+			return luaL_argerror(L, 2, lua_pushfstring(L, "%s: invalid query name", name));
+
+		rec[i].txt = lua_tolstring(L, -1, &rec[i].txtlen); /* anchored by table */
+
+		if (rec[i].txtlen >= UINT32_MAX / 2)
+			return auxL_pusherror(L, EOVERFLOW, "~$#");
+
+		order[i] = &rec[i];
+		i++;
+	}
+
+	/* keys distinct in Lua may still normalize to the same name */
+	qsort(order, n, sizeof *order, &opendkim_keydb_namecmp);
+
+	for (i = 1; i < n; i++) {
+		if (!strcmp(order[i]->name, order[i - 1]->name))
+			return luaL_argerror(L, 2, lua_pushfstring(L, "%s: duplicate query name", order[i]->name));
+	}
+
+	nbuckets = n / 2 + 1;
+	nslots = n + n / 4 + 1;
+
+	for (try = 0; ; try++) {
+		if (try >= 8 || nslots >= UINT32_MAX / 8)
+			return auxL_pusherror(L, ERANGE, "~$#");
+
+		disp = lua_newuserdata(L, sizeof *disp * nbuckets);
+		slot = lua_newuserdata(L, sizeof *slot * nslots);
+		taken = lua_newuserdata(L, nslots);
+		memset(disp, 0, sizeof *disp * nbuckets);
+		memset(slot, 0, sizeof *slot * nslots);
+
+		/* lay out records after the index */
+		off = sizeof hdr + sizeof *disp * ((size_t)nbuckets + nslots);
+
+		for (i = 0; i < n; i++) {
+			rec[i].bucket = aux_keydb_hash(0, rec[i].name, rec[i].namelen) % nbuckets;
+			rec[i].offset = off;
+			off += (8 + rec[i].namelen + rec[i].txtlen + 1 + 3) & ~(size_t)3;
+
+			if (off > UINT32_MAX)
+				return auxL_pusherror(L, EOVERFLOW, "~$#");
+		}
+
+		qsort(order, n, sizeof *order, &opendkim_keydb_cmp);
+
+		for (i = 0, nranges = 0; i < n; i++) {
+			if (i == 0 || order[i]->bucket != order[i - 1]->bucket) {
+				range[nranges].first = i;
+				range[nranges].count = 0;
+				range[nranges].bucket = order[i]->bucket;
+				nranges++;
+			}
+
+			range[nranges - 1].count++;
+		}
+
+		qsort(range, nranges, sizeof *range, &opendkim_keydb_rangecmp);
+
+		if (0 == opendkim_keydb_place(order, range, nranges, disp, slot, nslots, taken))
+			break;
+
+		lua_pop(L, 3);
+		nslots += nslots / 2;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, AUX_KEYDB_MAGIC, sizeof hdr.magic);
+	hdr.byteorder = AUX_KEYDB_BYTEORDER;
+	hdr.nbuckets = nbuckets;
+	hdr.nslots = nslots;
+	hdr.nrecords = n;
+
+	if (!(fp = aux_tmpopen(&tmp, path)))
+		goto syerr;
+
+	if (1 != fwrite(&hdr, sizeof hdr, 1, fp)
+	||  nbuckets != fwrite(disp, sizeof *disp, nbuckets, fp)
+	||  nslots != fwrite(slot, sizeof *slot, nslots, fp))
+		goto syerr;
+
+	for (i = 0; i < n; i++) {
+		uint32_t len[2] = { rec[i].namelen, rec[i].txtlen };
+		size_t reclen = 8 + rec[i].namelen + rec[i].txtlen + 1;
+
+		if (1 != fwrite(len, sizeof len, 1, fp)
+		||  rec[i].namelen != fwrite(rec[i].name, 1, rec[i].namelen, fp)
+		||  rec[i].txtlen != fwrite(rec[i].txt, 1, rec[i].txtlen, fp)
+		||  ((reclen + 3) & ~(size_t)3) - reclen + 1 != fwrite(pad, 1, ((reclen + 3) & ~(size_t)3) - reclen + 1, fp))
+			goto syerr;
+	}
+
+	if ((error = aux_tmpcommit(fp, tmp, path)))
+		return auxL_pusherror(L, error, "~$#");
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+syerr:
+	error = errno;
+
+	if (fp)
+		aux_tmpabort(fp, tmp);
+
+	return auxL_pusherror(L, error, "~$#");
+} /* opendkim_keydb_build() */
+
 static int opendkim_interpose(lua_State *L) {
 	lua_settop(L, 3);
 
@@ -2290,11 +7836,16 @@ static luaL_Reg opendkim_globals[] = {
 	{ "init", opendkim_init },
 	{ "libversion", opendkim_libversion },
 	{ "ssl_version", opendkim_ssl_version },
+	{ "monotime", opendkim_monotime },
 	{ "getresultstr", opendkim_getresultstr },
 	{ "sig_geterrorstr", opendkim_sig_geterrorstr },
 	{ "mail_parse", opendkim_mail_parse },
 #if 0 /* not declared in dkim.h */
 	{ "mail_parse_multi", opendkim_mail_parse_multi },
+#endif
+	{ "keydb_build", opendkim_keydb_build },
+#if HAVE_OPENSSL
+	{ "genkey", opendkim_genkey },
 #endif
 	{ "interpose", opendkim_interpose },
 	{ "band", opendkim_band },
@@ -2311,6 +7862,196 @@ static struct {
 #include "opendkim-const.h"
 };
 
+/* status codes synthesized by the binding */
+static const struct {
+	const char *name;
+	lua_Integer value;
+	const char *reason;
+} opendkim_xstat[] = {
+	{ "DKIM_STAT_TIMEOUT", DKIM_STAT_TIMEOUT, "deadline exceeded" },
+	{ "DKIM_STAT_MAXSIGS", DKIM_STAT_MAXSIGS, "too many signatures" },
+	{ "DKIM_STAT_MAXHDRBYTES", DKIM_STAT_MAXHDRBYTES, "header too large" },
+	{ "DKIM_STAT_MAXHDRS", DKIM_STAT_MAXHDRS, "too many header fields" },
+	{ "DKIM_STAT_MAXLOOKUPS", DKIM_STAT_MAXLOOKUPS, "too many key lookups" },
+};
+
+/* keep in sync with the prefix list in Rules.mk */
+static const char *const opendkim_prefix[] = {
+	"DKIM_STAT_", "DKIM_CBSTAT_", "DKIM_SIGERROR_", "DKIM_DNS_",
+	"DKIM_CANON_", "DKIM_SIGN_", "DKIM_QUERY_", "DKIM_PARAM_",
+	"DKIM_MODE_", "DKIM_OP_", "DKIM_OPTS_", "DKIM_LIBFLAGS_",
+	"DKIM_DNSSEC_", "DKIM_ATPS_", "DKIM_FEATURE_",
+};
+
+/*
+ * Return the index into opendkim_prefix of the longest prefix of name, or
+ * -1 if none match.
+ */
+static int opendkim_prefixof(const char *name) {
+	size_t i, len, best = 0;
+	int found = -1;
+
+	for (i = 0; i < sizeof opendkim_prefix / sizeof *opendkim_prefix; i++) {
+		len = strlen(opendkim_prefix[i]);
+
+		if (len > best && !strncmp(name, opendkim_prefix[i], len)) {
+			best = len;
+			found = i;
+		}
+	}
+
+	return found;
+} /* opendkim_prefixof() */
+
+/*
+ * Build core.names, mapping each constant prefix (without the leading
+ * DKIM_ and trailing underscore) to a table of value => suffix name. Where
+ * several macros share a value the first one listed wins. Also intern the
+ * DKIM_STAT and DKIM_SIGERROR reason strings.
+ */
+static void opendkim_names(lua_State *L) {
+	const char *prefix, *name;
+	size_t i;
+	int p;
+
+	lua_newtable(L); /* resultstr */
+	lua_newtable(L); /* sigerrorstr */
+	lua_newtable(L); /* names */
+
+	for (i = 0; i < sizeof opendkim_const / sizeof *opendkim_const; i++) {
+		name = opendkim_const[i].name;
+
+		if (-1 == (p = opendkim_prefixof(name)))
+			continue;
+
+		prefix = opendkim_prefix[p];
+
+		lua_pushlstring(L, prefix + 5, strlen(prefix) - 6);
+		lua_rawget(L, -2);
+
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushlstring(L, prefix + 5, strlen(prefix) - 6);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -4);
+		}
+
+		lua_rawgeti(L, -1, opendkim_const[i].value);
+
+		if (lua_isnil(L, -1)) {
+			lua_pushstring(L, name + strlen(prefix));
+			lua_rawseti(L, -3, opendkim_const[i].value);
+		}
+
+		lua_pop(L, 2);
+
+		if (!strcmp(prefix, "DKIM_STAT_")) {
+			lua_pushstring(L, dkim_getresultstr(opendkim_const[i].value));
+			lua_rawseti(L, -4, opendkim_const[i].value);
+		} else if (!strcmp(prefix, "DKIM_SIGERROR_")) {
+			lua_pushstring(L, dkim_sig_geterrorstr(opendkim_const[i].value));
+			lua_rawseti(L, -3, opendkim_const[i].value);
+		}
+	}
+
+	lua_getfield(L, -1, "STAT");
+
+	for (i = 0; i < sizeof opendkim_xstat / sizeof *opendkim_xstat; i++) {
+		lua_pushstring(L, opendkim_xstat[i].name + strlen("DKIM_STAT_"));
+		lua_rawseti(L, -2, opendkim_xstat[i].value);
+		lua_pushstring(L, opendkim_xstat[i].reason);
+		lua_rawseti(L, -5, opendkim_xstat[i].value);
+	}
+
+	lua_pop(L, 1);
+
+	lua_setfield(L, -4, "names");
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &auxL_sigerrorstr);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &auxL_resultstr);
+} /* opendkim_names() */
+
+
+/*
+ * C  M O D U L E  I N T E R F A C E
+ *
+ * See opendkim-lua.h.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static DKIM *opendkim_api_todkim(lua_State *L, int index) {
+	DKIM_State *dkim = luaL_testudata(L, index, "DKIM*");
+
+	if (!dkim || !dkim->ctx)
+		return NULL;
+
+	if (DKIM_STAT_OK != DKIM_flush(dkim))
+		return NULL;
+
+	dkim->bodybuf.size = 0;
+
+	return dkim->ctx;
+} /* opendkim_api_todkim() */
+
+static DKIM_LIB *opendkim_api_tolib(lua_State *L, int index) {
+	DKIM_LIB_State *lib = luaL_testudata(L, index, "DKIM_LIB*");
+
+	return (lib)? lib->ctx : NULL;
+} /* opendkim_api_tolib() */
+
+static int opendkim_api_set_key_lookup(lua_State *L, int index, opendkim_lua_key_lookup_f *f, void *arg) {
+	DKIM_LIB_State *lib = luaL_testudata(L, index, "DKIM_LIB*");
+
+	if (!lib || !lib->ctx)
+		return EINVAL;
+
+	lib->native.key_lookup.f = f;
+	lib->native.key_lookup.arg = arg;
+
+	DKIM_LIB_hook_key_lookup(lib);
+
+	return 0;
+} /* opendkim_api_set_key_lookup() */
+
+static int opendkim_api_set_prescreen(lua_State *L, int index, opendkim_lua_siglist_f *f, void *arg) {
+	DKIM_LIB_State *lib = luaL_testudata(L, index, "DKIM_LIB*");
+
+	if (!lib || !lib->ctx)
+		return EINVAL;
+
+	lib->native.prescreen.f = f;
+	lib->native.prescreen.arg = arg;
+
+	DKIM_LIB_hook_prescreen(lib);
+
+	return 0;
+} /* opendkim_api_set_prescreen() */
+
+static int opendkim_api_set_final(lua_State *L, int index, opendkim_lua_siglist_f *f, void *arg) {
+	DKIM_LIB_State *lib = luaL_testudata(L, index, "DKIM_LIB*");
+
+	if (!lib || !lib->ctx)
+		return EINVAL;
+
+	lib->native.final.f = f;
+	lib->native.final.arg = arg;
+
+	if (f)
+		dkim_set_final(lib->ctx, &DKIM_on_final);
+
+	return 0;
+} /* opendkim_api_set_final() */
+
+static const struct opendkim_lua_api opendkim_api = {
+	.abi = OPENDKIM_LUA_ABI,
+	.todkim = &opendkim_api_todkim,
+	.tolib = &opendkim_api_tolib,
+	.set_key_lookup = &opendkim_api_set_key_lookup,
+	.set_prescreen = &opendkim_api_set_prescreen,
+	.set_final = &opendkim_api_set_final,
+}; /* opendkim_api */
+
+
 int luaopen_opendkim_core(lua_State *L) {
 	size_t i;
 
@@ -2326,6 +8067,14 @@ int luaopen_opendkim_core(lua_State *L) {
 	auxL_newmetatable(L, "DKIM_QUERYINFO*", DKIM_QUERYINFO_methods, DKIM_QUERYINFO_metamethods, 0);
 	lua_pop(L, 1);
 
+	auxL_newmetatable(L, "DKIM_KEYSTORE*", DKIM_KEYSTORE_methods, DKIM_KEYSTORE_metamethods, 0);
+	lua_pop(L, 1);
+
+#if HAVE_OPENSSL
+	auxL_newmetatable(L, "DKIM_STAMP*", DKIM_STAMP_methods, DKIM_STAMP_metamethods, 0);
+	lua_pop(L, 1);
+#endif
+
 	luaL_newlib(L, opendkim_globals);
 
 	for (i = 0; i < sizeof opendkim_const / sizeof *opendkim_const; i++) {
@@ -2334,5 +8083,15 @@ int luaopen_opendkim_core(lua_State *L) {
 		lua_settable(L, -3);
 	}
 
+	for (i = 0; i < sizeof opendkim_xstat / sizeof *opendkim_xstat; i++) {
+		lua_pushinteger(L, opendkim_xstat[i].value);
+		lua_setfield(L, -2, opendkim_xstat[i].name);
+	}
+
+	opendkim_names(L);
+
+	lua_pushlightuserdata(L, (void *)&opendkim_api);
+	lua_setfield(L, LUA_REGISTRYINDEX, OPENDKIM_LUA_REGISTRYKEY);
+
 	return 1;
 } /* luaopen_opendkim_core() */
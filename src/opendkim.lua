@@ -67,6 +67,22 @@ core.interpose("DKIM*", "dopending", function (self)
 	return count
 end) -- :dopending
 
+--
+-- Key cache refreshes (see lib:set_key_refresh) are queued while a message
+-- is processed but only issued when the application calls :refresh, so
+-- the message's own result never waits on them.
+--
+core.interpose("DKIM*", "refresh", function (self)
+	local count = -1
+
+	repeat
+		local did = dopending(self:getrefresh())
+		count = count + 1
+	until not did
+
+	return count
+end) -- :refresh
+
 local function iowrap(class, method)
 	local DKIM_STAT_CBTRYAGAIN = core.DKIM_STAT_CBTRYAGAIN
 
@@ -89,6 +105,65 @@ local function iowrap(class, method)
 	end)
 end -- iowrap
 
+--
+-- :header returns a second true value when it has queued a key prefetch
+-- for a DKIM-Signature field. Issue the prefetch callback right away so
+-- the application can start the query while the message is still
+-- arriving.
+--
+local header; header = core.interpose("DKIM*", "header", function (self, ...)
+	local ok, prefetch, stat = header(self, ...)
+
+	if ok then
+		if prefetch then
+			self:dopending()
+		end
+
+		return true
+	end
+
+	return ok, prefetch, stat
+end) -- :header
+
+local header_block; header_block = core.interpose("DKIM*", "header_block", function (self, ...)
+	local pos, prefetch, stat = header_block(self, ...)
+
+	if pos then
+		if prefetch then
+			self:dopending()
+		end
+
+		return pos
+	end
+
+	return pos, prefetch, stat
+end) -- :header_block
+
+--
+-- :pump and the other descriptor and wire data feeders return a third
+-- true value when they've queued a key prefetch, as :header does. On
+-- failure the third value is the status, and a header field skipped for
+-- lib:set_limits adds a fourth, the byte count.
+--
+local function pumpwrap(method)
+	local f; f = core.interpose("DKIM*", method, function (self, ...)
+		local n, why, prefetch, count = f(self, ...)
+
+		if not n then
+			return n, why, prefetch, count
+		elseif prefetch then
+			self:dopending()
+		end
+
+		return n, why, prefetch
+	end)
+end -- pumpwrap
+
+pumpwrap("pump")
+pumpwrap("tee")
+pumpwrap("feed_smtp_data")
+pumpwrap("feed_compressed")
+
 iowrap("DKIM_SIGINFO*", "process")
 iowrap("DKIM*", "sig_process")
 iowrap("DKIM*", "eoh")
@@ -150,6 +225,11 @@ end)
 --
 -- core.strconst - Auxiliary routine to convert constant to string.
 --
+-- core.names is built by the C module and maps each constant prefix to a
+-- table of value => name, so a miss only needs to test one candidate name
+-- per prefix rather than scan every constant.
+--
+local names = core.names
 local cache = {}
 
 function core.strconst(match, c)
@@ -159,9 +239,11 @@ function core.strconst(match, c)
 		return cached
 	end
 
-	for k, v in pairs(core) do
-		if v == c then
-			local name = k:match(match)
+	for prefix, byvalue in pairs(names) do
+		local suffix = byvalue[c]
+
+		if suffix then
+			local name = ("DKIM_" .. prefix .. "_" .. suffix):match(match)
 
 			if name then
 				if not cache[match] then
@@ -0,0 +1,142 @@
+-- ==========================================================================
+-- opendkim/ffi.lua - LuaJIT FFI fast path for lua-opendkim.
+-- --------------------------------------------------------------------------
+-- Copyright (c) 2015 Barracuda Networks, Inc.
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a
+-- copy of this software and associated documentation files (the
+-- "Software"), to deal in the Software without restriction, including
+-- without limitation the rights to use, copy, modify, merge, publish,
+-- distribute, sublicense, and/or sell copies of the Software, and to permit
+-- persons to whom the Software is furnished to do so, subject to the
+-- following conditions:
+--
+-- The above copyright notice and this permission notice shall be included
+-- in all copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+-- OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+-- MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+-- NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+-- DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+-- OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+-- USE OR OTHER DEALINGS IN THE SOFTWARE.
+-- ==========================================================================
+local dkim = require"opendkim"
+local ffi = require"ffi"
+
+--
+-- Requiring this module replaces dkim:header and dkim:body with versions
+-- which call libopendkim through the FFI, so per-line feeding compiles
+-- into JIT traces instead of aborting them on a classic C API call.
+--
+-- Handles are still created and owned by opendkim.core. The raw DKIM
+-- pointer is fetched once per object with dkim:getctx and memoized in a
+-- weak table. Neither dkim_header nor dkim_body invoke callbacks, so no
+-- Lua code ever runs beneath an FFI call. Everything that can--eoh, eom,
+-- chunk and the DNS hooks--stays on the classic path, where the
+-- DKIM_on_* trampolines and the :dopending retry loop work unchanged and
+-- cost one call per message.
+--
+ffi.cdef[[
+typedef struct DKIM DKIM;
+typedef int DKIM_STAT;
+
+DKIM_STAT dkim_header(DKIM *, const char *, size_t);
+DKIM_STAT dkim_body(DKIM *, const char *, size_t);
+]]
+
+-- libopendkim is already mapped by opendkim.core, so this binds the same
+-- instance rather than loading a second copy.
+local C = ffi.load(os.getenv"OPENDKIM_FFI_LIBRARY" or "opendkim")
+
+local DKIM_STAT_OK = dkim.DKIM_STAT_OK
+local getresultstr = dkim.getresultstr
+local byte = string.byte
+
+local ctxof = setmetatable({}, { __mode = "k" })
+local limited = setmetatable({}, { __mode = "k" })
+
+-- bumped by lib:set_limits, so each object rechecks its limits
+local generation = 0
+local checked = setmetatable({}, { __mode = "k" })
+
+local function getctx(self)
+	local ctx = ctxof[self]
+
+	if not ctx then
+		-- the C coalescing buffer would reorder body data fed here
+		assert(self:set_body_buffer(0))
+
+		ctx = ffi.cast("DKIM *", (self:getctx()))
+		ctxof[self] = ctx
+	end
+
+	if checked[self] ~= generation then
+		local _, haslimits = self:getctx()
+
+		limited[self] = haslimits or nil
+		checked[self] = generation
+	end
+
+	return ctx, limited[self]
+end -- getctx
+
+local function pushstat(stat)
+	return false, getresultstr(stat), stat
+end -- pushstat
+
+local close; close = dkim.interpose("DKIM*", "close", function (self, ...)
+	ctxof[self] = nil
+	limited[self] = nil
+	checked[self] = nil
+
+	return close(self, ...)
+end) -- :close
+
+local set_limits; set_limits = dkim.interpose("DKIM_LIB*", "set_limits", function (self, ...)
+	generation = generation + 1
+
+	return set_limits(self, ...)
+end) -- :set_limits
+
+--
+-- DKIM-Signature fields go through the classic path, which queues key
+-- prefetches (see :header in opendkim.lua), as does everything when
+-- lib:set_limits is counting header fields.
+--
+local header; header = dkim.interpose("DKIM*", "header", function (self, hdr)
+	local c = byte(hdr, 1)
+
+	if c == 68 or c == 100 then -- D or d
+		if hdr:sub(1, 14):lower() == "dkim-signature" then
+			return header(self, hdr)
+		end
+	end
+
+	local ctx, haslimits = getctx(self)
+
+	if haslimits then
+		return header(self, hdr)
+	end
+
+	local stat = C.dkim_header(ctx, hdr, #hdr)
+
+	if stat ~= DKIM_STAT_OK then
+		return pushstat(stat)
+	end
+
+	return true
+end) -- :header
+
+dkim.interpose("DKIM*", "body", function (self, chunk)
+	local stat = C.dkim_body(getctx(self), chunk, #chunk)
+
+	if stat ~= DKIM_STAT_OK then
+		return pushstat(stat)
+	end
+
+	return true
+end) -- :body
+
+return dkim